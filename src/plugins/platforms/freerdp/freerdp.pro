@@ -64,6 +64,13 @@ QMAKE_CXXFLAGS += -DFREERDP_SETTINGS_INTERNAL_USE
 
 SOURCES += main.cpp 				\
 		qfreerdpcompositor.cpp      \
+		qfreerdptilecompare.cpp     \
+		qfreerdpmotion.cpp          \
+		qfreerdptilebitmap.cpp      \
+		qfreerdptileclassifier.cpp  \
+		qfreerdpegfxcache.cpp       \
+		qfreerdpencoder.cpp         \
+		qfreerdpbandwidth.cpp       \
 		qfreerdpclipboard.cpp       \
 		qfreerdpplatform.cpp 		\
 		qfreerdplistener.cpp 		\
@@ -72,6 +79,7 @@ SOURCES += main.cpp 				\
 		qfreerdpwindow.cpp			\
 		qfreerdppeer.cpp			\
 		qfreerdppeerclipboard.cpp	\
+		qfreerdppeerrail.cpp		\
 		qfreerdpwindowmanager.cpp	\
 		qfreerdpwmwidgets.cpp 		\
 		xcursors/xcursor.cpp        \
@@ -80,6 +88,13 @@ SOURCES += main.cpp 				\
 
 HEADERS += main.h \
 	qfreerdpcompositor.h \
+	qfreerdptilecompare.h \
+	qfreerdpmotion.h \
+	qfreerdptilebitmap.h \
+	qfreerdptileclassifier.h \
+	qfreerdpegfxcache.h \
+	qfreerdpencoder.h \
+	qfreerdpbandwidth.h \
 	qfreerdpplatform.h \
 	qfreerdplistener.h \
 	qfreerdpclipboard.h \
@@ -88,6 +103,7 @@ HEADERS += main.h \
 	qfreerdpwindow.h \
 	qfreerdppeer.h \
 	qfreerdppeerclipboard.h	\
+	qfreerdppeerrail.h \
 	qfreerdpwindowmanager.h \
 	qfreerdpwmwidgets.h \
 	xcursors/cursor-data.h \
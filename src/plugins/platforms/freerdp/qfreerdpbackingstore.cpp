@@ -52,6 +52,10 @@ void QFreeRdpBackingStore::flush(QWindow *window, const QRegion &region, const Q
     mPlatform->mWindowManager->pushDirtyArea(
     		region.translated(window->geometry().topLeft())
 	);
+
+    // RemoteApp peers send windows on surfaces of their own
+    if (mPlatform->config()->rail_enabled)
+    	mPlatform->notifyWindowContent(window, region);
 }
 
 void QFreeRdpBackingStore::resize(const QSize &size, const QRegion &staticContents)
@@ -0,0 +1,282 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <algorithm>
+
+#include "qfreerdpbandwidth.h"
+
+QT_BEGIN_NAMESPACE
+
+/** how long throughput and round trip samples are remembered, in milliseconds */
+#define BANDWIDTH_WINDOW 10000
+
+/** smaller transfers are dominated by the latency and the scheduling noise */
+#define MIN_SAMPLE_BYTES 8192
+
+/** shortest write or delivery time giving a throughput sample, in milliseconds */
+#define MIN_SAMPLE_DURATION 2
+
+/** interval of the send rate samples of the transport, in milliseconds */
+#define TRANSPORT_SAMPLE_INTERVAL 1000
+
+/** share of the link a frame may use, in percent */
+#define BUDGET_LINK_SHARE 80
+
+/** smallest frame budget, so that the screen always makes progress */
+#define MIN_FRAME_BUDGET 16384
+
+/** frames unacknowledged for that long are not counted in flight anymore */
+#define FRAME_IN_FLIGHT_TIMEOUT 2000
+
+QFreeRdpBandwidthEstimator::QFreeRdpBandwidthEstimator()
+{
+	reset();
+}
+
+void QFreeRdpBandwidthEstimator::reset() {
+	mFramesInFlight.clear();
+	mBytesInFlight = 0;
+	mLastAck = -1;
+	mSamples.clear();
+	mBandwidth = 0;
+	mRttSamples.clear();
+	mRtt = -1;
+	mTransportBytes = 0;
+	mTransportTime = -1;
+
+	// until measured, planar content is about half the raw size
+	mBytesPerPixel[ENCODING_LOSSLESS] = 2.0;
+	mBytesPerPixel[ENCODING_LOSSY] = 0.5;
+}
+
+void QFreeRdpBandwidthEstimator::frameSent(quint32 frameId, quint64 bytes, qint64 now) {
+	for (auto it = mFramesInFlight.begin(); it != mFramesInFlight.end(); ) {
+		if (now - it->sent > FRAME_IN_FLIGHT_TIMEOUT) {
+			mBytesInFlight -= it->bytes;
+			it = mFramesInFlight.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	mFramesInFlight.insert(frameId, FrameInFlight{ bytes, now });
+	mBytesInFlight += bytes;
+}
+
+void QFreeRdpBandwidthEstimator::frameAcked(quint32 frameId, qint64 now) {
+	auto it = mFramesInFlight.find(frameId);
+	if (it == mFramesInFlight.end())
+		return;
+
+	FrameInFlight frame = *it;
+	mFramesInFlight.erase(it);
+	mBytesInFlight -= frame.bytes;
+
+	// the frame went on the link after the previous one was delivered, and the
+	// acknowledge came back a round trip after its delivery
+	qint64 duration = now - frame.sent - qMax(mRtt, 0);
+	if (mLastAck >= 0)
+		duration = qMin(duration, now - mLastAck);
+	mLastAck = now;
+
+	if (frame.bytes >= MIN_SAMPLE_BYTES) {
+		if (duration >= MIN_SAMPLE_DURATION)
+			addSample(frame.bytes * 1000 / duration, now);
+	} else {
+		// small frames travel as fast as the link allows, their acknowledge
+		// is a round trip (plus the decoding time)
+		rttMeasured(int(now - frame.sent), now);
+	}
+}
+
+void QFreeRdpBandwidthEstimator::dropFramesInFlight() {
+	mFramesInFlight.clear();
+	mBytesInFlight = 0;
+	mLastAck = -1;
+}
+
+void QFreeRdpBandwidthEstimator::writeCompleted(quint64 bytes, qint64 duration, qint64 now) {
+	if (bytes >= MIN_SAMPLE_BYTES && duration >= MIN_SAMPLE_DURATION)
+		addSample(bytes * 1000 / duration, now);
+}
+
+void QFreeRdpBandwidthEstimator::transportSent(quint64 totalBytes, qint64 now) {
+	if (mTransportTime < 0 || totalBytes < mTransportBytes) {
+		mTransportBytes = totalBytes;
+		mTransportTime = now;
+		return;
+	}
+
+	qint64 elapsed = now - mTransportTime;
+	if (elapsed < TRANSPORT_SAMPLE_INTERVAL)
+		return;
+
+	quint64 sent = totalBytes - mTransportBytes;
+	if (sent >= MIN_SAMPLE_BYTES)
+		addSample(sent * 1000 / elapsed, now);
+
+	mTransportBytes = totalBytes;
+	mTransportTime = now;
+}
+
+void QFreeRdpBandwidthEstimator::rttMeasured(int rtt, qint64 now) {
+	while (!mRttSamples.isEmpty() && (now - mRttSamples.first().time > BANDWIDTH_WINDOW))
+		mRttSamples.removeFirst();
+	mRttSamples.append(Sample{ now, quint64(qMax(rtt, 0)) });
+
+	quint64 best = mRttSamples.first().bytesPerSecond;
+	for (const Sample &sample : mRttSamples)
+		best = qMin(best, sample.bytesPerSecond);
+	mRtt = int(best);
+}
+
+void QFreeRdpBandwidthEstimator::bandwidthMeasured(quint64 kbps, qint64 now) {
+	if (kbps)
+		addSample(kbps * 1000 / 8, now);
+}
+
+void QFreeRdpBandwidthEstimator::encoded(EncodingKind kind, quint64 pixels, quint64 bytes) {
+	if (!pixels)
+		return;
+
+	double ratio = double(bytes) / double(pixels);
+	mBytesPerPixel[kind] = (3 * mBytesPerPixel[kind] + ratio) / 4;
+}
+
+void QFreeRdpBandwidthEstimator::addSample(quint64 bytesPerSecond, qint64 now) {
+	while (!mSamples.isEmpty() && (now - mSamples.first().time > BANDWIDTH_WINDOW))
+		mSamples.removeFirst();
+	mSamples.append(Sample{ now, bytesPerSecond });
+
+	// the upper median, the list keeps its capacity from one sample to the next
+	mSortedRates.clear();
+	for (const Sample &sample : mSamples)
+		mSortedRates.append(sample.bytesPerSecond);
+	auto median = mSortedRates.begin() + mSortedRates.size() / 2;
+	std::nth_element(mSortedRates.begin(), median, mSortedRates.end());
+	mBandwidth = *median;
+}
+
+quint64 QFreeRdpBandwidthEstimator::frameBudget(int frameInterval) const {
+	if (!mBandwidth)
+		return 0;
+
+	quint64 budget = mBandwidth * frameInterval / 1000 * BUDGET_LINK_SHARE / 100;
+
+	// what is queued beyond the bandwidth-delay product delays everything
+	// sent after it, input feedback included
+	quint64 bdp = mBandwidth * qMax(mRtt, 0) / 1000;
+	if (mBytesInFlight > bdp) {
+		quint64 backlog = mBytesInFlight - bdp;
+		budget = (budget > backlog) ? budget - backlog : 0;
+	}
+
+	return qMax<quint64>(budget, MIN_FRAME_BUDGET);
+}
+
+#ifdef BUILD_TESTS
+#include "tests/qfreerdptestharness.h"
+
+#include <QTest>
+
+void QFreeRdpTest::bandwidthTestEstimate() {
+	QFreeRdpBandwidthEstimator estimator;
+	QCOMPARE(estimator.bandwidth(), quint64(0));
+	QCOMPARE(estimator.rtt(), -1);
+	QCOMPARE(estimator.frameBudget(40), quint64(0));
+
+	// a 1MB/s link with a 20ms round trip, offered 100KB every 40ms
+	estimator.rttMeasured(20, 0);
+	qint64 linkFree = 0;
+	for (int i = 0; i < 10; i++) {
+		qint64 sent = i * 40;
+		estimator.frameSent(i, 100000, sent);
+
+		linkFree = qMax(linkFree, sent) + 100;
+		if (i < 7)
+			estimator.frameAcked(i, linkFree + 20);
+	}
+	QCOMPARE(estimator.bandwidth(), quint64(1000000));
+	QCOMPARE(estimator.rtt(), 20);
+	QCOMPARE(estimator.bytesInFlight(), quint64(300000));
+
+	// the frames queued on the link leave only the minimal budget
+	QCOMPARE(estimator.frameBudget(40), quint64(16384));
+
+	for (int i = 7; i < 10; i++)
+		estimator.frameAcked(i, 720 + (i - 6) * 100);
+	QCOMPARE(estimator.bytesInFlight(), quint64(0));
+	QCOMPARE(estimator.frameBudget(40), quint64(32000));
+
+	// unknown frames are ignored
+	estimator.frameAcked(42, 2000);
+	QCOMPARE(estimator.bandwidth(), quint64(1000000));
+}
+
+void QFreeRdpTest::bandwidthTestSources() {
+	QFreeRdpBandwidthEstimator estimator;
+
+	// small or quick writes don't tell anything
+	estimator.writeCompleted(1000, 50, 0);
+	estimator.writeCompleted(100000, 1, 0);
+	QCOMPARE(estimator.bandwidth(), quint64(0));
+
+	// a blocking write does
+	estimator.writeCompleted(100000, 50, 0);
+	QCOMPARE(estimator.bandwidth(), quint64(2000000));
+
+	// the transport rate is measured over a second at least
+	estimator.transportSent(1000000, 100);
+	estimator.transportSent(2000000, 600);
+	QCOMPARE(estimator.bandwidth(), quint64(2000000));
+	estimator.transportSent(4000000, 1100);
+	QCOMPARE(estimator.bandwidth(), quint64(3000000));
+
+	// the median of the recent samples wins, old ones are forgotten
+	estimator.bandwidthMeasured(8000, 2000);
+	QCOMPARE(estimator.bandwidth(), quint64(2000000));
+	estimator.bandwidthMeasured(8000, 12000);
+	QCOMPARE(estimator.bandwidth(), quint64(1000000));
+
+	// the bytes per pixel follow the measures
+	QCOMPARE(estimator.bytesPerPixel(QFreeRdpBandwidthEstimator::ENCODING_LOSSLESS), 2.0);
+	estimator.encoded(QFreeRdpBandwidthEstimator::ENCODING_LOSSLESS, 1000, 1000);
+	QCOMPARE(estimator.bytesPerPixel(QFreeRdpBandwidthEstimator::ENCODING_LOSSLESS), 1.75);
+	QCOMPARE(estimator.bytesPerPixel(QFreeRdpBandwidthEstimator::ENCODING_LOSSY), 0.5);
+}
+
+void QFreeRdpTest::bandwidthTestOutlier() {
+	QFreeRdpBandwidthEstimator estimator;
+
+	// blocking writes on a 1MB/s link
+	for (int i = 0; i < 5; i++)
+		estimator.writeCompleted(100000, 100, i * 100);
+	QCOMPARE(estimator.bandwidth(), quint64(1000000));
+
+	// a short write that landed in free socket buffer doesn't change the budget
+	estimator.writeCompleted(100000, 2, 500);
+	QCOMPARE(estimator.bandwidth(), quint64(1000000));
+	QCOMPARE(estimator.frameBudget(40), quint64(32000));
+}
+
+#endif // BUILD_TESTS
+
+QT_END_NAMESPACE
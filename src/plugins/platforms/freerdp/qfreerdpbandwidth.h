@@ -0,0 +1,147 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __QFREERDPBANDWIDTH_H__
+#define __QFREERDPBANDWIDTH_H__
+
+#include <QHash>
+#include <QVector>
+#include <QtGlobal>
+
+QT_BEGIN_NAMESPACE
+
+/**
+ * @brief estimates the throughput of the link to a peer
+ *
+ * Throughput samples come from the delivery of the frames (bytes of a frame
+ * over the time the client took to acknowledge it, once the round trip is
+ * removed), from the time spent writing to the socket, from the send rate of
+ * the transport and from the measures of the RDP network autodetection. The
+ * estimate is the median of the samples of the last few seconds: a write that
+ * lands in free socket buffer gives a rate far above the link, and a single
+ * sample like that must not set the budget of the following frames.
+ *
+ * The estimate gives the number of bytes a frame may use: a share of what the
+ * link carries during a frame interval, minus what is still queued beyond the
+ * bandwidth-delay product.
+ */
+class QFreeRdpBandwidthEstimator {
+public:
+	/** @brief kind of encoding, whose size per pixel is learnt separately */
+	enum EncodingKind {
+		ENCODING_LOSSLESS,
+		ENCODING_LOSSY,
+		ENCODING_KIND_COUNT
+	};
+
+	QFreeRdpBandwidthEstimator();
+
+	/** Forgets all the measures */
+	void reset();
+
+	/**
+	 * Records a frame sent to the client, its delivery is known once it is
+	 * acknowledged.
+	 *
+	 * @param frameId id of the frame
+	 * @param bytes size of the encoded content of the frame
+	 * @param now time of the sending, in milliseconds
+	 */
+	void frameSent(quint32 frameId, quint64 bytes, qint64 now);
+
+	/** Records the acknowledge of a frame by the client */
+	void frameAcked(quint32 frameId, qint64 now);
+
+	/** Forgets the frames waiting for an acknowledge, that won't come */
+	void dropFramesInFlight();
+
+	/**
+	 * Records the time it took to write some bytes to the socket, a write
+	 * that blocks shows the throughput of the link.
+	 */
+	void writeCompleted(quint64 bytes, qint64 duration, qint64 now);
+
+	/**
+	 * Records the total number of bytes written by the transport, the send
+	 * rate is computed over intervals of at least TRANSPORT_SAMPLE_INTERVAL.
+	 */
+	void transportSent(quint64 totalBytes, qint64 now);
+
+	/** Records a round trip time measured by the network autodetection, in milliseconds */
+	void rttMeasured(int rtt, qint64 now);
+
+	/** Records a bandwidth measured by the network autodetection, in kilobits per second */
+	void bandwidthMeasured(quint64 kbps, qint64 now);
+
+	/** Records the size of an encoded area, to learn the bytes per pixel of the codecs */
+	void encoded(EncodingKind kind, quint64 pixels, quint64 bytes);
+
+	/** @return the estimated size of one pixel with a kind of encoding */
+	double bytesPerPixel(EncodingKind kind) const { return mBytesPerPixel[kind]; }
+
+	/** @return the estimated throughput in bytes per second, 0 if unknown */
+	quint64 bandwidth() const { return mBandwidth; }
+
+	/** @return the smallest round trip time seen lately in milliseconds, -1 if unknown */
+	int rtt() const { return mRtt; }
+
+	/** @return the bytes of the frames sent and not acknowledged yet */
+	quint64 bytesInFlight() const { return mBytesInFlight; }
+
+	/**
+	 * @param frameInterval time between two frames, in milliseconds
+	 * @return the number of bytes the next frame may use, 0 for no limit
+	 */
+	quint64 frameBudget(int frameInterval) const;
+
+protected:
+	void addSample(quint64 bytesPerSecond, qint64 now);
+
+	/** @brief a frame waiting for its acknowledge */
+	struct FrameInFlight {
+		quint64 bytes;
+		qint64 sent;
+	};
+	QHash<quint32, FrameInFlight> mFramesInFlight;
+	quint64 mBytesInFlight;
+	qint64 mLastAck;
+
+	/** @brief a throughput measure */
+	struct Sample {
+		qint64 time;
+		quint64 bytesPerSecond;
+	};
+	QVector<Sample> mSamples;
+	QVector<quint64> mSortedRates;
+	quint64 mBandwidth;
+
+	QVector<Sample> mRttSamples;
+	int mRtt;
+
+	quint64 mTransportBytes;
+	qint64 mTransportTime;
+
+	double mBytesPerPixel[ENCODING_KIND_COUNT];
+};
+
+QT_END_NAMESPACE
+
+#endif // __QFREERDPBANDWIDTH_H__
@@ -21,13 +21,33 @@
  */
 
 #include <memory>
+#include <string.h>
 
+#include <QHash>
 #include <QImage>
+#include <QtAlgorithms>
+#include <QRunnable>
+#include <QThread>
 
 #include "qfreerdpcompositor.h"
 
 #define SHADOW_TILE_SIZE 64
 
+/** minimal number of tiles announced by Qt before comparing on several threads */
+#define PARALLEL_MIN_TILES 48
+
+/** above this number of dirty tiles, whole tiles are reported */
+#define TIGHT_MAX_TILES 256
+
+/** cost of an extra rectangle for the encoders, in pixels */
+#define TIGHT_RECT_COST 256
+
+/** minimal size of a rectangle for the planar codec */
+#define TIGHT_MIN_SIZE 4
+
+/** longest delay in ms between two updates of a tile that is continuously changing */
+#define CHANGING_MAX_INTERVAL 250
+
 #ifdef NDEBUG
 #define DEBUG false
 #else
@@ -36,98 +56,961 @@
 
 QT_BEGIN_NAMESPACE
 
+static int area(const QRect &rect) {
+	return rect.width() * rect.height();
+}
+
 // helper function to get region area in pixels
 static int area(const QRegion &region) {
 	int sz = 0;
 
 	for (const QRect& rect: region)
 	{
-		sz += rect.width() * rect.height();
+		sz += area(rect);
 	}
 
 	return sz;
 }
 
-QFreeRdpCompositor::QFreeRdpCompositor(QFreeRdpScreen *screen) :
+QFreeRdpCompositor::QFreeRdpCompositor(QFreeRdpScreen *screen, DamageMode mode, bool detectMoves) :
         QObject(screen),
-        mScreen(screen) {}
+        mScreen(screen),
+        mMode(mode),
+        mTilesPerRow(0),
+        mGeneration(0),
+        mGenerationTime(0),
+        mDetectMoves(detectMoves),
+        mShadowBits(nullptr),
+        mThreads(1),
+        mCompareKernel(QFreeRdpTileComparator::kernel()) {}
+
+QFreeRdpCompositor::~QFreeRdpCompositor() {
+	mPool.waitForDone();
+	qDeleteAll(mBandJobs);
+}
+
+void QFreeRdpCompositor::setWorkerThreads(int count) {
+	if (count <= 0)
+		count = std::min(QThread::idealThreadCount(), 4);
+
+	// the calling thread takes its share of the work
+	mThreads = std::max(count, 1);
+	mPool.setMaxThreadCount(std::max(mThreads - 1, 1));
+}
 
 void QFreeRdpCompositor::reset(size_t width, size_t height) {
+	mSize = QSize(width, height);
+	mTilesPerRow = (width + SHADOW_TILE_SIZE - 1) / SHADOW_TILE_SIZE;
+	size_t tileRows = (height + SHADOW_TILE_SIZE - 1) / SHADOW_TILE_SIZE;
+
+	// all the tiles are new for the peers
+	mGeneration++;
+	mTileGenerations.assign(mTilesPerRow * tileRows, mGeneration);
+	mTileChangeGenerations.assign(mTilesPerRow * tileRows, 0);
+	mTileStreaks.assign(mTilesPerRow * tileRows, 0);
+	mDamage = QRegion(0, 0, width, height);
+	mMoves.clear();
+	mFills.clear();
+	mDirtyTiles.reset(mSize, SHADOW_TILE_SIZE);
+	if (mDetectMoves)
+		mMotion.reset(mSize);
+
+	if (mMode == DAMAGE_TILE_HASH) {
+		// hashes start with a value that no tile has, so that the first update
+		// of a tile is always considered as dirty
+		mTileHashes.assign(mTilesPerRow * tileRows, 0);
+		mTileBounds.clear();
+		mShadowImage.reset();
+		mShadowBits = nullptr;
+		return;
+	}
+
+	mTileHashes.clear();
+	mTileBounds.assign(mTilesPerRow * tileRows, QRect());
 	mShadowImage = std::make_unique<QImage>(
 		QSize(width, height),
 		QImage::Format_ARGB32_Premultiplied
 	);
 	mShadowImage->fill(Qt::black);
+
+	// fetched once, QImage::bits() is not meant to be called from several threads
+	mShadowBits = mShadowImage->bits();
+}
+
+QRegion QFreeRdpCompositor::changingRegion(int minUpdates) const {
+	QFreeRdpTileBitmap tiles;
+	tiles.reset(mSize, SHADOW_TILE_SIZE);
+
+	for (int index = 0; index < tileCount(); index++) {
+		if ((mTileChangeGenerations[index] == mGeneration) && (mTileStreaks[index] >= minUpdates))
+			tiles.set(index % mTilesPerRow, index / mTilesPerRow);
+	}
+
+	return tiles.toRegion();
+}
+
+QRect QFreeRdpCompositor::tileRect(int index) const {
+	QRect tile((index % mTilesPerRow) * SHADOW_TILE_SIZE, (index / mTilesPerRow) * SHADOW_TILE_SIZE,
+			SHADOW_TILE_SIZE, SHADOW_TILE_SIZE);
+	return tile.intersected(QRect(QPoint(0, 0), mSize));
+}
+
+void QFreeRdpCompositor::newGeneration(const QRegion &dirty, const QFreeRdpMoveList &moves) {
+	if (dirty.isEmpty() && moves.isEmpty())
+		return;
+
+	mGeneration++;
+	mDamage = dirty;
+	mMoves = moves;
+	mFills.clear();
+	findSolidFills(dirty, mFills);
+
+	// a tile keeps changing if it was modified by the previous update, and that
+	// update is recent
+	if (!mClock.isValid())
+		mClock.start();
+	qint64 now = mClock.elapsed();
+	bool recent = (now - mGenerationTime) <= CHANGING_MAX_INTERVAL;
+	mGenerationTime = now;
+
+	for (int ty = 0; ty < mDirtyTiles.tileRows(); ty++) {
+		for (int tx = 0; tx < mDirtyTiles.tilesPerRow(); tx++) {
+			if (!mDirtyTiles.test(tx, ty))
+				continue;
+
+			int index = ty * mTilesPerRow + tx;
+			bool continued = recent && (mTileChangeGenerations[index] == mGeneration - 1);
+			if (!continued)
+				mTileStreaks[index] = 1;
+			else if (mTileStreaks[index] < 0xffff)
+				mTileStreaks[index]++;
+			mTileChangeGenerations[index] = mGeneration;
+		}
+	}
+
+	// the tiles of the moved areas are also modified for peers that can't use moves
+	for (const QFreeRdpMove &move : moves)
+		mDirtyTiles.setRect(move.dstRect());
+
+	for (int ty = 0; ty < mDirtyTiles.tileRows(); ty++) {
+		for (int tx = 0; tx < mDirtyTiles.tilesPerRow(); tx++) {
+			if (mDirtyTiles.test(tx, ty))
+				mTileGenerations[ty * mTilesPerRow + tx] = mGeneration;
+		}
+	}
 }
 
-QRegion QFreeRdpCompositor::qtToRdpDirtyRegion(const QRegion &region) {
+void QFreeRdpCompositor::findSolidFills(const QRegion &region, QFreeRdpFillList &fills) const {
+	const QImage *screenBits = mScreen->getScreenBits();
+	const QRect screenRect = QRect(QPoint(0, 0), mSize).intersected(screenBits->rect());
+	const int stride = screenBits->bytesPerLine();
+
+	// index in fills of the last fill with the given left, width and color,
+	// to merge the fills of consecutive rows
+	QHash<quint64, int> columns;
+	auto addFill = [&](const QFreeRdpFill &fill) {
+		quint64 key = (quint64(fill.rect.left()) << 48) | (quint64(fill.rect.width()) << 32) | fill.color;
+		auto it = columns.find(key);
+		if (it != columns.end() && fills[*it].rect.bottom() + 1 == fill.rect.top()) {
+			fills[*it].rect.setBottom(fill.rect.bottom());
+			return;
+		}
+
+		columns.insert(key, fills.size());
+		fills.append(fill);
+	};
+
+	// rectangles of the region come top to bottom
+	for (const QRect &r : region) {
+		QRect rect = r.intersected(screenRect);
+		if (rect.isEmpty())
+			continue;
+
+		for (int ty = rect.top() / SHADOW_TILE_SIZE; ty <= rect.bottom() / SHADOW_TILE_SIZE; ty++) {
+			QFreeRdpFill run = { QRect(), 0 };
+
+			for (int tx = rect.left() / SHADOW_TILE_SIZE; tx <= rect.right() / SHADOW_TILE_SIZE; tx++) {
+				QRect piece = QRect(tx * SHADOW_TILE_SIZE, ty * SHADOW_TILE_SIZE, SHADOW_TILE_SIZE, SHADOW_TILE_SIZE)
+						.intersected(rect);
+				const uchar *src = screenBits->bits() + (piece.top() * stride) + (piece.left() * 4);
+
+				quint32 color;
+				if (!QFreeRdpTileComparator::isSolid(src, stride, piece.width(), piece.height(), color)) {
+					if (!run.rect.isEmpty())
+						addFill(run);
+					run.rect = QRect();
+					continue;
+				}
+
+				if (!run.rect.isEmpty() && run.color == color) {
+					run.rect.setRight(piece.right());
+				} else {
+					if (!run.rect.isEmpty())
+						addFill(run);
+					run = { piece, color };
+				}
+			}
+
+			if (!run.rect.isEmpty())
+				addFill(run);
+		}
+	}
+}
+
+QRegion QFreeRdpCompositor::qtToRdpDirtyRegion(const QRegion &region, const QFreeRdpMoveList &hints) {
 	QRegion dirty;
+	QFreeRdpMoveList moves;
 	int inSize = 0;
 
+	// follow the screen geometry changes
+	const QImage *screenBits = mScreen->getScreenBits();
+	if (screenBits->size() != mSize)
+		reset(screenBits->width(), screenBits->height());
+
 	inSize += area(region);
 
 	// if Qt compositor has a small enough tile size
 	// do not try to reduce it.
 	if (inSize <= SHADOW_TILE_SIZE) {
+		// the shadow, the tile hashes and the row hashes must still describe
+		// what the peers have
+		for (const QRect &rect : region) {
+			QRect visible = rect.intersected(QRect(QPoint(0, 0), mSize)).intersected(screenBits->rect());
+			if (mShadowImage && !visible.isEmpty())
+				compareTileAndUpdate(visible);
+			if (mMode == DAMAGE_TILE_HASH && !visible.isEmpty()) {
+				for (int ty = visible.top() / SHADOW_TILE_SIZE; ty <= visible.bottom() / SHADOW_TILE_SIZE; ty++)
+					for (int tx = visible.left() / SHADOW_TILE_SIZE; tx <= visible.right() / SHADOW_TILE_SIZE; tx++)
+						hashTileAndUpdate(tileRect(ty * mTilesPerRow + tx));
+			}
+			if (mDetectMoves)
+				mMotion.updateHashes(*screenBits, rect);
+		}
+
+		mDirtyTiles.clear();
+		for (const QRect &rect : region)
+			mDirtyTiles.setRect(rect);
+
+		newGeneration(region, moves);
 		return region;
 	}
 
-	for (const QRect& rect: region)	{
-		dirty += dirtyRegion(rect);
+	// moves that need the previous frame are applied to the shadow before
+	// computing the damage, so that the moved areas are not dirty anymore
+	if (mDetectMoves && mShadowImage) {
+		QFreeRdpMoveList found;
+		for (const QFreeRdpMove &hint : hints) {
+			QFreeRdpMove move;
+			if (mMotion.verifyMove(*screenBits, *mShadowImage, hint, move))
+				found.append(move);
+		}
+
+		for (const QRect &rect : region)
+			mMotion.findHorizontalMoves(*screenBits, *mShadowImage, rect, found);
+
+		for (const QFreeRdpMove &move : found) {
+			QFreeRdpMotionEstimator::applyMove(*mShadowImage, move);
+			mMotion.updateHashes(*mShadowImage, move.dstRect());
+		}
+		moves += found;
+	}
+
+	detectDirtyTiles(region, inSize);
+
+	if (mMode == DAMAGE_SHADOW_IMAGE && mDirtyTiles.count() <= TIGHT_MAX_TILES)
+		dirty = tightRegion();
+	else
+		dirty = mDirtyTiles.toRegion();
+	// only the announced part of the tiles has been compared
+	if (mMode == DAMAGE_SHADOW_IMAGE && !(region.rectCount() == 1 && region.boundingRect().contains(dirty.boundingRect())))
+		dirty &= region;
+
+	// vertical scrolls are found by row hashes, in both modes
+	if (mDetectMoves) {
+		QFreeRdpMoveList scrolls;
+		mMotion.findVerticalMoves(*screenBits, dirty, scrolls);
+		for (const QFreeRdpMove &move : scrolls)
+			dirty -= move.dstRect();
+		moves += scrolls;
 	}
 
 	if (DEBUG) {
 		int outSize = area(dirty);
-		qDebug("%s: gain %d%%", __FUNCTION__, (outSize * 100) / inSize);
+		qDebug("%s: gain %d%%, %d moves", __FUNCTION__, (outSize * 100) / inSize, moves.size());
 	}
 
+	newGeneration(dirty, moves);
 	return dirty;
 }
 
-bool QFreeRdpCompositor::compareTileAndUpdate(const QRect &rect) {
+QRect QFreeRdpCompositor::compareTileAndUpdate(const QRect &rect) {
 	const QImage *srcImg = mScreen->getScreenBits();
 	int SrcStride = srcImg->bytesPerLine();
 	const int bytesPerPixel = 4;
 	const uchar *src = srcImg->bits() + (rect.top() * SrcStride) + (rect.left() * bytesPerPixel);
 
 	int shadowStride = mShadowImage->bytesPerLine();
-	uchar *shadow = mShadowImage->bits() + (rect.top() * shadowStride) + (rect.left() * bytesPerPixel);
-
-	bool ret = false;
-	int tileWidth = rect.width() * bytesPerPixel;
-	for (int y = rect.top(); y <= rect.bottom(); y++, src += SrcStride, shadow += shadowStride) {
-		if (memcmp(src, shadow, tileWidth) != 0) {
-			ret = true;
-			memcpy(shadow, src, tileWidth);
+	uchar *shadow = mShadowBits + (rect.top() * shadowStride) + (rect.left() * bytesPerPixel);
+
+	int left, right;
+	quint64 rows = mCompareKernel(src, SrcStride, shadow, shadowStride, rect.width(), rect.height(), left, right);
+	if (!rows)
+		return QRect();
+
+	int top = qCountTrailingZeroBits(rows);
+	int bottom = 63 - qCountLeadingZeroBits(rows);
+	return QRect(rect.left() + left, rect.top() + top, right - left + 1, bottom - top + 1);
+}
+
+/** Grows rect up to TIGHT_MIN_SIZE in each direction, without leaving clip */
+static void growToMinimumSize(QRect &rect, const QRect &clip) {
+	if (rect.width() < TIGHT_MIN_SIZE) {
+		rect.setRight(std::min(rect.left() + TIGHT_MIN_SIZE - 1, clip.right()));
+		rect.setLeft(std::max(rect.right() - TIGHT_MIN_SIZE + 1, clip.left()));
+	}
+
+	if (rect.height() < TIGHT_MIN_SIZE) {
+		rect.setBottom(std::min(rect.top() + TIGHT_MIN_SIZE - 1, clip.bottom()));
+		rect.setTop(std::max(rect.bottom() - TIGHT_MIN_SIZE + 1, clip.top()));
+	}
+}
+
+QRegion QFreeRdpCompositor::tightRegion() const {
+	QVector<QRect> spans;
+	mDirtyTiles.spans(spans);
+
+	// neighbour tiles of a span are merged when encoding the unchanged pixels
+	// between them costs less than another rectangle
+	QRegion ret;
+	for (const QRect &span : spans) {
+		int ty = span.top() / SHADOW_TILE_SIZE;
+		int first = span.left() / SHADOW_TILE_SIZE;
+		int last = span.right() / SHADOW_TILE_SIZE;
+
+		QRect current = mTileBounds[ty * mTilesPerRow + first];
+		for (int tx = first + 1; tx <= last; tx++) {
+			const QRect &next = mTileBounds[ty * mTilesPerRow + tx];
+			QRect merged = current.united(next);
+			if (area(merged) <= area(current) + area(next) + TIGHT_RECT_COST) {
+				current = merged;
+			} else {
+				ret += current;
+				current = next;
+			}
+		}
+		ret += current;
+	}
+	return ret;
+}
+
+/**
+ * @brief compares a band of tile rows on a worker thread
+ *
+ * Jobs are kept by the compositor from one update to the next, the region is
+ * only referenced until the pool is done.
+ */
+class QFreeRdpTileBandJob : public QRunnable {
+public:
+	QFreeRdpTileBandJob(QFreeRdpCompositor *compositor)
+	: mCompositor(compositor), mRegion(nullptr), mFirstRow(0), mLastRow(-1)
+	{
+		setAutoDelete(false);
+	}
+
+	void setBand(const QRegion *region, int firstRow, int lastRow) {
+		mRegion = region;
+		mFirstRow = firstRow;
+		mLastRow = lastRow;
+	}
+
+	void run() override {
+		mCompositor->detectTiles(*mRegion, mFirstRow, mLastRow);
+	}
+
+protected:
+	QFreeRdpCompositor *mCompositor;
+	const QRegion *mRegion;
+	int mFirstRow;
+	int mLastRow;
+};
+
+void QFreeRdpCompositor::detectDirtyTiles(const QRegion &region, int inSize) {
+	mDirtyTiles.clear();
+
+	QRect bounds = region.boundingRect().intersected(QRect(QPoint(0, 0), mSize));
+	if (bounds.isEmpty())
+		return;
+
+	int firstRow = bounds.top() / SHADOW_TILE_SIZE;
+	int rows = bounds.bottom() / SHADOW_TILE_SIZE - firstRow + 1;
+	int bands = std::min(mThreads, rows);
+	if (bands <= 1 || inSize < PARALLEL_MIN_TILES * SHADOW_TILE_SIZE * SHADOW_TILE_SIZE) {
+		detectTiles(region, firstRow, firstRow + rows - 1);
+		return;
+	}
+
+	while (int(mBandJobs.size()) < bands - 1)
+		mBandJobs.push_back(new QFreeRdpTileBandJob(this));
+
+	// bands never share a row of tiles: workers write distinct words of the
+	// bitmap and distinct rows of the shadow, and the result does not depend
+	// on the scheduling
+	for (int band = 1; band < bands; band++) {
+		QFreeRdpTileBandJob *job = mBandJobs[band - 1];
+		job->setBand(&region, firstRow + (rows * band) / bands, firstRow + (rows * (band + 1)) / bands - 1);
+		mPool.start(job);
+	}
+
+	detectTiles(region, firstRow, firstRow + rows / bands - 1);
+	mPool.waitForDone();
+}
+
+void QFreeRdpCompositor::detectTiles(const QRegion &region, int firstRow, int lastRow) {
+	for (const QRect &rect : region) {
+		if (mMode == DAMAGE_TILE_HASH)
+			hashTiles(rect, firstRow, lastRow);
+		else
+			compareTiles(rect, firstRow, lastRow);
+	}
+}
+
+void QFreeRdpCompositor::compareTiles(const QRect &rect, int firstRow, int lastRow) {
+	// tiles are aligned on the grid and clipped to the announced rect
+	QRect bounds = rect.intersected(QRect(QPoint(0, 0), mSize))
+			.intersected(mScreen->getScreenBits()->rect());
+	if (bounds.isEmpty())
+		return;
+
+	int top = std::max(bounds.top() / SHADOW_TILE_SIZE, firstRow);
+	int bottom = std::min(bounds.bottom() / SHADOW_TILE_SIZE, lastRow);
+	for (int ty = top; ty <= bottom; ty++) {
+		for (int tx = bounds.left() / SHADOW_TILE_SIZE; tx <= bounds.right() / SHADOW_TILE_SIZE; tx++) {
+			QRect tile = QRect(tx * SHADOW_TILE_SIZE, ty * SHADOW_TILE_SIZE, SHADOW_TILE_SIZE, SHADOW_TILE_SIZE)
+					.intersected(bounds);
+			QRect changed = compareTileAndUpdate(tile);
+			if (changed.isEmpty())
+				continue;
+
+			// the bands of a region may cut a tile, changes found by the
+			// previous ones are kept
+			growToMinimumSize(changed, tile);
+			QRect &tileBounds = mTileBounds[ty * mTilesPerRow + tx];
+			tileBounds = mDirtyTiles.test(tx, ty) ? tileBounds.united(changed) : changed;
+			mDirtyTiles.set(tx, ty);
+		}
+	}
+}
+
+bool QFreeRdpCompositor::hashTileAndUpdate(const QRect &tile) {
+	const QImage *srcImg = mScreen->getScreenBits();
+	int srcStride = srcImg->bytesPerLine();
+	const uchar *src = srcImg->bits() + (tile.top() * srcStride) + (tile.left() * 4);
+
+	quint64 hash = QFreeRdpTileComparator::hash(src, srcStride, tile.width(), tile.height());
+	quint64 &stored = mTileHashes[(tile.top() / SHADOW_TILE_SIZE) * mTilesPerRow + (tile.left() / SHADOW_TILE_SIZE)];
+	if (stored == hash)
+		return false;
+
+	stored = hash;
+	return true;
+}
+
+void QFreeRdpCompositor::hashTiles(const QRect &rect, int firstRow, int lastRow) {
+	// hashes are computed on whole tiles, aligned on the tile grid
+	QRect bounds = rect.intersected(QRect(QPoint(0, 0), mSize))
+			.intersected(mScreen->getScreenBits()->rect());
+	if (bounds.isEmpty())
+		return;
+
+	int top = std::max(bounds.top() / SHADOW_TILE_SIZE, firstRow);
+	int bottom = std::min(bounds.bottom() / SHADOW_TILE_SIZE, lastRow);
+	for (int ty = top; ty <= bottom; ty++) {
+		for (int tx = bounds.left() / SHADOW_TILE_SIZE; tx <= bounds.right() / SHADOW_TILE_SIZE; tx++) {
+			if (hashTileAndUpdate(tileRect(ty * mTilesPerRow + tx)))
+				mDirtyTiles.set(tx, ty);
+		}
+	}
+}
+
+QFreeRdpDamageTracker::QFreeRdpDamageTracker()
+: mTilesPerRow(0)
+, mLastGeneration(0)
+, mUpToDate(false)
+{}
+
+void QFreeRdpDamageTracker::reset() {
+	mSentGenerations.clear();
+	mTilesPerRow = 0;
+	mUpToDate = false;
+}
+
+void QFreeRdpDamageTracker::syncGeometry(const QFreeRdpCompositor &compositor) {
+	if (mTilesPerRow == compositor.tilesPerRow() && int(mSentGenerations.size()) == compositor.tileCount())
+		return;
+
+	// the screen has been resized, nothing of the old content is valid
+	mTilesPerRow = compositor.tilesPerRow();
+	mSentGenerations.assign(compositor.tileCount(), 0);
+	mPendingTiles.reset(compositor.size(), SHADOW_TILE_SIZE);
+	mUpToDate = false;
+}
+
+QRegion QFreeRdpDamageTracker::update(const QFreeRdpCompositor &compositor, QFreeRdpMoveList *moves,
+		QFreeRdpFillList *fills)
+{
+	syncGeometry(compositor);
+	if (moves)
+		moves->clear();
+	if (fills)
+		fills->clear();
+
+	quint32 current = compositor.generation();
+	if (mUpToDate && mLastGeneration == current)
+		return QRegion();
+
+	QRegion ret;
+	if (mUpToDate && mLastGeneration + 1 == current) {
+		// the peer has everything but the current frame, its damage is enough
+		ret = compositor.damage();
+		QRegion touched = ret;
+		for (const QFreeRdpMove &move : compositor.moves())
+			touched += move.dstRect();
+
+		if (moves)
+			*moves = compositor.moves();
+		else
+			ret = touched;
+
+		if (fills)
+			*fills = compositor.fills();
+
+		int tileRows = mTilesPerRow ? int(mSentGenerations.size()) / mTilesPerRow : 0;
+		QRect bounds(0, 0, mTilesPerRow * SHADOW_TILE_SIZE, tileRows * SHADOW_TILE_SIZE);
+		for (const QRect &r : touched) {
+			QRect rect = r.intersected(bounds);
+			if (rect.isEmpty())
+				continue;
+
+			for (int ty = rect.top() / SHADOW_TILE_SIZE; ty <= rect.bottom() / SHADOW_TILE_SIZE; ty++) {
+				for (int tx = rect.left() / SHADOW_TILE_SIZE; tx <= rect.right() / SHADOW_TILE_SIZE; tx++)
+					mSentGenerations[ty * mTilesPerRow + tx] = current;
+			}
+		}
+	} else {
+		// the peer has missed some updates, send all the tiles modified since
+		mPendingTiles.clear();
+		for (int i = 0; i < compositor.tileCount(); i++) {
+			if (compositor.tileGeneration(i) > mSentGenerations[i]) {
+				mPendingTiles.set(i % mTilesPerRow, i / mTilesPerRow);
+				mSentGenerations[i] = current;
+			}
 		}
+		ret = mPendingTiles.toRegion();
+
+		if (fills)
+			compositor.findSolidFills(ret, *fills);
 	}
 
+	if (fills) {
+		for (const QFreeRdpFill &fill : *fills)
+			ret -= fill.rect;
+	}
+
+	mLastGeneration = current;
+	mUpToDate = true;
 	return ret;
 }
 
-QRegion QFreeRdpCompositor::dirtyRegion(const QRect &rect) {
-	int y = rect.top();
-	int ymax = y + rect.height();
+void QFreeRdpDamageTracker::markSent(const QFreeRdpCompositor &compositor, const QRegion &region) {
+	syncGeometry(compositor);
 
-	QRegion dirty;
-	while (y < ymax) {
-		int height = std::min(ymax - y, SHADOW_TILE_SIZE);
-		int x = rect.left();
-		int xmax = x + rect.width();
-		while (x < xmax) {
-			int width = std::min(xmax - x, SHADOW_TILE_SIZE);
-
-			QRect tile(QPoint(x, y), QSize(width, height));
-			if (compareTileAndUpdate(tile)) {
-				dirty += tile;
+	quint32 current = compositor.generation();
+	QRect bounds(QPoint(0, 0), compositor.size());
+	for (const QRect &r : region) {
+		QRect rect = r.intersected(bounds);
+		if (rect.isEmpty())
+			continue;
+
+		// only the tiles fully covered by a rectangle
+		for (int ty = rect.top() / SHADOW_TILE_SIZE; ty <= rect.bottom() / SHADOW_TILE_SIZE; ty++) {
+			for (int tx = rect.left() / SHADOW_TILE_SIZE; tx <= rect.right() / SHADOW_TILE_SIZE; tx++) {
+				int index = ty * mTilesPerRow + tx;
+				if (rect.contains(compositor.tileRect(index)))
+					mSentGenerations[index] = current;
 			}
-			x += width;
 		}
+	}
 
-		y += height;
+	bool upToDate = true;
+	for (int i = 0; i < compositor.tileCount() && upToDate; i++) {
+		if (compositor.tileGeneration(i) > mSentGenerations[i])
+			upToDate = false;
 	}
 
-	return dirty;
+	mLastGeneration = current;
+	mUpToDate = upToDate;
+}
+
+
+#ifdef BUILD_TESTS
+#include "tests/qfreerdptestharness.h"
+
+#include <QTest>
+
+void QFreeRdpTest::compositorTestDamage_data() {
+	QTest::addColumn<int>("mode");
+	QTest::addColumn<QRect>("paintedRect");
+	QTest::addColumn<QRect>("announcedRect");
+	QTest::addColumn<QRegion>("expected");
+
+	// Assuming a 200x100 screen geometry
+
+	QTest::newRow("shadow: nothing painted")
+		<< int(DAMAGE_SHADOW_IMAGE) << QRect() << QRect(0, 0, 200, 100) << QRegion();
+
+	QTest::newRow("hash: nothing painted")
+		<< int(DAMAGE_TILE_HASH) << QRect() << QRect(0, 0, 200, 100) << QRegion();
+
+	QTest::newRow("shadow: one pixel")
+		<< int(DAMAGE_SHADOW_IMAGE) << QRect(70, 10, 1, 1) << QRect(0, 0, 200, 100)
+		<< QRegion(70, 10, 4, 4);
+
+	QTest::newRow("hash: one pixel")
+		<< int(DAMAGE_TILE_HASH) << QRect(70, 10, 1, 1) << QRect(0, 0, 200, 100)
+		<< QRegion(64, 0, 64, 64);
+
+	QTest::newRow("shadow: bounds are tight")
+		<< int(DAMAGE_SHADOW_IMAGE) << QRect(20, 30, 30, 2) << QRect(0, 0, 200, 100)
+		<< QRegion(20, 30, 30, 4);
+
+	QTest::newRow("shadow: small changes are grown inside the tile")
+		<< int(DAMAGE_SHADOW_IMAGE) << QRect(127, 99, 1, 1) << QRect(0, 0, 200, 100)
+		<< QRegion(124, 96, 4, 4);
+
+	QTest::newRow("shadow: close changes are merged across tiles")
+		<< int(DAMAGE_SHADOW_IMAGE) << QRect(60, 10, 8, 8) << QRect(0, 0, 200, 100)
+		<< QRegion(60, 10, 8, 8);
+
+	QTest::newRow("shadow: tiles are clipped to the announced rect")
+		<< int(DAMAGE_SHADOW_IMAGE) << QRect(65, 12, 1, 1) << QRect(60, 10, 10, 10)
+		<< QRegion(65, 12, 4, 4);
+
+	QTest::newRow("hash: tiles are aligned on the grid")
+		<< int(DAMAGE_TILE_HASH) << QRect(65, 12, 1, 1) << QRect(60, 10, 10, 10)
+		<< QRegion(64, 0, 64, 64);
+
+	QTest::newRow("hash: bottom right tile is clipped")
+		<< int(DAMAGE_TILE_HASH) << QRect(190, 90, 2, 2) << QRect(150, 50, 50, 50)
+		<< QRegion(192, 64, 8, 36);
 }
 
+void QFreeRdpTest::compositorTestDamage() {
+	QFETCH(int, mode);
+	QFETCH(QRect, paintedRect);
+	QFETCH(QRect, announcedRect);
+	QFETCH(QRegion, expected);
+
+	QFreeRdpScreen screen(nullptr, 200, 100);
+	QFreeRdpCompositor compositor(&screen, DamageMode(mode));
+	compositor.reset(200, 100);
+
+	// let the compositor know the initial content
+	compositor.qtToRdpDirtyRegion(QRegion(screen.geometry()));
+
+	QImage *bits = screen.getScreenBits();
+	for (int y = paintedRect.top(); y <= paintedRect.bottom(); y++)
+		for (int x = paintedRect.left(); x <= paintedRect.right(); x++)
+			bits->setPixel(x, y, qRgb(255, 255, 255));
+
+	QCOMPARE(compositor.qtToRdpDirtyRegion(QRegion(announcedRect)), expected);
+
+	// nothing changed since the last call
+	QCOMPARE(compositor.qtToRdpDirtyRegion(QRegion(announcedRect)), QRegion());
+
+	// a small change is sent as announced, reverting it in a larger update is
+	// still a change
+	QRgb previous = bits->pixel(5, 5);
+	bits->setPixel(5, 5, previous ^ 0xffffff);
+	QCOMPARE(compositor.qtToRdpDirtyRegion(QRegion(5, 5, 1, 1)), QRegion(5, 5, 1, 1));
+	bits->setPixel(5, 5, previous);
+	QVERIFY(compositor.qtToRdpDirtyRegion(QRegion(screen.geometry())).contains(QPoint(5, 5)));
+}
+
+void QFreeRdpTest::compositorTestBandedRegion() {
+	QFreeRdpScreen screen(nullptr, 200, 100);
+	QFreeRdpCompositor compositor(&screen);
+	compositor.reset(200, 100);
+	compositor.qtToRdpDirtyRegion(QRegion(screen.geometry()));
+
+	// two bands of the announced region cut the first tile, each has a change
+	QImage *bits = screen.getScreenBits();
+	bits->setPixel(10, 10, qRgb(255, 255, 255));
+	bits->setPixel(40, 40, qRgb(255, 255, 255));
+	QRegion announced = QRegion(0, 0, 64, 20) + QRegion(0, 30, 64, 20);
+	QCOMPARE(announced.rectCount(), 2);
+
+	QCOMPARE(compositor.qtToRdpDirtyRegion(announced), QRegion(10, 10, 34, 34));
+	QCOMPARE(compositor.qtToRdpDirtyRegion(announced), QRegion());
+}
+
+void QFreeRdpTest::compositorTestDamageTracker() {
+	QFreeRdpScreen screen(nullptr, 200, 100);
+	QFreeRdpCompositor compositor(&screen);
+	QImage *bits = screen.getScreenBits();
+	const QRegion fullScreen(0, 0, 200, 100);
+
+	QFreeRdpDamageTracker upToDate, lagging, refreshed;
+
+	// peers that never received anything get the full screen
+	compositor.qtToRdpDirtyRegion(fullScreen);
+	QCOMPARE(upToDate.update(compositor), fullScreen);
+	QCOMPARE(lagging.update(compositor), fullScreen);
+
+	bits->setPixel(70, 10, qRgb(255, 255, 255));
+	QRegion damage = compositor.qtToRdpDirtyRegion(fullScreen);
+	QCOMPARE(damage, QRegion(70, 10, 4, 4));
+	QCOMPARE(upToDate.update(compositor), damage);
+
+	// the peer in sync only gets the frame damage, the other one catches up
+	bits->setPixel(150, 70, qRgb(255, 255, 255));
+	damage = compositor.qtToRdpDirtyRegion(fullScreen);
+	QCOMPARE(damage, QRegion(150, 70, 4, 4));
+	QCOMPARE(upToDate.update(compositor), damage);
+	QCOMPARE(lagging.update(compositor), QRegion(64, 0, 64, 64) + QRegion(128, 64, 64, 36));
+
+	// nothing new
+	QCOMPARE(upToDate.update(compositor), QRegion());
+	QCOMPARE(lagging.update(compositor), QRegion());
+
+	// a full refresh brings a peer up to date
+	refreshed.markSent(compositor, fullScreen);
+	QCOMPARE(refreshed.update(compositor), QRegion());
+
+	// a partial refresh does not
+	QFreeRdpDamageTracker partial;
+	partial.markSent(compositor, QRegion(0, 0, 128, 64));
+	QCOMPARE(partial.update(compositor), QRegion(128, 0, 72, 64) + QRegion(0, 64, 200, 36));
+}
+
+void QFreeRdpTest::compositorTestChangingRegion() {
+	QFreeRdpScreen screen(nullptr, 200, 100);
+	QFreeRdpCompositor compositor(&screen);
+	QImage *bits = screen.getScreenBits();
+	const QRegion fullScreen(0, 0, 200, 100);
+	compositor.qtToRdpDirtyRegion(fullScreen);
+
+	// an animation in the first tile, a single change in the last one
+	for (int i = 0; i < 5; i++) {
+		bits->setPixel(10, 10, qRgb(10 + i * 50, 0, 0));
+		if (i == 3)
+			bits->setPixel(150, 70, qRgb(255, 255, 255));
+		compositor.qtToRdpDirtyRegion(fullScreen);
+		QCOMPARE(compositor.changingRegion(3), i >= 2 ? QRegion(0, 0, 64, 64) : QRegion());
+	}
+
+	// an update without the animation breaks the sequence
+	bits->setPixel(150, 70, qRgb(0, 0, 0));
+	compositor.qtToRdpDirtyRegion(fullScreen);
+	QCOMPARE(compositor.changingRegion(1), QRegion(128, 64, 64, 36));
+	bits->setPixel(10, 10, qRgb(0, 255, 0));
+	compositor.qtToRdpDirtyRegion(fullScreen);
+	QCOMPARE(compositor.changingRegion(2), QRegion());
+}
+
+void QFreeRdpTest::compositorTestSolidFills() {
+	QFreeRdpScreen screen(nullptr, 200, 100);
+	QFreeRdpCompositor compositor(&screen);
+	QImage *bits = screen.getScreenBits();
+	const QRegion fullScreen(0, 0, 200, 100);
+
+	bits->fill(Qt::black);
+	compositor.qtToRdpDirtyRegion(fullScreen);
+
+	QFreeRdpDamageTracker upToDate, lagging;
+	QFreeRdpFillList fills;
+	upToDate.update(compositor, nullptr, &fills);
+
+	// a flat rectangle crossing tiles is a single fill
+	const quint32 red = qRgb(255, 0, 0);
+	for (int y = 10; y < 50; y++)
+		for (int x = 10; x < 160; x++)
+			bits->setPixel(x, y, red);
+
+	QCOMPARE(compositor.qtToRdpDirtyRegion(fullScreen), QRegion(10, 10, 150, 40));
+	QCOMPARE(compositor.fills().size(), 1);
+	QCOMPARE(compositor.fills()[0].rect, QRect(10, 10, 150, 40));
+	QCOMPARE(compositor.fills()[0].color, red);
+
+	QCOMPARE(upToDate.update(compositor, nullptr, &fills), QRegion());
+	QCOMPARE(fills.size(), 1);
+	QCOMPARE(fills[0].rect, QRect(10, 10, 150, 40));
+
+	// without fills everything is in the region
+	QFreeRdpDamageTracker noFills;
+	noFills.update(compositor);
+
+	// clearing the screen, tiles of all rows are merged
+	const quint32 blue = qRgb(0, 0, 255);
+	bits->fill(blue);
+	compositor.qtToRdpDirtyRegion(fullScreen);
+
+	QCOMPARE(lagging.update(compositor, nullptr, &fills), QRegion());
+	QCOMPARE(fills.size(), 1);
+	QCOMPARE(fills[0].rect, QRect(0, 0, 200, 100));
+	QCOMPARE(fills[0].color, blue);
+
+	QCOMPARE(noFills.update(compositor), QRegion(compositor.damage()));
+	QCOMPARE(upToDate.update(compositor, nullptr, &fills), QRegion());
+
+	// pieces that are not solid stay in the region
+	bits->setPixel(100, 50, red);
+	QRegion damage = compositor.qtToRdpDirtyRegion(fullScreen);
+	QCOMPARE(upToDate.update(compositor, nullptr, &fills), damage);
+	QVERIFY(fills.isEmpty());
+}
+
+void QFreeRdpTest::compositorBenchmarkDirtyTiles_data() {
+	QTest::addColumn<int>("mode");
+	QTest::addColumn<int>("tiles");
+	QTest::addColumn<int>("threads");
+
+	// a 4K screen has 60x34 tiles
+	for (int threads : { 1, 4 }) {
+		for (int tiles : { 0, 256, 1024, 2040 }) {
+			QTest::newRow(qPrintable(QString("shadow %1 tiles %2 threads").arg(tiles).arg(threads)))
+				<< int(DAMAGE_SHADOW_IMAGE) << tiles << threads;
+			QTest::newRow(qPrintable(QString("hash %1 tiles %2 threads").arg(tiles).arg(threads)))
+				<< int(DAMAGE_TILE_HASH) << tiles << threads;
+		}
+	}
+}
+
+void QFreeRdpTest::compositorBenchmarkDirtyTiles() {
+	QFETCH(int, mode);
+	QFETCH(int, tiles);
+	QFETCH(int, threads);
+
+	QFreeRdpScreen screen(nullptr, 3840, 2160);
+	QFreeRdpCompositor compositor(&screen, DamageMode(mode));
+	compositor.setWorkerThreads(threads);
+	QImage *bits = screen.getScreenBits();
+	const QRegion fullScreen(screen.geometry());
+	compositor.qtToRdpDirtyRegion(fullScreen);
+
+	// Qt announces the full screen, a pixel changes in the given number of tiles
+	quint32 color = 0;
+	QBENCHMARK {
+		color++;
+		for (int i = 0; i < tiles; i++)
+			bits->setPixel((i % 60) * 64, (i / 60) * 64, color);
+		compositor.qtToRdpDirtyRegion(fullScreen);
+	}
+}
+
+void QFreeRdpTest::compositorTestParallel_data() {
+	QTest::addColumn<int>("mode");
+
+	QTest::newRow("shadow") << int(DAMAGE_SHADOW_IMAGE);
+	QTest::newRow("hash") << int(DAMAGE_TILE_HASH);
+}
+
+void QFreeRdpTest::compositorTestParallel() {
+	QFETCH(int, mode);
+
+	// the same frames on two screens, compared inline and on 4 threads
+	QFreeRdpScreen inlineScreen(nullptr, 1000, 700);
+	QFreeRdpScreen parallelScreen(nullptr, 1000, 700);
+	QFreeRdpCompositor inlineCompositor(&inlineScreen, DamageMode(mode));
+	QFreeRdpCompositor parallelCompositor(&parallelScreen, DamageMode(mode));
+	parallelCompositor.setWorkerThreads(4);
+
+	const QRegion fullScreen(0, 0, 1000, 700);
+	inlineCompositor.qtToRdpDirtyRegion(fullScreen);
+	parallelCompositor.qtToRdpDirtyRegion(fullScreen);
+
+	quint32 seed = 42;
+	auto next = [&seed]() {
+		seed = seed * 1103515245 + 12345;
+		return (seed >> 16) & 0x7fff;
+	};
+
+	for (int frame = 0; frame < 20; frame++) {
+		for (int i = 0; i < 40; i++) {
+			int x = next() % 1000;
+			int y = next() % 700;
+			quint32 color = next() | (frame << 16);
+			inlineScreen.getScreenBits()->setPixel(x, y, color);
+			parallelScreen.getScreenBits()->setPixel(x, y, color);
+		}
+
+		// a big region, and one that stays on the inline path
+		const QRegion announced = (frame & 1) ? fullScreen : QRegion(100, 100, 100, 100);
+		QRegion expected = inlineCompositor.qtToRdpDirtyRegion(announced);
+		QCOMPARE(parallelCompositor.qtToRdpDirtyRegion(announced), expected);
+	}
+}
+
+void QFreeRdpTest::compositorTestMoves_data() {
+	QTest::addColumn<int>("mode");
+
+	QTest::newRow("shadow") << int(DAMAGE_SHADOW_IMAGE);
+	QTest::newRow("hash") << int(DAMAGE_TILE_HASH);
+}
+
+void QFreeRdpTest::compositorTestMoves() {
+	QFETCH(int, mode);
+
+	QFreeRdpScreen screen(nullptr, 256, 256);
+	QFreeRdpCompositor compositor(&screen, DamageMode(mode), true);
+	QImage *bits = screen.getScreenBits();
+	const QRegion fullScreen(0, 0, 256, 256);
+
+	for (int y = 0; y < 256; y++)
+		for (int x = 0; x < 256; x++)
+			bits->setPixel(x, y, qRgb(x, y, (x * y) & 0xff));
+	compositor.qtToRdpDirtyRegion(fullScreen);
+	QVERIFY(compositor.moves().isEmpty());
+
+	QFreeRdpDamageTracker upToDate, lagging, noMoves;
+	QFreeRdpMoveList moves;
+	upToDate.update(compositor, &moves);
+	lagging.update(compositor, &moves);
+	noMoves.update(compositor);
+
+	// scroll the whole screen by 32 rows, the exposed strip is painted
+	QImage previous = bits->copy();
+	QFreeRdpMotionEstimator::applyMove(*bits, { QRect(0, 0, 256, 224), QPoint(0, 32) });
+	for (int y = 0; y < 32; y++)
+		memset(bits->scanLine(y), 0xff, bits->bytesPerLine());
+
+	QRegion damage = compositor.qtToRdpDirtyRegion(fullScreen);
+	QCOMPARE(compositor.moves().size(), 1);
+	QCOMPARE(compositor.moves()[0].src, QRect(0, 0, 256, 224));
+	QCOMPARE(compositor.moves()[0].dst, QPoint(0, 32));
+	QVERIFY(damage.intersected(QRect(0, 64, 256, 192)).isEmpty());
+
+	// replaying the moves and the damage gives the current frame
+	QRegion dirty = upToDate.update(compositor, &moves);
+	QCOMPARE(moves.size(), 1);
+	QFreeRdpMotionEstimator::applyMove(previous, moves[0]);
+	for (const QRect &r : dirty)
+		for (int y = r.top(); y <= r.bottom(); y++)
+			memcpy(previous.scanLine(y) + r.left() * 4, bits->constScanLine(y) + r.left() * 4, r.width() * 4);
+	QCOMPARE(previous, *bits);
+
+	// peers that can't apply moves get the moved area as damage
+	QCOMPARE(noMoves.update(compositor), fullScreen);
+
+	// peers that missed the previous frame can't use the moves
+	QRegion skipped = compositor.qtToRdpDirtyRegion(fullScreen);
+	QVERIFY(skipped.isEmpty());
+	upToDate.update(compositor, &moves);
+	bits->setPixel(10, 100, qRgb(0, 0, 0));
+	compositor.qtToRdpDirtyRegion(fullScreen);
+	QCOMPARE(lagging.update(compositor, &moves), fullScreen);
+	QVERIFY(moves.isEmpty());
+}
+
+#endif // BUILD_TESTS
+
 QT_END_NAMESPACE
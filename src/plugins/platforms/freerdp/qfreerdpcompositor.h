@@ -23,13 +23,28 @@
 #define __QFREERDPCOMPOSITOR_H__
 
 #include <memory>
+#include <vector>
 
+#include <QElapsedTimer>
 #include <QImage>
+#include <QThreadPool>
 
+#include "qfreerdpmotion.h"
+#include "qfreerdpplatform.h"
 #include "qfreerdpscreen.h"
+#include "qfreerdptilebitmap.h"
+#include "qfreerdptilecompare.h"
 
 QT_BEGIN_NAMESPACE
 
+/** @brief an area of the screen made of a single color */
+struct QFreeRdpFill {
+	QRect rect;
+	quint32 color;
+};
+
+typedef QVector<QFreeRdpFill> QFreeRdpFillList;
+
 /**
  * @brief a compositor to convert Qt to RDP screen updates
  * 
@@ -41,45 +56,222 @@ QT_BEGIN_NAMESPACE
  * a full update of the screen. This compositor will only update
  * the impacted region on a 64x64 square basis. That means if one
  * pixel the region impacted is 64x64 and not the entire screen.
+ *
+ * Modified tiles are detected either by comparing with a shadow copy of the
+ * screen, or in DAMAGE_TILE_HASH mode by comparing the hash of each tile of the
+ * 64x64 grid with the one computed on the previous update. The latter only keeps
+ * 8 bytes per tile instead of a full copy of the screen.
+ *
+ * The compositor is shared by all the peers: each non-empty update bumps a
+ * generation counter and stamps the tiles of the 64x64 grid it touched with it,
+ * so that peers can find out what they have missed with a QFreeRdpDamageTracker.
+ *
+ * When move detection is enabled, scrolls and window moves are reported as
+ * screen to screen copies and removed from the damage. Peers that are up to date
+ * apply them before the residual damage, the others receive the modified tiles.
+ *
+ * The parts of the damage that are made of a single color are also reported,
+ * so that peers can send them as solid fills instead of encoding bitmaps.
+ *
+ * Tiles whose content changes in consecutive updates (videos, animations) are
+ * reported by changingRegion(), so that peers can use a video codec for them.
  */
+class QFreeRdpTileBandJob;
+
 class QFreeRdpCompositor : public QObject {
+	friend class QFreeRdpTileBandJob;
+
 public:
-    explicit QFreeRdpCompositor(QFreeRdpScreen *screen);
+    explicit QFreeRdpCompositor(QFreeRdpScreen *screen, DamageMode mode = DAMAGE_SHADOW_IMAGE,
+    		bool detectMoves = false);
+    ~QFreeRdpCompositor();
 
     /**
      * Reset compositor
      */
     void reset(size_t width, size_t height);
 
+	/**
+	 * Sets the number of threads comparing tiles when Qt announces a big
+	 * region, small regions are always handled by the calling thread.
+	 *
+	 * @param count number of threads including the calling one, 0 to pick
+	 * 		one from the number of cores
+	 */
+	void setWorkerThreads(int count);
+
 	/** 
 	 * Given a dirty region announced by Qt computes the effectively dirty
 	 * region (also updating the shadow image during the operation).
 	 *
 	 * @param region input dirty region
-	 * @return the real dirty region
+	 * @param hints moves announced by the window manager, checked before being used
+	 * @return the real dirty region, without the areas updated by moves()
 	 */
-	QRegion qtToRdpDirtyRegion(const QRegion &region);
+	QRegion qtToRdpDirtyRegion(const QRegion &region, const QFreeRdpMoveList &hints = QFreeRdpMoveList());
+
+	/** @return the residual damage of the current generation */
+	const QRegion &damage() const { return mDamage; }
+
+	/** @return the moves of the current generation, to apply before damage() */
+	const QFreeRdpMoveList &moves() const { return mMoves; }
+
+	/** @return the solid color parts of damage() */
+	const QFreeRdpFillList &fills() const { return mFills; }
+
+	/**
+	 * Finds the parts of a region that are made of a single color in the
+	 * current screen content. The region is cut on the tile grid, solid
+	 * pieces of the same color are merged.
+	 */
+	void findSolidFills(const QRegion &region, QFreeRdpFillList &fills) const;
+
+	/**
+	 * @return the tiles modified by the current generation that have also been
+	 * 		modified by the previous ones, for at least minUpdates updates in a
+	 * 		row. Moves don't count as modifications.
+	 */
+	QRegion changingRegion(int minUpdates) const;
+
+	/** @return the generation of the last non-empty update */
+	quint32 generation() const { return mGeneration; }
+
+	/** @return the size of the screen the tiles cover */
+	QSize size() const { return mSize; }
+
+	/** @return the number of tiles of the grid */
+	int tileCount() const { return int(mTileGenerations.size()); }
+
+	/** @return the number of tiles in a row of the grid */
+	int tilesPerRow() const { return mTilesPerRow; }
+
+	/** @return the generation at which the given tile was last modified */
+	quint32 tileGeneration(int index) const { return mTileGenerations[index]; }
+
+	/** @return the rectangle covered by the given tile, clipped to the screen */
+	QRect tileRect(int index) const;
 
 private:
+	/** records the result of an update as a new generation, if there is one */
+	void newGeneration(const QRegion &dirty, const QFreeRdpMoveList &moves);
 
     /** 
 	 * Compares a tile in the current image and the previous one and returns
-     * if it has been effectively modified. The shadow image is updated
-     * during the process.
+     * the bounds of the pixels that have been effectively modified. The shadow
+     * image is updated during the process.
+	 *
+	 * @param rect the tile (at most SHADOW_TILE_SIZE pixels high)
+	 * @return the modified part of the tile, empty if the tile is unchanged
+	 */
+	QRect compareTileAndUpdate(const QRect &rect);
+
+	/**
+	 * Builds the damage from the bounds of the changes in the dirty tiles,
+	 * rather than from whole tiles.
+	 */
+	QRegion tightRegion() const;
+
+	/**
+	 * Fills mDirtyTiles for the region announced by Qt, bands of tile rows
+	 * are handled in parallel for big regions.
+	 */
+	void detectDirtyTiles(const QRegion &region, int inSize);
+
+	/** Handles the rows of tiles from firstRow to lastRow of the region */
+	void detectTiles(const QRegion &region, int firstRow, int lastRow);
+
+	/**
+	 * Compares the tiles of the grid touched by a dirty rect announced by Qt
+	 * with the shadow image, and marks the modified ones in mDirtyTiles.
+	 */
+	void compareTiles(const QRect &rect, int firstRow, int lastRow);
+
+	/**
+	 * Computes the hash of a tile of the grid and compares it with the
+	 * previous one, the stored hash is updated during the process.
 	 *
-	 * @param rect the tile
+	 * @param tile the tile, aligned on the tile grid
 	 * @return if the tile is modified in the new image
 	 */
-	bool compareTileAndUpdate(const QRect &rect);
+	bool hashTileAndUpdate(const QRect &tile);
 
 	/**
-	 * Given a dirty rect announced by Qt computes the effectively dirty
-	 * sub-rectangles as a dirty region.
+	 * Hashes the tiles of the grid touched by a dirty rect announced by Qt in
+	 * DAMAGE_TILE_HASH mode, and marks the modified ones in mDirtyTiles.
 	 */
-	QRegion dirtyRegion(const QRect &rect);
+	void hashTiles(const QRect &rect, int firstRow, int lastRow);
 
-    std::unique_ptr<QImage> mShadowImage;
     QFreeRdpScreen *mScreen;
+    DamageMode mMode;
+    QSize mSize;
+    std::unique_ptr<QImage> mShadowImage;
+    int mTilesPerRow;
+    std::vector<quint64> mTileHashes;
+    std::vector<QRect> mTileBounds;
+    quint32 mGeneration;
+    std::vector<quint32> mTileGenerations;
+    std::vector<quint32> mTileChangeGenerations;
+    std::vector<quint16> mTileStreaks;
+    QElapsedTimer mClock;
+    qint64 mGenerationTime;
+    QRegion mDamage;
+    QFreeRdpTileBitmap mDirtyTiles;
+    bool mDetectMoves;
+    QFreeRdpMotionEstimator mMotion;
+    QFreeRdpMoveList mMoves;
+    QFreeRdpFillList mFills;
+    uchar *mShadowBits;
+    int mThreads;
+    QThreadPool mPool;
+    std::vector<QFreeRdpTileBandJob *> mBandJobs;
+    QFreeRdpTileComparator::CompareFn mCompareKernel;
+};
+
+
+/**
+ * @brief tracks which updates of the shared compositor a peer has received
+ *
+ * For each tile of the grid the tracker keeps the generation of the content
+ * sent to the peer. A peer that received every update only needs the damage of
+ * the current frame, others (late joiners, peers whose output was suspended) get
+ * the full tiles modified since they last received them.
+ */
+class QFreeRdpDamageTracker {
+public:
+	QFreeRdpDamageTracker();
+
+	/** Forgets everything that has been sent, the next update will contain the full screen */
+	void reset();
+
+	/**
+	 * Computes the region to send to the peer to bring it up to date, and
+	 * considers it as sent.
+	 *
+	 * @param compositor the shared compositor
+	 * @param moves if not null, receives the moves to apply before the returned
+	 * 		region. Otherwise the areas updated by moves are part of the region
+	 * @param fills if not null, receives the solid color areas to send after
+	 * 		the moves, they are not part of the returned region
+	 * @return the region to send
+	 */
+	QRegion update(const QFreeRdpCompositor &compositor, QFreeRdpMoveList *moves = nullptr,
+			QFreeRdpFillList *fills = nullptr);
+
+	/**
+	 * Records that the given region has been sent outside of update(), the
+	 * tiles fully covered by one of the rectangles of the region are considered
+	 * up to date.
+	 */
+	void markSent(const QFreeRdpCompositor &compositor, const QRegion &region);
+
+protected:
+	void syncGeometry(const QFreeRdpCompositor &compositor);
+
+	std::vector<quint32> mSentGenerations;
+	QFreeRdpTileBitmap mPendingTiles;
+	int mTilesPerRow;
+	quint32 mLastGeneration;
+	bool mUpToDate;
 };
 
 QT_END_NAMESPACE
@@ -0,0 +1,158 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "qfreerdpegfxcache.h"
+#include "qfreerdptilecompare.h"
+
+QT_BEGIN_NAMESPACE
+
+QFreeRdpEgfxCache::QFreeRdpEgfxCache()
+: mFreeSlots(0)
+, mHits(0)
+, mMisses(0)
+, mEvictions(0)
+{
+	reset(0);
+}
+
+void QFreeRdpEgfxCache::reset(int slots) {
+	mEntries.assign(slots + 1, Entry{ 0, 0, 0 });
+	mSlots.clear();
+	mFreeSlots = slots;
+}
+
+void QFreeRdpEgfxCache::unlink(int slot) {
+	Entry &entry = mEntries[slot];
+	mEntries[entry.prev].next = entry.next;
+	mEntries[entry.next].prev = entry.prev;
+}
+
+void QFreeRdpEgfxCache::pushFront(int slot) {
+	Entry &head = mEntries[0];
+	Entry &entry = mEntries[slot];
+	entry.prev = 0;
+	entry.next = head.next;
+	mEntries[head.next].prev = slot;
+	head.next = slot;
+}
+
+int QFreeRdpEgfxCache::find(quint64 key) {
+	auto it = mSlots.constFind(key);
+	if (it == mSlots.constEnd()) {
+		mMisses++;
+		return 0;
+	}
+
+	mHits++;
+	int slot = *it;
+	unlink(slot);
+	pushFront(slot);
+	return slot;
+}
+
+int QFreeRdpEgfxCache::insert(quint64 key) {
+	if (!slotCount())
+		return 0;
+
+	int slot;
+	if (mFreeSlots) {
+		// slots are handed out in order until the cache is full
+		slot = slotCount() - mFreeSlots + 1;
+		mFreeSlots--;
+	} else {
+		slot = mEntries[0].prev;
+		unlink(slot);
+		mSlots.remove(mEntries[slot].key);
+		mEvictions++;
+	}
+
+	mEntries[slot].key = key;
+	mSlots.insert(key, slot);
+	pushFront(slot);
+	return slot;
+}
+
+quint64 QFreeRdpEgfxCache::tileKey(const uchar *src, int stride, int width, int height) {
+	// tiles of different sizes never share a key
+	return QFreeRdpTileComparator::hash(src, stride, width, height) ^
+			(quint64(width) << 48) ^ (quint64(height) << 32);
+}
+
+int QFreeRdpEgfxCache::hitRate() const {
+	quint64 lookups = mHits + mMisses;
+	return lookups ? int((mHits * 100) / lookups) : 0;
+}
+
+#ifdef BUILD_TESTS
+#include "tests/qfreerdptestharness.h"
+
+#include <QImage>
+#include <QTest>
+
+void QFreeRdpTest::egfxCacheTestLru() {
+	QFreeRdpEgfxCache cache;
+	QCOMPARE(cache.slotCount(), 0);
+	QCOMPARE(cache.insert(1), 0);
+
+	cache.reset(3);
+	QCOMPARE(cache.find(10), 0);
+	QCOMPARE(cache.insert(10), 1);
+	QCOMPARE(cache.insert(20), 2);
+	QCOMPARE(cache.insert(30), 3);
+
+	// 10 becomes the most recently used, 20 is evicted first
+	QCOMPARE(cache.find(10), 1);
+	QCOMPARE(cache.insert(40), 2);
+	QCOMPARE(cache.find(20), 0);
+	QCOMPARE(cache.find(40), 2);
+
+	QCOMPARE(cache.insert(50), 3);
+	QCOMPARE(cache.find(30), 0);
+
+	QCOMPARE(cache.hits(), quint64(2));
+	QCOMPARE(cache.misses(), quint64(3));
+	QCOMPARE(cache.evictions(), quint64(2));
+	QCOMPARE(cache.hitRate(), 40);
+
+	// a reset forgets the content, not the counters
+	cache.reset(3);
+	QCOMPARE(cache.find(10), 0);
+	QCOMPARE(cache.insert(10), 1);
+	QCOMPARE(cache.misses(), quint64(4));
+}
+
+void QFreeRdpTest::egfxCacheTestTileKey() {
+	QImage tile(64, 64, QImage::Format_ARGB32_Premultiplied);
+	tile.fill(Qt::white);
+
+	quint64 full = QFreeRdpEgfxCache::tileKey(tile.constBits(), tile.bytesPerLine(), 64, 64);
+	quint64 half = QFreeRdpEgfxCache::tileKey(tile.constBits(), tile.bytesPerLine(), 32, 64);
+	QVERIFY(full != half);
+	QCOMPARE(QFreeRdpEgfxCache::tileKey(tile.constBits(), tile.bytesPerLine(), 64, 64), full);
+
+	tile.setPixel(10, 10, qRgb(0, 0, 0));
+	QVERIFY(QFreeRdpEgfxCache::tileKey(tile.constBits(), tile.bytesPerLine(), 64, 64) != full);
+}
+
+#endif // BUILD_TESTS
+
+QT_END_NAMESPACE
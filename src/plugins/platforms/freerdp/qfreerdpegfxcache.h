@@ -0,0 +1,106 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __QFREERDPEGFXCACHE_H__
+#define __QFREERDPEGFXCACHE_H__
+
+#include <vector>
+
+#include <QHash>
+#include <QtGlobal>
+
+QT_BEGIN_NAMESPACE
+
+/**
+ * @brief server side model of the EGFX cache of a client
+ *
+ * The client keeps bitmaps in numbered slots (starting at 1), filled with
+ * SurfaceToCache and drawn with CacheToSurface. The model knows which content
+ * is in which slot, by a key derived from the content, and picks the least
+ * recently used slot when a new content has to be stored.
+ *
+ * It also models a cell of the bitmap cache of clients that get bitmap updates,
+ * filled with CacheBitmapV2 and drawn with MemBlt, slot n being cache index n - 1.
+ */
+class QFreeRdpEgfxCache {
+public:
+	QFreeRdpEgfxCache();
+
+	/**
+	 * Empties the cache, as after a ResetGraphics
+	 *
+	 * @param slots number of slots of the client cache, 0 to disable caching
+	 */
+	void reset(int slots);
+
+	/** @return the number of slots of the client cache */
+	int slotCount() const { return int(mEntries.size()) - 1; }
+
+	/**
+	 * Looks for a content in the cache, a hit makes it the most recently used.
+	 *
+	 * @return the slot holding the content, 0 if it is not cached
+	 */
+	int find(quint64 key);
+
+	/**
+	 * Assigns a slot to a content that is not cached yet, the content of the
+	 * slot must then be sent to the client.
+	 *
+	 * @return the slot, a free one or the least recently used one
+	 */
+	int insert(quint64 key);
+
+	/** @return the key of a 32 bits tile of the screen */
+	static quint64 tileKey(const uchar *src, int stride, int width, int height);
+
+	/** Counters since the creation of the session
+	 * @{ */
+	quint64 hits() const { return mHits; }
+	quint64 misses() const { return mMisses; }
+	quint64 evictions() const { return mEvictions; }
+	int hitRate() const;
+	/** @} */
+
+protected:
+	void unlink(int slot);
+	void pushFront(int slot);
+
+	/** @brief a slot, linked in the LRU list */
+	struct Entry {
+		quint64 key;
+		int prev;
+		int next;
+	};
+
+	/** slot 0 is the head of the LRU list, its next is the most recently used */
+	std::vector<Entry> mEntries;
+	QHash<quint64, int> mSlots;
+	int mFreeSlots;
+
+	quint64 mHits;
+	quint64 mMisses;
+	quint64 mEvictions;
+};
+
+QT_END_NAMESPACE
+
+#endif // __QFREERDPEGFXCACHE_H__
@@ -0,0 +1,641 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freerdp/settings.h>
+
+#include <QThread>
+
+#include "qfreerdpencoder.h"
+
+QT_BEGIN_NAMESPACE
+
+/** jobs of a batch below which everything stays on the calling thread */
+#define ENCODE_PARALLEL_MIN_JOBS 2
+
+/** bytes added by NSC to the size of the padded planes in the worst case */
+#define NSC_MAX_OVERHEAD 64
+
+/** bytes of the RemoteFX headers of a message, and of the header of a tile */
+#define RFX_MESSAGE_OVERHEAD 512
+#define RFX_TILE_HEADER_SIZE 19
+
+/** alignment of the buffers of a scratch arena */
+#define SCRATCH_ALIGNMENT 64
+
+QFreeRdpCodecContexts::QFreeRdpCodecContexts()
+: mPlanar(nullptr)
+, mPlanarWidth(0)
+, mPlanarHeight(0)
+, mInterleaved(nullptr)
+, mNsc(nullptr)
+, mRfx(nullptr)
+{}
+
+QFreeRdpCodecContexts::~QFreeRdpCodecContexts() {
+	freerdp_bitmap_planar_context_free(mPlanar);
+	bitmap_interleaved_context_free(mInterleaved);
+	nsc_context_free(mNsc);
+	rfx_context_free(mRfx);
+}
+
+BITMAP_PLANAR_CONTEXT *QFreeRdpCodecContexts::planar(int width, int height, bool topdown) {
+	if (!mPlanar) {
+		mPlanar = freerdp_bitmap_planar_context_new(PLANAR_FORMAT_HEADER_RLE, 64, 64);
+		if (!mPlanar)
+			return nullptr;
+		mPlanarWidth = 64;
+		mPlanarHeight = 64;
+	}
+
+	if (width != mPlanarWidth || height != mPlanarHeight) {
+		mPlanarWidth = mPlanarHeight = 0;
+		if (!freerdp_bitmap_planar_context_reset(mPlanar, width, height))
+			return nullptr;
+		mPlanarWidth = width;
+		mPlanarHeight = height;
+	}
+	freerdp_planar_topdown_image(mPlanar, topdown);
+	return mPlanar;
+}
+
+BITMAP_INTERLEAVED_CONTEXT *QFreeRdpCodecContexts::interleaved() {
+	if (!mInterleaved)
+		mInterleaved = bitmap_interleaved_context_new(TRUE);
+	return mInterleaved;
+}
+
+NSC_CONTEXT *QFreeRdpCodecContexts::nsc(int width, int height, UINT32 colorLossLevel, bool allowSubsampling,
+		bool dynamicFidelity)
+{
+	if (!mNsc) {
+		mNsc = nsc_context_new();
+		if (!mNsc)
+			return nullptr;
+		nsc_context_set_parameters(mNsc, NSC_COLOR_FORMAT, PIXEL_FORMAT_BGRX32);
+	}
+
+	// peers may have negotiated different parameters
+	nsc_context_reset(mNsc, width, height);
+	nsc_context_set_parameters(mNsc, NSC_COLOR_LOSS_LEVEL, colorLossLevel);
+	nsc_context_set_parameters(mNsc, NSC_ALLOW_SUBSAMPLING, allowSubsampling ? 1 : 0);
+	nsc_context_set_parameters(mNsc, NSC_DYNAMIC_COLOR_FIDELITY, dynamicFidelity ? 1 : 0);
+	return mNsc;
+}
+
+size_t QFreeRdpCodecContexts::nscMaxSize(int width, int height) {
+	// NSC pads the planes, and may keep them raw
+	return size_t((width + 15) & ~15) * ((height + 1) & ~1) * 4 + NSC_MAX_OVERHEAD;
+}
+
+RFX_CONTEXT *QFreeRdpCodecContexts::rfx(int width, int height) {
+	if (!mRfx) {
+		// tiles are spread on the encoder threads already
+		mRfx = rfx_context_new_ex(TRUE, THREADING_FLAGS_DISABLE_THREADS);
+		if (!mRfx)
+			return nullptr;
+		rfx_context_set_mode(mRfx, RLGR3);
+		rfx_context_set_pixel_format(mRfx, PIXEL_FORMAT_BGRX32);
+	}
+
+	// contexts are shared by the peers, each message carries the headers
+	if (!rfx_context_reset(mRfx, width, height))
+		return nullptr;
+	return mRfx;
+}
+
+size_t QFreeRdpCodecContexts::rfxMessageSize(const RFX_MESSAGE *message) {
+	UINT16 numRects = 0;
+	UINT16 numQuants = 0;
+	UINT16 numTiles = 0;
+	rfx_message_get_rects(message, &numRects);
+	rfx_message_get_quants(message, &numQuants);
+	const RFX_TILE **tiles = rfx_message_get_tiles(message, &numTiles);
+
+	size_t ret = RFX_MESSAGE_OVERHEAD + numRects * 8 + numQuants * 5;
+	for (UINT16 i = 0; i < numTiles; i++)
+		ret += RFX_TILE_HEADER_SIZE + tiles[i]->YLen + tiles[i]->CbLen + tiles[i]->CrLen;
+	return ret;
+}
+
+QFreeRdpCodecContexts &QFreeRdpCodecContexts::local() {
+	static thread_local QFreeRdpCodecContexts contexts;
+	return contexts;
+}
+
+
+QFreeRdpScratchArena::QFreeRdpScratchArena()
+: mCapacity(0)
+, mUsed(0)
+, mHeapAllocations(0)
+{}
+
+QFreeRdpScratchArena::~QFreeRdpScratchArena() {
+	for (uchar *buffer : mOverflow)
+		free(buffer);
+}
+
+void QFreeRdpScratchArena::reset() {
+	size_t used = mUsed;
+
+	for (uchar *buffer : mOverflow)
+		free(buffer);
+	mOverflow.clear();
+
+	// the block is sized for the largest frame seen
+	if (used > mCapacity) {
+		mBlock.reset(new uchar[used]);
+		mCapacity = used;
+		mHeapAllocations++;
+	}
+	mUsed = 0;
+}
+
+uchar *QFreeRdpScratchArena::alloc(size_t size) {
+	size = (size + SCRATCH_ALIGNMENT - 1) & ~size_t(SCRATCH_ALIGNMENT - 1);
+
+	// the total is counted even when the block is full, to size the next one
+	size_t offset = mUsed.fetch_add(size);
+	if (offset + size <= mCapacity)
+		return mBlock.get() + offset;
+
+	uchar *buffer = (uchar *)malloc(size);
+	QMutexLocker locker(&mOverflowLock);
+	if (buffer)
+		mOverflow.push_back(buffer);
+	mHeapAllocations++;
+	return buffer;
+}
+
+
+/** @brief jobs of a run() call, shared by the threads working on it */
+struct QFreeRdpEncodeBatch {
+	/** runs pending jobs until there is none left, afterJob is called after each of them */
+	template <typename AfterJob>
+	void work(const AfterJob &afterJob) {
+		QFreeRdpCodecContexts &codecs = QFreeRdpCodecContexts::local();
+		for (int index = next++; index < count; index = next++) {
+			job(jobData, index, codecs);
+			if (finished) {
+				finished[index] = true;
+				jobsDone->release();
+			}
+			afterJob();
+		}
+	}
+
+	void work() {
+		work([]() {});
+	}
+
+	/** @return the number of jobs finished in order from the first one, at least from */
+	int finishedJobs(int from) const {
+		// without helpers, jobs end in the order they are taken
+		if (!finished)
+			return std::min<int>(next, count);
+
+		int done = from;
+		while (done < count && finished[done])
+			done++;
+		return done;
+	}
+
+	int count;
+	std::atomic<int> next;
+	QFreeRdpEncoder::JobCall job;
+	const void *jobData;
+
+	/** job completions, only tracked when helpers share the batch */
+	std::atomic<bool> *finished;
+	QSemaphore *jobsDone;
+};
+
+/** @brief thread helping the calling threads of run() with their jobs */
+class QFreeRdpEncodeWorker : public QThread {
+public:
+	QFreeRdpEncodeWorker(QFreeRdpEncoder *encoder)
+	: mEncoder(encoder)
+	{}
+
+protected:
+	void run() override {
+		for (;;) {
+			mEncoder->mWork.acquire();
+
+			// the encoder clears the batch to stop its workers
+			QFreeRdpEncodeBatch *batch = mEncoder->mBatch;
+			if (!batch)
+				return;
+
+			batch->work();
+			mEncoder->mHelpersDone.release();
+		}
+	}
+
+	QFreeRdpEncoder *mEncoder;
+};
+
+QFreeRdpEncoder::QFreeRdpEncoder()
+: mThreads(1)
+, mBatch(nullptr)
+, mFinishedCapacity(0)
+{
+	setThreadCount(0);
+}
+
+QFreeRdpEncoder::~QFreeRdpEncoder() {
+	QMutexLocker locker(&mRunLock);
+	stopWorkers();
+}
+
+QFreeRdpEncoder *QFreeRdpEncoder::instance() {
+	static QFreeRdpEncoder encoder;
+	return &encoder;
+}
+
+void QFreeRdpEncoder::setThreadCount(int count) {
+	if (count <= 0)
+		count = QThread::idealThreadCount();
+
+	QMutexLocker locker(&mRunLock);
+	stopWorkers();
+
+	// the calling thread takes its share of the work
+	mThreads = std::max(count, 1);
+	for (int i = 0; i < mThreads - 1; i++) {
+		QFreeRdpEncodeWorker *worker = new QFreeRdpEncodeWorker(this);
+		worker->start();
+		mWorkers.push_back(worker);
+	}
+}
+
+void QFreeRdpEncoder::stopWorkers() {
+	mBatch = nullptr;
+	mWork.release(int(mWorkers.size()));
+	for (QFreeRdpEncodeWorker *worker : mWorkers) {
+		worker->wait();
+		delete worker;
+	}
+	mWorkers.clear();
+}
+
+void QFreeRdpEncoder::runBatch(int count, JobCall job, const void *jobData, ProgressCall progress,
+		const void *progressData)
+{
+	if (count <= 0)
+		return;
+
+	// workers busy with the jobs of another thread are not waited for
+	int helpers = 0;
+	if (count >= ENCODE_PARALLEL_MIN_JOBS && mRunLock.tryLock()) {
+		helpers = std::min<int>(int(mWorkers.size()), count - 1);
+		if (!helpers)
+			mRunLock.unlock();
+	}
+
+	QFreeRdpEncodeBatch batch;
+	batch.count = count;
+	batch.next = 0;
+	batch.job = job;
+	batch.jobData = jobData;
+	batch.finished = nullptr;
+	batch.jobsDone = &mJobsDone;
+
+	if (helpers) {
+		// the completion flags are kept from one batch to the next
+		if (count > mFinishedCapacity) {
+			mFinished.reset(new std::atomic<bool>[count]);
+			mFinishedCapacity = count;
+		}
+		for (int i = 0; i < count; i++)
+			mFinished[i] = false;
+		batch.finished = mFinished.get();
+
+		mBatch = &batch;
+		mWork.release(helpers);
+	}
+
+	if (!progress) {
+		batch.work();
+	} else {
+		int reported = 0;
+		auto report = [&]() {
+			int done = batch.finishedJobs(reported);
+			if (done > reported) {
+				reported = done;
+				progress(progressData, done);
+			}
+		};
+
+		batch.work(report);
+
+		// the helpers finish the last jobs, each of them releases jobsDone
+		while (reported < count) {
+			mJobsDone.acquire();
+			report();
+		}
+	}
+
+	if (helpers) {
+		// helpers that started late find nothing to do, but still use the batch
+		mHelpersDone.acquire(helpers);
+		mJobsDone.acquire(mJobsDone.available());
+		mBatch = nullptr;
+		mRunLock.unlock();
+	}
+}
+
+
+#ifdef BUILD_TESTS
+#include "tests/allocationcounter.h"
+#include "tests/qfreerdptestharness.h"
+#include "qfreerdppeer.h"
+
+#include <QElapsedTimer>
+#include <QImage>
+#include <QTest>
+
+#include <winpr/stream.h>
+
+void QFreeRdpTest::encoderTestRun_data() {
+	QTest::addColumn<int>("threads");
+	QTest::addColumn<int>("jobs");
+
+	QTest::newRow("single thread") << 1 << 50;
+	QTest::newRow("less jobs than threads") << 4 << 3;
+	QTest::newRow("many jobs") << 4 << 500;
+}
+
+void QFreeRdpTest::encoderTestRun() {
+	QFETCH(int, threads);
+	QFETCH(int, jobs);
+
+	QFreeRdpEncoder *encoder = QFreeRdpEncoder::instance();
+	int previous = encoder->threadCount();
+	encoder->setThreadCount(threads);
+
+	// each job runs exactly once, with the contexts of the thread running it
+	QVector<int> runs(jobs, 0);
+	QVector<QFreeRdpCodecContexts *> contexts(jobs, nullptr);
+	encoder->run(jobs, [&](int index, QFreeRdpCodecContexts &codecs) {
+		runs[index]++;
+		contexts[index] = &codecs;
+	});
+
+	QCOMPARE(runs, QVector<int>(jobs, 1));
+	if (threads == 1) {
+		for (QFreeRdpCodecContexts *codecs : contexts)
+			QCOMPARE(codecs, &QFreeRdpCodecContexts::local());
+	}
+
+	QVERIFY(QFreeRdpCodecContexts::local().planar(64, 32, true));
+
+	encoder->setThreadCount(previous);
+}
+
+void QFreeRdpTest::encoderTestProgress() {
+	QFreeRdpEncoder *encoder = QFreeRdpEncoder::instance();
+	int previous = encoder->threadCount();
+	encoder->setThreadCount(4);
+
+	// progress only reports jobs that are finished, in order, up to the last one
+	const int jobs = 200;
+	QVector<int> results(jobs, 0);
+	QVector<int> reports;
+	bool consistent = true;
+	encoder->run(jobs, [&](int index, QFreeRdpCodecContexts &) {
+		if (index % 7 == 0)
+			QThread::usleep(200);
+		results[index] = index + 1;
+	}, [&](int done) {
+		for (int i = 0; i < done; i++)
+			consistent &= (results[i] == i + 1);
+		reports.append(done);
+	});
+
+	QVERIFY(consistent);
+	QVERIFY(!reports.isEmpty());
+	QCOMPARE(reports.last(), jobs);
+	for (int i = 1; i < reports.size(); i++)
+		QVERIFY(reports[i] > reports[i - 1]);
+
+	encoder->setThreadCount(previous);
+}
+
+void QFreeRdpTest::encoderTestRemoteFx() {
+	QImage image(200, 130, QImage::Format_RGB32);
+	for (int y = 0; y < image.height(); y++)
+		for (int x = 0; x < image.width(); x++)
+			image.setPixel(x, y, qRgb(x, y, (x * y) & 0xff));
+
+	// two messages from the same context both carry the headers, edge tiles
+	// are clipped to the image
+	QFreeRdpCodecContexts &codecs = QFreeRdpCodecContexts::local();
+	const RFX_RECT rects[] = { { 0, 0, 64, 64 }, { 192, 128, 8, 2 } };
+	QVector<size_t> sizes;
+	for (int i = 0; i < 2; i++) {
+		RFX_CONTEXT *rfx = codecs.rfx(image.width(), image.height());
+		QVERIFY(rfx);
+
+		RFX_MESSAGE *message = rfx_encode_message(rfx, rects, 2, image.constBits(), image.width(),
+				image.height(), image.bytesPerLine());
+		QVERIFY(message);
+
+		size_t capacity = QFreeRdpCodecContexts::rfxMessageSize(message);
+		std::vector<BYTE> buffer(capacity);
+		wStream stream;
+		wStream *s = Stream_StaticInit(&stream, buffer.data(), capacity);
+		QVERIFY(rfx_write_message(rfx, s, message));
+		rfx_message_free(rfx, message);
+
+		QVERIFY(Stream_GetPosition(s) > 0);
+		sizes.append(Stream_GetPosition(s));
+	}
+	QCOMPARE(sizes[0], sizes[1]);
+}
+
+void QFreeRdpTest::encoderTestScratchArena() {
+	QFreeRdpScratchArena arena;
+	QFreeRdpEncoder *encoder = QFreeRdpEncoder::instance();
+	const int jobs = 64;
+
+	// a frame made of rects of various sizes, encoded on several threads
+	auto frame = [&]() {
+		arena.reset();
+		QVector<uchar *> buffers(jobs, nullptr);
+		encoder->run(jobs, [&](int index, QFreeRdpCodecContexts &) {
+			size_t size = 100 + (index % 8) * 4096;
+			buffers[index] = arena.alloc(size);
+			memset(buffers[index], index, size);
+		});
+
+		// buffers don't overlap
+		for (int index = 0; index < jobs; index++) {
+			size_t size = 100 + (index % 8) * 4096;
+			QVERIFY(buffers[index]);
+			QCOMPARE(int(buffers[index][0]), index);
+			QCOMPARE(int(buffers[index][size - 1]), index);
+		}
+	};
+
+	// the first frame uses the heap, the block is then big enough
+	frame();
+	QVERIFY(arena.heapAllocations() >= quint64(jobs));
+	frame();
+	quint64 warm = arena.heapAllocations();
+	QVERIFY(arena.capacity() > 0);
+
+	for (int i = 0; i < 10; i++)
+		frame();
+	QCOMPARE(arena.heapAllocations(), warm);
+
+	// a bigger frame grows the block once
+	arena.reset();
+	arena.alloc(arena.capacity() + 1);
+	arena.reset();
+	quint64 grown = arena.heapAllocations();
+	arena.alloc(arena.capacity());
+	arena.reset();
+	QCOMPARE(arena.heapAllocations(), grown);
+}
+
+/** Runs a job on each thread of the encoder, so that they all have their planar codec */
+static void warmUpEncoderThreads(QFreeRdpEncoder *encoder) {
+	// jobs wait for each other, so that each of them runs on its own thread
+	std::atomic<int> started(0);
+	encoder->run(encoder->threadCount(), [&](int, QFreeRdpCodecContexts &codecs) {
+		started++;
+		QElapsedTimer timer;
+		timer.start();
+		while (started < encoder->threadCount() && timer.elapsed() < 5000)
+			QThread::yieldCurrentThread();
+		codecs.planar(64, 64, false);
+	});
+}
+
+void QFreeRdpTest::encoderTestWarmRun() {
+	QFreeRdpEncoder *encoder = QFreeRdpEncoder::instance();
+	int previous = encoder->threadCount();
+	encoder->setThreadCount(4);
+	warmUpEncoderThreads(encoder);
+
+	QImage image(256, 192, QImage::Format_RGB32);
+	for (int y = 0; y < image.height(); y++)
+		for (int x = 0; x < image.width(); x++)
+			image.setPixel(x, y, qRgb(x, y, (x * y) & 0xff));
+
+	// a frame encodes the 64x64 tiles of the image with the planar codec, in
+	// the buffers of an arena
+	const int tilesPerRow = image.width() / 64;
+	const int jobs = tilesPerRow * (image.height() / 64);
+	QFreeRdpScratchArena arena;
+	std::vector<const BYTE *> results(jobs, nullptr);
+	std::vector<UINT32> sizes(jobs, 0);
+	int reported = 0;
+	auto frame = [&]() {
+		arena.reset();
+		reported = 0;
+		encoder->run(jobs, [&](int index, QFreeRdpCodecContexts &codecs) {
+			const BYTE *src = image.constBits() + (index / tilesPerRow) * 64 * image.bytesPerLine() +
+					(index % tilesPerRow) * 64 * 4;
+			sizes[index] = 64 * 64 * 4 + 64;
+			BYTE *dst = arena.alloc(sizes[index]);
+			BITMAP_PLANAR_CONTEXT *planar = codecs.planar(64, 64, false);
+			results[index] = (planar && dst) ? freerdp_bitmap_compress_planar(planar, src, PIXEL_FORMAT_BGRX32,
+					64, 64, image.bytesPerLine(), dst, &sizes[index]) : nullptr;
+		}, [&](int done) {
+			reported = done;
+		});
+	};
+
+	// the first frames size the arena
+	frame();
+	frame();
+
+	quint64 allocations = testHeapAllocations();
+	quint64 arenaAllocations = arena.heapAllocations();
+	for (int i = 0; i < 10; i++)
+		frame();
+	QCOMPARE(testHeapAllocations(), allocations);
+	QCOMPARE(arena.heapAllocations(), arenaAllocations);
+
+	QCOMPARE(reported, jobs);
+	for (int index = 0; index < jobs; index++) {
+		QVERIFY(results[index]);
+		QVERIFY(sizes[index] > 0);
+	}
+
+	encoder->setThreadCount(previous);
+}
+
+void QFreeRdpTest::encoderTestWarmBitmapUpdate() {
+	QFreeRdpEncoder *encoder = QFreeRdpEncoder::instance();
+	int previous = encoder->threadCount();
+	encoder->setThreadCount(4);
+	warmUpEncoderThreads(encoder);
+
+	QImage image(256, 192, QImage::Format_RGB32);
+	for (int y = 0; y < image.height(); y++)
+		for (int x = 0; x < image.width(); x++)
+			image.setPixel(x, y, qRgb((x * y) & 0xff, x, y));
+
+	// the tiles of a bitmap update at 32 bpp, encoded as the peer does
+	QVector<QRect> rects;
+	for (int y = 0; y < image.height(); y += 64)
+		for (int x = 0; x < image.width(); x += 64)
+			rects.append(QRect(x, y, 64, 64));
+
+	QFreeRdpScratchArena arena;
+	std::vector<BITMAP_DATA> bitmaps(rects.size());
+	auto frame = [&]() {
+		arena.reset();
+		encoder->run(rects.size(), [&](int i, QFreeRdpCodecContexts &codecs) {
+			QFreeRdpPeer::encodeBitmap(&image, rects.at(i), 32, nullptr, arena, codecs, bitmaps[i]);
+		});
+	};
+
+	frame();
+	frame();
+
+	quint64 allocations = testHeapAllocations();
+	quint64 arenaAllocations = arena.heapAllocations();
+	for (int i = 0; i < 10; i++)
+		frame();
+	QCOMPARE(testHeapAllocations(), allocations);
+	QCOMPARE(arena.heapAllocations(), arenaAllocations);
+
+	for (const BITMAP_DATA &bitmap : bitmaps) {
+		QVERIFY(bitmap.bitmapDataStream);
+		QVERIFY(bitmap.bitmapLength > 0);
+	}
+
+	encoder->setThreadCount(previous);
+}
+
+#endif // BUILD_TESTS
+
+QT_END_NAMESPACE
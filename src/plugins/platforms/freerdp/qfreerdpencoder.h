@@ -0,0 +1,221 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __QFREERDPENCODER_H__
+#define __QFREERDPENCODER_H__
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <freerdp/codec/interleaved.h>
+#include <freerdp/codec/nsc.h>
+#include <freerdp/codec/planar.h>
+#include <freerdp/codec/rfx.h>
+
+#include <QMutex>
+#include <QSemaphore>
+
+QT_BEGIN_NAMESPACE
+
+/**
+ * @brief codec contexts owned by an encoding thread
+ *
+ * FreeRDP codec contexts keep state between calls and can't be shared, each
+ * thread running encode jobs gets its own set, created on first use.
+ */
+class QFreeRdpCodecContexts {
+public:
+	QFreeRdpCodecContexts();
+	~QFreeRdpCodecContexts();
+
+	/**
+	 * @return the planar encoder, reset for a bitmap of the given size. The
+	 * reset reallocates the planes, it is skipped when the size is the one of
+	 * the previous call.
+	 */
+	BITMAP_PLANAR_CONTEXT *planar(int width, int height, bool topdown);
+
+	/** @return the interleaved encoder */
+	BITMAP_INTERLEAVED_CONTEXT *interleaved();
+
+	/**
+	 * @return the NSC encoder, configured for a bitmap of the given size
+	 *
+	 * @param colorLossLevel from 1 (lossless chroma) to 7
+	 * @param allowSubsampling if the chroma planes can be subsampled
+	 * @param dynamicFidelity if the color loss can be lowered for bitmaps with few colors
+	 */
+	NSC_CONTEXT *nsc(int width, int height, UINT32 colorLossLevel, bool allowSubsampling,
+			bool dynamicFidelity);
+
+	/** @return the maximum size of a bitmap encoded by the NSC encoder */
+	static size_t nscMaxSize(int width, int height);
+
+	/**
+	 * @return the RemoteFX encoder for a screen of the given size. The context
+	 * is reset, so that the next message starts with the RemoteFX headers.
+	 */
+	RFX_CONTEXT *rfx(int width, int height);
+
+	/** @return the maximum size of an encoded RemoteFX message, headers included */
+	static size_t rfxMessageSize(const RFX_MESSAGE *message);
+
+	/** @return the contexts of the calling thread */
+	static QFreeRdpCodecContexts &local();
+
+protected:
+	BITMAP_PLANAR_CONTEXT *mPlanar;
+	int mPlanarWidth;
+	int mPlanarHeight;
+	BITMAP_INTERLEAVED_CONTEXT *mInterleaved;
+	NSC_CONTEXT *mNsc;
+	RFX_CONTEXT *mRfx;
+};
+
+/**
+ * @brief buffers of the encoded data of a frame
+ *
+ * Buffers are carved out of a single block that is kept from one frame to the
+ * next, so that repainting does not allocate once the block is as big as the
+ * largest frame. A frame that doesn't fit gets its extra buffers from the heap,
+ * and the block grows at the next reset(). alloc() can be called from the
+ * encoder threads.
+ */
+class QFreeRdpScratchArena {
+public:
+	QFreeRdpScratchArena();
+	~QFreeRdpScratchArena();
+
+	/** Starts a new frame, the buffers of the previous one must not be used anymore */
+	void reset();
+
+	/** @return a buffer of at least size bytes, valid until the next reset() */
+	uchar *alloc(size_t size);
+
+	/** @return the size of the block */
+	size_t capacity() const { return mCapacity; }
+
+	/** @return the number of heap allocations done since the creation of the arena */
+	quint64 heapAllocations() const { return mHeapAllocations; }
+
+protected:
+	std::unique_ptr<uchar[]> mBlock;
+	size_t mCapacity;
+	std::atomic<size_t> mUsed;
+	QMutex mOverflowLock;
+	std::vector<uchar *> mOverflow;
+	quint64 mHeapAllocations;
+};
+
+class QFreeRdpEncodeWorker;
+struct QFreeRdpEncodeBatch;
+
+/**
+ * @brief process-wide pool encoding the rectangles of frames in parallel
+ *
+ * Peers cut their frame into independent jobs, run() spreads them on the
+ * workers and returns once they are all encoded, so that the peer can send
+ * the results in order. Idle threads take the next pending job, the calling
+ * thread included, which keeps the cores busy when jobs have uneven costs.
+ * Jobs are taken in order, so a peer can also send the first results while the
+ * following ones are being encoded.
+ *
+ * The workers are started once and jobs are only referenced, a run() does not
+ * allocate. The workers help one run() at a time, a thread calling run() while
+ * they are busy encodes its jobs alone.
+ */
+class QFreeRdpEncoder {
+public:
+	/** @return the encoder shared by all the peers */
+	static QFreeRdpEncoder *instance();
+
+	~QFreeRdpEncoder();
+
+	/**
+	 * Sets the number of threads encoding a frame
+	 *
+	 * @param count number of threads including the calling one, 0 to pick
+	 * 		one from the number of cores
+	 */
+	void setThreadCount(int count);
+
+	/** @return the number of threads encoding a frame */
+	int threadCount() const { return mThreads; }
+
+	/**
+	 * Runs job(0) to job(count - 1) and waits for their completion, job is
+	 * called as job(int index, QFreeRdpCodecContexts &codecs). Jobs must only
+	 * write their own output.
+	 */
+	template <typename JobFn>
+	void run(int count, const JobFn &job) {
+		runBatch(count, &callJob<JobFn>, &job, nullptr, nullptr);
+	}
+
+	/**
+	 * Same as run(), progress(done) is also called on the calling thread each
+	 * time more jobs are finished, with job(0) to job(done - 1) all finished.
+	 * The last call is progress(count).
+	 */
+	template <typename JobFn, typename ProgressFn>
+	void run(int count, const JobFn &job, const ProgressFn &progress) {
+		runBatch(count, &callJob<JobFn>, &job, &callProgress<ProgressFn>, &progress);
+	}
+
+protected:
+	typedef void (*JobCall)(const void *job, int index, QFreeRdpCodecContexts &codecs);
+	typedef void (*ProgressCall)(const void *progress, int done);
+
+	QFreeRdpEncoder();
+
+	template <typename JobFn>
+	static void callJob(const void *job, int index, QFreeRdpCodecContexts &codecs) {
+		(*static_cast<const JobFn *>(job))(index, codecs);
+	}
+
+	template <typename ProgressFn>
+	static void callProgress(const void *progress, int done) {
+		(*static_cast<const ProgressFn *>(progress))(done);
+	}
+
+	void runBatch(int count, JobCall job, const void *jobData, ProgressCall progress, const void *progressData);
+
+	/** stops the workers, mRunLock must be held */
+	void stopWorkers();
+
+	friend struct QFreeRdpEncodeBatch;
+	friend class QFreeRdpEncodeWorker;
+
+	int mThreads;
+	QMutex mRunLock;
+	std::vector<QFreeRdpEncodeWorker *> mWorkers;
+	QFreeRdpEncodeBatch *mBatch;
+	QSemaphore mWork;
+	QSemaphore mJobsDone;
+	QSemaphore mHelpersDone;
+	std::unique_ptr<std::atomic<bool>[]> mFinished;
+	int mFinishedCapacity;
+};
+
+QT_END_NAMESPACE
+
+#endif // __QFREERDPENCODER_H__
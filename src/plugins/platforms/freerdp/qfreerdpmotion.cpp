@@ -0,0 +1,505 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <string.h>
+
+#include "qfreerdpmotion.h"
+#include "qfreerdptilecompare.h"
+
+/** width of the strips of the row hash cache, matches the compositor tiles */
+#define MOTION_STRIP_WIDTH 64
+/** height of the bands scanned for horizontal scrolls */
+#define MOTION_BAND_HEIGHT 64
+/** minimal number of rows of a move */
+#define MOTION_MIN_ROWS 16
+/** minimal width of a move */
+#define MOTION_MIN_WIDTH 64
+/** number of unambiguous rows that must agree on a vertical offset */
+#define MOTION_MIN_VOTES 4
+/** width of the pattern searched for horizontal scrolls */
+#define MOTION_PROBE_WIDTH 16
+
+QT_BEGIN_NAMESPACE
+
+QFreeRdpMotionEstimator::QFreeRdpMotionEstimator()
+: mStrips(0)
+{}
+
+void QFreeRdpMotionEstimator::reset(const QSize &size) {
+	mSize = size;
+	mStrips = (size.width() + MOTION_STRIP_WIDTH - 1) / MOTION_STRIP_WIDTH;
+
+	// 0 is not the hash of any row, the first frame never matches
+	mRowHashes.assign(mStrips * size.height(), 0);
+}
+
+quint64 QFreeRdpMotionEstimator::rowHash(const QImage &image, int strip, int y) const {
+	int x = strip * MOTION_STRIP_WIDTH;
+	int width = std::min(MOTION_STRIP_WIDTH, mSize.width() - x);
+	return QFreeRdpTileComparator::hash(image.constScanLine(y) + x * 4, image.bytesPerLine(), width, 1);
+}
+
+void QFreeRdpMotionEstimator::updateHashes(const QImage &image, const QRect &rect) {
+	QRect r = rect.intersected(QRect(QPoint(0, 0), mSize)).intersected(image.rect());
+	if (r.isEmpty())
+		return;
+
+	for (int strip = r.left() / MOTION_STRIP_WIDTH; strip <= r.right() / MOTION_STRIP_WIDTH; strip++) {
+		quint64 *hashes = &mRowHashes[strip * mSize.height()];
+		for (int y = r.top(); y <= r.bottom(); y++)
+			hashes[y] = rowHash(image, strip, y);
+	}
+}
+
+void QFreeRdpMotionEstimator::mergeMove(QFreeRdpMoveList &moves, const QFreeRdpMove &move) {
+	QPoint offset = move.dst - move.src.topLeft();
+
+	for (QFreeRdpMove &m : moves) {
+		if (m.dst - m.src.topLeft() != offset)
+			continue;
+
+		// side by side strips of a vertical scroll
+		if (m.src.top() == move.src.top() && m.src.height() == move.src.height() &&
+				m.src.right() + 1 == move.src.left()) {
+			m.src.setRight(move.src.right());
+			return;
+		}
+
+		// stacked bands of an horizontal scroll
+		if (m.src.left() == move.src.left() && m.src.width() == move.src.width() &&
+				m.src.bottom() + 1 == move.src.top()) {
+			m.src.setBottom(move.src.bottom());
+			return;
+		}
+	}
+
+	moves.append(move);
+}
+
+void QFreeRdpMotionEstimator::findStripMove(int strip, int top, int rows, const quint64 *current,
+		QFreeRdpMoveList &moves)
+{
+	const int height = mSize.height();
+	const quint64 *previous = &mRowHashes[strip * height];
+
+	// index the rows of the previous frame around the dirty rows, rows that
+	// appear several times (blank lines...) can't tell anything
+	int lo = std::max(0, top - rows);
+	int hi = std::min(height - 1, top + 2 * rows - 1);
+	mRowIndex.clear();
+	for (int y = lo; y <= hi; y++) {
+		auto it = mRowIndex.find(previous[y]);
+		if (it == mRowIndex.end())
+			mRowIndex.insert(previous[y], y);
+		else
+			it.value() = -1;
+	}
+
+	QHash<int, int> votes;
+	for (int i = 0; i < rows; i++) {
+		if (current[i] == previous[top + i])
+			continue;
+
+		int y = mRowIndex.value(current[i], -1);
+		if (y >= 0 && y != top + i)
+			votes[top + i - y]++;
+	}
+
+	int dy = 0;
+	int bestVotes = 0;
+	for (auto it = votes.cbegin(); it != votes.cend(); ++it) {
+		if (it.value() > bestVotes) {
+			dy = it.key();
+			bestVotes = it.value();
+		}
+	}
+
+	if (bestVotes < MOTION_MIN_VOTES)
+		return;
+
+	// longest run of rows matching the previous frame with this offset
+	int bestStart = 0, bestLen = 0, bestChanged = 0;
+	int start = 0, len = 0, changed = 0;
+	for (int i = 0; i < rows; i++) {
+		int y = top + i - dy;
+		if (y >= 0 && y < height && current[i] == previous[y]) {
+			if (!len)
+				start = i, changed = 0;
+			len++;
+			if (current[i] != previous[top + i])
+				changed++;
+
+			if (len > bestLen) {
+				bestStart = start;
+				bestLen = len;
+				bestChanged = changed;
+			}
+		} else {
+			len = 0;
+		}
+	}
+
+	if (bestLen < MOTION_MIN_ROWS || bestChanged < MOTION_MIN_ROWS / 2)
+		return;
+
+	int x = strip * MOTION_STRIP_WIDTH;
+	int width = std::min(MOTION_STRIP_WIDTH, mSize.width() - x);
+	QFreeRdpMove move = { QRect(x, top + bestStart - dy, width, bestLen), QPoint(x, top + bestStart) };
+
+	// moves are applied in order, the source must not have been overwritten before
+	for (const QFreeRdpMove &m : moves) {
+		if (m.dstRect().intersects(move.src))
+			return;
+	}
+
+	mergeMove(moves, move);
+}
+
+void QFreeRdpMotionEstimator::findVerticalMoves(const QImage &currentImage, const QRegion &dirty,
+		QFreeRdpMoveList &moves)
+{
+	QRect bounds = QRect(QPoint(0, 0), mSize).intersected(currentImage.rect());
+	QRect dirtyBounds = dirty.boundingRect().intersected(bounds);
+	if (dirtyBounds.isEmpty())
+		return;
+
+	for (int strip = dirtyBounds.left() / MOTION_STRIP_WIDTH; strip <= dirtyBounds.right() / MOTION_STRIP_WIDTH; strip++) {
+		QRect stripRect(strip * MOTION_STRIP_WIDTH, 0, MOTION_STRIP_WIDTH, mSize.height());
+
+		// rows of the strip touched by the damage, as top to bottom intervals
+		QVector<QPair<int, int>> intervals;
+		for (const QRect &r : dirty.intersected(stripRect.intersected(bounds))) {
+			if (!intervals.isEmpty() && r.top() <= intervals.last().second + 1)
+				intervals.last().second = std::max(intervals.last().second, r.bottom());
+			else
+				intervals.append(qMakePair(r.top(), r.bottom()));
+		}
+
+		int rows = 0;
+		for (const QPair<int, int> &interval : intervals)
+			rows += interval.second - interval.first + 1;
+
+		mCurrentHashes.resize(rows);
+		quint64 *current = mCurrentHashes.data();
+		for (const QPair<int, int> &interval : intervals) {
+			for (int y = interval.first; y <= interval.second; y++)
+				*current++ = rowHash(currentImage, strip, y);
+		}
+
+		// moves are searched against the previous content of the whole strip
+		current = mCurrentHashes.data();
+		for (const QPair<int, int> &interval : intervals) {
+			int intervalRows = interval.second - interval.first + 1;
+			if (intervalRows >= MOTION_MIN_ROWS)
+				findStripMove(strip, interval.first, intervalRows, current, moves);
+			current += intervalRows;
+		}
+
+		// then the cache follows the frame
+		quint64 *cache = &mRowHashes[strip * mSize.height()];
+		current = mCurrentHashes.data();
+		for (const QPair<int, int> &interval : intervals) {
+			int intervalRows = interval.second - interval.first + 1;
+			memcpy(cache + interval.first, current, intervalRows * sizeof(quint64));
+			current += intervalRows;
+		}
+	}
+}
+
+static bool isUniform(const uchar *pixels, int count) {
+	const quint32 *p = (const quint32 *)pixels;
+	for (int i = 1; i < count; i++) {
+		if (p[i] != p[0])
+			return false;
+	}
+	return true;
+}
+
+void QFreeRdpMotionEstimator::findHorizontalMoves(const QImage &current, const QImage &previous,
+		const QRect &area, QFreeRdpMoveList &moves) const
+{
+	QRect r = area.intersected(current.rect()).intersected(previous.rect());
+	if (r.width() < MOTION_MIN_WIDTH + MOTION_PROBE_WIDTH || r.height() < MOTION_MIN_ROWS)
+		return;
+
+	const int width = r.width();
+	const int probeX = r.left() + (width - MOTION_PROBE_WIDTH) / 2;
+
+	for (int bandTop = r.top(); bandTop <= r.bottom(); bandTop += MOTION_BAND_HEIGHT) {
+		int bandHeight = std::min(MOTION_BAND_HEIGHT, r.bottom() + 1 - bandTop);
+		if (bandHeight < MOTION_MIN_ROWS)
+			continue;
+
+		// search a pattern of a few sample rows of the current frame in the
+		// same row of the previous frame
+		QHash<int, int> votes;
+		for (int sample = 0; sample < 4; sample++) {
+			int y = bandTop + ((2 * sample + 1) * bandHeight) / 8;
+			const uchar *cur = current.constScanLine(y);
+			const uchar *prev = previous.constScanLine(y);
+			if (!memcmp(cur + r.left() * 4, prev + r.left() * 4, width * 4))
+				continue;
+
+			const uchar *probe = cur + probeX * 4;
+			if (isUniform(probe, MOTION_PROBE_WIDTH))
+				continue;
+
+			int found = -1;
+			for (int x = r.left(); x <= r.right() + 1 - MOTION_PROBE_WIDTH; x++) {
+				if (x == probeX || memcmp(prev + x * 4, probe, MOTION_PROBE_WIDTH * 4))
+					continue;
+
+				if (found >= 0) {
+					found = -1;
+					break;
+				}
+				found = x;
+			}
+
+			if (found >= 0)
+				votes[probeX - found]++;
+		}
+
+		int dx = 0;
+		int bestVotes = 0;
+		for (auto it = votes.cbegin(); it != votes.cend(); ++it) {
+			if (it.value() > bestVotes) {
+				dx = it.key();
+				bestVotes = it.value();
+			}
+		}
+
+		int moveWidth = width - std::abs(dx);
+		if (bestVotes < 2 || moveWidth < MOTION_MIN_WIDTH)
+			continue;
+
+		int srcX = r.left() + std::max(0, -dx);
+		int dstX = r.left() + std::max(0, dx);
+
+		int bestStart = 0, bestLen = 0, bestChanged = 0;
+		int start = 0, len = 0, changed = 0;
+		for (int y = bandTop; y < bandTop + bandHeight; y++) {
+			const uchar *cur = current.constScanLine(y) + dstX * 4;
+			const uchar *prev = previous.constScanLine(y);
+			if (!memcmp(cur, prev + srcX * 4, moveWidth * 4)) {
+				if (!len)
+					start = y, changed = 0;
+				len++;
+				if (memcmp(cur, prev + dstX * 4, moveWidth * 4))
+					changed++;
+
+				if (len > bestLen) {
+					bestStart = start;
+					bestLen = len;
+					bestChanged = changed;
+				}
+			} else {
+				len = 0;
+			}
+		}
+
+		if (bestLen < MOTION_MIN_ROWS || bestChanged < MOTION_MIN_ROWS / 2)
+			continue;
+
+		mergeMove(moves, { QRect(srcX, bestStart, moveWidth, bestLen), QPoint(dstX, bestStart) });
+	}
+}
+
+bool QFreeRdpMotionEstimator::verifyMove(const QImage &current, const QImage &previous,
+		const QFreeRdpMove &hint, QFreeRdpMove &confirmed) const
+{
+	QRect bounds = current.rect().intersected(previous.rect());
+	QPoint offset = hint.dst - hint.src.topLeft();
+
+	// clip both the source and the destination
+	QRect src = hint.src.intersected(bounds).intersected(bounds.translated(-offset));
+	if (src.width() < MOTION_MIN_WIDTH || src.height() < MOTION_MIN_ROWS || offset.isNull())
+		return false;
+
+	QRect dst = src.translated(offset);
+	int bestStart = 0, bestLen = 0;
+	int start = 0, len = 0;
+	for (int i = 0; i < src.height(); i++) {
+		const uchar *cur = current.constScanLine(dst.top() + i) + dst.left() * 4;
+		const uchar *prev = previous.constScanLine(src.top() + i) + src.left() * 4;
+		if (!memcmp(cur, prev, src.width() * 4)) {
+			if (!len)
+				start = i;
+			len++;
+
+			if (len > bestLen) {
+				bestStart = start;
+				bestLen = len;
+			}
+		} else {
+			len = 0;
+		}
+	}
+
+	if (bestLen < MOTION_MIN_ROWS)
+		return false;
+
+	confirmed.src = QRect(src.left(), src.top() + bestStart, src.width(), bestLen);
+	confirmed.dst = confirmed.src.topLeft() + offset;
+	return true;
+}
+
+void QFreeRdpMotionEstimator::applyMove(QImage &image, const QFreeRdpMove &move) {
+	const int stride = image.bytesPerLine();
+	const int length = move.src.width() * 4;
+	const int height = move.src.height();
+	uchar *bits = image.bits();
+
+	// rows are copied in the order that keeps the source intact when overlapping
+	bool bottomUp = move.dst.y() > move.src.top();
+	for (int i = 0; i < height; i++) {
+		int row = bottomUp ? height - 1 - i : i;
+		const uchar *src = bits + (move.src.top() + row) * stride + move.src.left() * 4;
+		uchar *dst = bits + (move.dst.y() + row) * stride + move.dst.x() * 4;
+		memmove(dst, src, length);
+	}
+}
+
+
+#ifdef BUILD_TESTS
+#include "tests/qfreerdptestharness.h"
+
+#include <QTest>
+
+/** fills an image with rows that are all different */
+static void fillRows(QImage &image, int seed) {
+	for (int y = 0; y < image.height(); y++) {
+		for (int x = 0; x < image.width(); x++)
+			image.setPixel(x, y, qRgb((x * 7 + seed) & 0xff, (y + seed) & 0xff, ((y + seed) >> 8) & 0xff));
+	}
+}
+
+void QFreeRdpTest::motionTestVerticalScroll_data() {
+	QTest::addColumn<int>("dy");
+
+	QTest::newRow("scroll down") << 24;
+	QTest::newRow("scroll up") << -40;
+}
+
+void QFreeRdpTest::motionTestVerticalScroll() {
+	QFETCH(int, dy);
+
+	QImage previous(256, 256, QImage::Format_ARGB32_Premultiplied);
+	fillRows(previous, 0);
+
+	QFreeRdpMotionEstimator estimator;
+	estimator.reset(previous.size());
+	estimator.updateHashes(previous, previous.rect());
+
+	// scroll the viewport (32, 32, 192, 192) and paint the exposed strip
+	const QRect viewport(32, 32, 192, 192);
+	QImage current = previous.copy();
+	QFreeRdpMove scroll;
+	if (dy > 0)
+		scroll = { QRect(viewport.left(), viewport.top(), viewport.width(), viewport.height() - dy),
+				QPoint(viewport.left(), viewport.top() + dy) };
+	else
+		scroll = { QRect(viewport.left(), viewport.top() - dy, viewport.width(), viewport.height() + dy),
+				QPoint(viewport.left(), viewport.top()) };
+	QFreeRdpMotionEstimator::applyMove(current, scroll);
+
+	QRegion exposed = QRegion(viewport) - scroll.dstRect();
+	for (const QRect &r : exposed)
+		for (int y = r.top(); y <= r.bottom(); y++)
+			for (int x = r.left(); x <= r.right(); x++)
+				current.setPixel(x, y, qRgb(255, 255, 255));
+
+	QFreeRdpMoveList moves;
+	estimator.findVerticalMoves(current, QRegion(viewport), moves);
+	QVERIFY(!moves.isEmpty());
+
+	// replaying the moves on the previous frame gives the current one out of the exposed strip
+	QRegion covered;
+	for (const QFreeRdpMove &move : moves) {
+		QCOMPARE(move.dst - move.src.topLeft(), QPoint(0, dy));
+		QFreeRdpMotionEstimator::applyMove(previous, move);
+		covered += move.dstRect();
+	}
+
+	for (const QRect &r : covered)
+		QCOMPARE(previous.copy(r), current.copy(r));
+
+	// the strips at the borders of the viewport are only partially scrolled
+	QVERIFY(covered.intersected(scroll.dstRect()).boundingRect().width() >= 128);
+
+	// the cache now describes the current frame
+	moves.clear();
+	estimator.findVerticalMoves(current, QRegion(viewport), moves);
+	QVERIFY(moves.isEmpty());
+}
+
+void QFreeRdpTest::motionTestHorizontalScroll() {
+	QImage previous(256, 128, QImage::Format_ARGB32_Premultiplied);
+	for (int y = 0; y < previous.height(); y++)
+		for (int x = 0; x < previous.width(); x++)
+			previous.setPixel(x, y, qRgb((x * 13) & 0xff, (x * 5 + y) & 0xff, (x * x) & 0xff));
+
+	QImage current = previous.copy();
+	QFreeRdpMove scroll = { QRect(20, 0, 236, 128), QPoint(0, 0) };
+	QFreeRdpMotionEstimator::applyMove(current, scroll);
+
+	QFreeRdpMotionEstimator estimator;
+	QFreeRdpMoveList moves;
+	estimator.findHorizontalMoves(current, previous, current.rect(), moves);
+
+	QCOMPARE(moves.size(), 1);
+	QCOMPARE(moves[0].src, scroll.src);
+	QCOMPARE(moves[0].dst, scroll.dst);
+}
+
+void QFreeRdpTest::motionTestVerifyMove() {
+	QImage previous(256, 256, QImage::Format_ARGB32_Premultiplied);
+	previous.fill(Qt::black);
+	QImage window(100, 80, QImage::Format_ARGB32_Premultiplied);
+	fillRows(window, 3);
+
+	for (int y = 0; y < window.height(); y++)
+		memcpy(previous.scanLine(10 + y) + 10 * 4, window.constScanLine(y), window.width() * 4);
+
+	// the window moves by (50, 60) and its 20 last rows are covered by another window
+	QImage current(previous.size(), previous.format());
+	current.fill(Qt::black);
+	for (int y = 0; y < window.height(); y++)
+		memcpy(current.scanLine(70 + y) + 60 * 4, window.constScanLine(y), window.width() * 4);
+	for (int y = 130; y < 150; y++)
+		memset(current.scanLine(y), 0xff, current.bytesPerLine());
+
+	QFreeRdpMotionEstimator estimator;
+	QFreeRdpMove confirmed;
+	QVERIFY(estimator.verifyMove(current, previous, { QRect(10, 10, 100, 80), QPoint(60, 70) }, confirmed));
+	QCOMPARE(confirmed.src, QRect(10, 10, 100, 60));
+	QCOMPARE(confirmed.dst, QPoint(60, 70));
+
+	// a wrong hint
+	QVERIFY(!estimator.verifyMove(current, previous, { QRect(10, 10, 100, 80), QPoint(61, 70) }, confirmed));
+}
+
+#endif // BUILD_TESTS
+
+QT_END_NAMESPACE
@@ -0,0 +1,112 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __QFREERDPMOTION_H__
+#define __QFREERDPMOTION_H__
+
+#include <vector>
+
+#include <QHash>
+#include <QImage>
+#include <QRect>
+#include <QRegion>
+#include <QVector>
+
+QT_BEGIN_NAMESPACE
+
+/** @brief a screen to screen copy, the content of src is moved at dst */
+struct QFreeRdpMove {
+	QRect src;
+	QPoint dst;
+
+	QRect dstRect() const { return QRect(dst, src.size()); }
+};
+
+typedef QVector<QFreeRdpMove> QFreeRdpMoveList;
+
+/**
+ * @brief detects scrolls and moves between two frames
+ *
+ * The estimator keeps the hash of each row of each 64 pixels wide strip of
+ * the content known by the peers (the row hash cache). Vertical scrolls are
+ * found after the damage has been computed, by matching the rows of the dirty
+ * area against the cache, so no copy of the previous frame is needed.
+ *
+ * When a copy of the previous frame is available, move hints (window moves)
+ * and horizontal scrolls can also be verified against it.
+ *
+ * Moves must be applied in order by the peers, before the residual damage.
+ */
+class QFreeRdpMotionEstimator {
+public:
+	QFreeRdpMotionEstimator();
+
+	/** Drops the row hash cache for a screen of the given size, nothing will match until it is refilled */
+	void reset(const QSize &size);
+
+	/** Recomputes the row hashes covering rect from the given image */
+	void updateHashes(const QImage &image, const QRect &rect);
+
+	/**
+	 * Searches vertical scrolls in the dirty area of the current frame and
+	 * refreshes the row hash cache of the dirty area.
+	 *
+	 * @param current the current frame
+	 * @param dirty the area modified since the content described by the cache
+	 * @param moves the list to append the detected moves to
+	 */
+	void findVerticalMoves(const QImage &current, const QRegion &dirty, QFreeRdpMoveList &moves);
+
+	/**
+	 * Searches horizontal scrolls inside an area by comparing with the
+	 * previous frame.
+	 */
+	void findHorizontalMoves(const QImage &current, const QImage &previous, const QRect &area,
+			QFreeRdpMoveList &moves) const;
+
+	/**
+	 * Checks a move hint against the previous frame.
+	 *
+	 * @param hint the supposed move
+	 * @param confirmed the biggest part of the hint that is an exact copy
+	 * @return if some part of the hint has been confirmed
+	 */
+	bool verifyMove(const QImage &current, const QImage &previous, const QFreeRdpMove &hint,
+			QFreeRdpMove &confirmed) const;
+
+	/** Applies a move on an image the same way the peers do */
+	static void applyMove(QImage &image, const QFreeRdpMove &move);
+
+protected:
+	quint64 rowHash(const QImage &image, int strip, int y) const;
+	void findStripMove(int strip, int top, int rows, const quint64 *current, QFreeRdpMoveList &moves);
+	static void mergeMove(QFreeRdpMoveList &moves, const QFreeRdpMove &move);
+
+	QSize mSize;
+	int mStrips;
+	std::vector<quint64> mRowHashes;
+	std::vector<quint64> mCurrentHashes;
+	QHash<quint64, int> mRowIndex;
+};
+
+QT_END_NAMESPACE
+
+#endif // __QFREERDPMOTION_H__
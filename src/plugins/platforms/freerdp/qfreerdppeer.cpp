@@ -44,19 +44,99 @@
 #include "qfreerdpplatform.h"
 #include "qfreerdpwindowmanager.h"
 #include "qfreerdpclipboard.h"
+#include "qfreerdpencoder.h"
 #include "qfreerdppeerclipboard.h"
 #include "qfreerdppeerkeyboard.h"
+#include "qfreerdppeerrail.h"
 
 #include <QAbstractEventDispatcher>
 #include <QSocketNotifier>
 #include <QDebug>
 #include <QMutexLocker>
+#include <QSet>
 #include <QStringList>
 #include <QtGui/qpa/qwindowsysteminterface.h>
 #include <qpa/qplatforminputcontext.h>
 #include <QtGui/private/qguiapplication_p.h>
 #include <QtCore/qmath.h>
 
+#include <algorithm>
+
+/** maximum number of EGFX frames sent and not acknowledged yet */
+#define EGFX_MAX_FRAMES_IN_FLIGHT 3
+
+/** longest interval between two EGFX frames in ms, whatever the latency */
+#define EGFX_MAX_FRAME_INTERVAL 500
+
+/** delay in ms after which an unacknowledged frame is not waited for anymore */
+#define EGFX_FRAME_ACK_TIMEOUT 2000
+
+/** delay in ms without lossy updates after which lossy areas are refined */
+#define EGFX_REFINE_DELAY 300
+
+/** bytes added by the planar codec to the size of the raw bitmap in the worst case */
+#define PLANAR_MAX_OVERHEAD 64
+
+/** number of updates in a row after which a tile is sent with AVC420 */
+#define AVC_MIN_UPDATES 8
+
+/** target bitrate of the AVC420 encoder, in bits per second */
+#define AVC_BITRATE 5000000
+
+/** size of the tiles stored in the EGFX cache */
+#define EGFX_CACHE_TILE_SIZE 64
+
+/** maximum number of tiles stored in the EGFX cache per frame */
+#define EGFX_CACHE_MAX_STORES 128
+
+/** payload of a fast-path fragment, the PDU headers are taken from the 0x3FFF bytes */
+#define BITMAP_BATCH_FRAGMENT_SIZE (0x3FFF - 32)
+
+/** maximum number of fast-path fragments of a bitmap update */
+#define BITMAP_BATCH_MAX_FRAGMENTS 8
+
+/** size of the headers of a bitmap update, and of each of its rects */
+#define BITMAP_UPDATE_HEADER_SIZE 16
+#define BITMAP_DATA_HEADER_SIZE 18
+
+/** size of the tiles stored in the bitmap cache, and the first cell that takes them */
+#define BITMAP_CACHE_TILE_SIZE 64
+#define BITMAP_CACHE_TILE_CELL 2
+
+/** the cache index is 15 bits wide, 0x7FFF being the waiting list */
+#define BITMAP_CACHE_MAX_ENTRIES 0x7FFF
+
+/** approximate size of a CacheBitmapV2 order without its bitmap, and of a MemBlt order */
+#define BITMAP_CACHE_ORDER_HEADER_SIZE 12
+#define MEMBLT_ORDER_SIZE 16
+
+/** size of the header of a surface bits command, without its bitmap data */
+#define SURFACE_BITS_HEADER_SIZE 22
+
+/** size of a RemoteFX tile: its header and at most 8192 bytes per plane */
+#define RFX_MAX_TILE_SIZE (19 + 3 * 8192)
+
+/** size of the headers of a RemoteFX message, without its rects and tiles */
+#define RFX_HEADERS_SIZE 512
+
+/** maximum number of RemoteFX tiles encoded in a message by a job */
+#define RFX_JOB_MAX_TILES 16
+
+/** frame rate at which peers start on a slow link in autodetect mode */
+#define AUTODETECT_SLOW_LINK_FPS 12
+
+/** size of the tiles that wait for the next frame when over the byte budget */
+#define BUDGET_TILE_SIZE 64
+
+/**
+ * interval between two round trip measures of the network autodetection, in ms.
+ * A bandwidth measure covers the updates sent during one interval.
+ */
+#define LINK_MEASURE_INTERVAL 2000
+
+/** smaller bandwidth measures show how much was sent, not what the link carries */
+#define BANDWIDTH_MEASURE_MIN_BYTES 65536
+
 struct RdpPeerContext {
 	rdpContext _p;
 	QFreeRdpPeer *rdpPeer;
@@ -65,8 +145,6 @@ struct RdpPeerContext {
 
 	QSocketNotifier* event;
 	QSocketNotifier* channelEvent;
-
-	NSC_CONTEXT* nsc_context;
 };
 
 
@@ -94,14 +172,6 @@ static BOOL rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	if (!codecs->planar)
 		return FALSE;
 
-	// init NSC encoder
-	context->nsc_context = nsc_context_new();
-	nsc_context_reset(context->nsc_context, settings->DesktopWidth, settings->DesktopHeight);
-	nsc_context_set_parameters(context->nsc_context, NSC_COLOR_LOSS_LEVEL, settings->NSCodecColorLossLevel);
-	nsc_context_set_parameters(context->nsc_context, NSC_ALLOW_SUBSAMPLING, settings->NSCodecAllowSubsampling ? 1 : 0);
-	nsc_context_set_parameters(context->nsc_context, NSC_DYNAMIC_COLOR_FIDELITY, settings->NSCodecAllowDynamicColorFidelity ? 1 : 0);
-	nsc_context_set_parameters(context->nsc_context, NSC_COLOR_FORMAT, PIXEL_FORMAT_BGRX32);
-
 	return TRUE;
 }
 
@@ -109,9 +179,6 @@ static void rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 	if(!context)
 		return;
 
-	nsc_context_free(context->nsc_context);
-	context->nsc_context = NULL;
-
 	// free codecs
 #if FREERDP_VERSION_MAJOR == 3 && FREERDP_VERSION_MINOR >= 5 || FREERDP_VERSION_MAJOR > 3
 	freerdp_client_codecs_free(client->context->codecs);
@@ -129,16 +196,47 @@ QFreeRdpPeer::QFreeRdpPeer(QFreeRdpPlatform *platform, freerdp_peer* client) :
 		mKeyboard(platform->mConfig),
 		mSurfaceOutputModeEnabled(false),
 		mNsCodecSupported(false),
-		mCompositor(platform->getScreen()),
+		mRfxSupported(false),
+		mNscColorLoss(1),
+		mNscMaxColorLoss(1),
 		mRenderMode(RENDER_BITMAP_UPDATES),
 		mVcm(nullptr),
 		mClipboard(nullptr),
+		mRail(nullptr),
 		mRdpgfx(nullptr),
 		mGfxOpened(false),
+		mGfxNotifier(nullptr),
 		mSurfaceCreated(false),
 		mSurfaceId(1),
-		mFrameId(0)
-{}
+		mNextSurfaceId(2),
+		mFrameId(0),
+		mEgfxCacheSlots(0),
+		mBitmapCacheId(0),
+		mClientQueueDepth(QUEUE_DEPTH_UNAVAILABLE),
+		mFrameAcksSuspended(false),
+		mAckLatency(-1),
+		mBaseFrameInterval(1000 / platform->mConfig->fps),
+		mLastFrameTime(0),
+		mRepaintPending(false),
+		mProgressive(nullptr),
+		mH264(nullptr),
+		mAvcEnabled(false),
+		mEgfxProgressive(platform->mConfig->egfx_progressive),
+		mFrameBytes(0),
+		mRttSequence(0),
+		mRttRequestTime(-1),
+		mBandwidthSequence(0),
+		mBandwidthMeasuring(false),
+		mPduPayloadBytes(),
+		mPduSentBytes()
+{
+	mClock.start();
+	mDeferredRepaint.setSingleShot(true);
+	connect(&mDeferredRepaint, &QTimer::timeout, this, &QFreeRdpPeer::repaint);
+	mRefineTimer.setSingleShot(true);
+	connect(&mRefineTimer, &QTimer::timeout, this, &QFreeRdpPeer::refineLossyRegion);
+	connect(&mLinkTimer, &QTimer::timeout, this, &QFreeRdpPeer::measureLink);
+}
 
 void QFreeRdpPeer::dropSocketNotifier(QSocketNotifier *notifier) {
 	if(notifier) {
@@ -154,14 +252,53 @@ QFreeRdpPeer::~QFreeRdpPeer() {
 	dropSocketNotifier(peerCtx->event);
 	dropSocketNotifier(peerCtx->channelEvent);
 
+	if (mPlatform->config()->egfx_autocodec) {
+		for (int i = 0; i < QFreeRdpTileClassifier::TILE_CLASS_COUNT; i++) {
+			auto tileClass = QFreeRdpTileClassifier::TileClass(i);
+			qDebug("tile classifier: %llu %s tiles (%llu pixels)", mClassifier.tiles(tileClass),
+					QFreeRdpTileClassifier::className(tileClass), mClassifier.pixels(tileClass));
+		}
+	}
+
+	if (mBandwidth.bandwidth()) {
+		qDebug("link estimate: %llu kbit/s, %d ms round trip", mBandwidth.bandwidth() * 8 / 1000,
+				mBandwidth.rtt());
+	}
+
+	if (mEgfxCache.hits() || mEgfxCache.misses()) {
+		qDebug("egfx cache: %llu hits, %llu misses (%d%% hit rate), %llu evictions",
+				mEgfxCache.hits(), mEgfxCache.misses(), mEgfxCache.hitRate(), mEgfxCache.evictions());
+	}
+
+	if (mClient->context->settings->CompressionEnabled) {
+		static const char *pduNames[PDU_KIND_COUNT] = { "bitmap updates", "surface bits", "cache orders" };
+		for (int i = 0; i < PDU_KIND_COUNT; i++) {
+			if (!mPduPayloadBytes[i])
+				continue;
+			qDebug("bulk compression: %s %llu -> %llu bytes (%llu%%)", pduNames[i], mPduPayloadBytes[i],
+					mPduSentBytes[i], (mPduSentBytes[i] * 100) / mPduPayloadBytes[i]);
+		}
+	}
+
+	if (mBitmapCache.hits() || mBitmapCache.misses()) {
+		qDebug("bitmap cache: %llu hits, %llu misses (%d%% hit rate), %llu evictions",
+				mBitmapCache.hits(), mBitmapCache.misses(), mBitmapCache.hitRate(), mBitmapCache.evictions());
+	}
+
 	if (mRdpgfx) {
+		delete mGfxNotifier;
 		rdpgfx_server_context_free(mRdpgfx);
 		mRdpgfx = nullptr;
 	}
 
+	progressive_context_free(mProgressive);
+	h264_context_free(mH264);
+
 	if (mClipboard)
 		delete mClipboard;
 
+	delete mRail;
+
 	if (mVcm)
 		WTSCloseServer(mVcm);
 	mVcm = NULL;
@@ -219,7 +356,7 @@ BOOL QFreeRdpPeer::xf_input_synchronize_event(rdpInput* input, UINT32 flags)
 void QFreeRdpPeer::sendFullRefresh(rdpSettings *settings) {
 	QRect refreshRect(0, 0, settings->DesktopWidth, settings->DesktopHeight);
 
-	repaint(QRegion(refreshRect), false);
+	refresh(QRegion(refreshRect));
 }
 
 BOOL QFreeRdpPeer::xf_input_keyboard_event(rdpInput* input, UINT16 flags, UINT8 code)
@@ -258,7 +395,7 @@ BOOL QFreeRdpPeer::xf_refresh_rect(rdpContext *context, BYTE count, const RECTAN
 	// Do not try to reduce the size of the update using the compositor's
 	// cache. We got asked for a certain size and we're going to send all
 	// of it.
-	rdpPeer->repaint(refreshRegion, false);
+	rdpPeer->refresh(refreshRegion);
 
 	return TRUE;
 }
@@ -286,6 +423,32 @@ BOOL QFreeRdpPeer::xf_surface_frame_acknowledge(rdpContext* context, UINT32 fram
 	return rdpPeer->frameAck(frameId);
 }
 
+BOOL QFreeRdpPeer::xf_rtt_measure_response(rdpAutoDetect *autodetect, RDP_TRANSPORT_TYPE /*transport*/,
+		UINT16 sequenceNumber)
+{
+	RdpPeerContext *peerContext = (RdpPeerContext *)autodetect->context;
+	QFreeRdpPeer *rdpPeer = peerContext->rdpPeer;
+
+	if ((sequenceNumber == rdpPeer->mRttSequence) && (rdpPeer->mRttRequestTime >= 0)) {
+		qint64 now = rdpPeer->mClock.elapsed();
+		rdpPeer->mBandwidth.rttMeasured(int(now - rdpPeer->mRttRequestTime), now);
+		rdpPeer->mRttRequestTime = -1;
+	}
+	return TRUE;
+}
+
+BOOL QFreeRdpPeer::xf_bandwidth_measure_result(rdpAutoDetect *autodetect, RDP_TRANSPORT_TYPE /*transport*/,
+		UINT16 /*responseType*/, UINT16 /*sequenceNumber*/, UINT32 timeDelta, UINT32 byteCount)
+{
+	RdpPeerContext *peerContext = (RdpPeerContext *)autodetect->context;
+	QFreeRdpPeer *rdpPeer = peerContext->rdpPeer;
+
+	// bits per millisecond are kilobits per second
+	if (timeDelta && byteCount >= BANDWIDTH_MEASURE_MIN_BYTES)
+		rdpPeer->mBandwidth.bandwidthMeasured(quint64(byteCount) * 8 / timeDelta, rdpPeer->mClock.elapsed());
+	return TRUE;
+}
+
 UINT QFreeRdpPeer::rdpgfx_caps_advertise(RdpgfxServerContext* context, const RDPGFX_CAPS_ADVERTISE_PDU* capsAdvertise) {
 	QFreeRdpPeer *peer = (QFreeRdpPeer *)context->custom;
 	UINT rc = CHANNEL_RC_OK;
@@ -314,7 +477,7 @@ UINT QFreeRdpPeer::rdpgfx_caps_advertise(RdpgfxServerContext* context, const RDP
 
 UINT QFreeRdpPeer::rdpgfx_frame_acknowledge(RdpgfxServerContext* context, const RDPGFX_FRAME_ACKNOWLEDGE_PDU* frameAcknowledge) {
 	QFreeRdpPeer *peer = (QFreeRdpPeer *)context->custom;
-	peer->frameAck(frameAcknowledge->frameId);
+	peer->frameAck(frameAcknowledge->frameId, frameAcknowledge->queueDepth);
 	return CHANNEL_RC_OK;
 }
 
@@ -322,8 +485,9 @@ BOOL QFreeRdpPeer::configureDisplayLegacyMode(rdpSettings *settings) {
 	// Disable surface mode
 	this->mSurfaceOutputModeEnabled = FALSE;
 
-	// disable NS codec
+	// disable NS codec and RemoteFX
 	this->mNsCodecSupported = FALSE;
+	this->mRfxSupported = FALSE;
 
 	if (settings->ColorDepth == 24) {
 		// don't support 24 bits if surface mode not enabled
@@ -332,7 +496,7 @@ BOOL QFreeRdpPeer::configureDisplayLegacyMode(rdpSettings *settings) {
 	return TRUE;
 }
 
-BOOL QFreeRdpPeer::configureOptimizeMode(rdpSettings *settings) {
+BOOL QFreeRdpPeer::configureOptimizeMode(rdpSettings *settings, bool preferRfx) {
 	// display surface and eventually NS codec
 	if ((settings->SurfaceCommandsEnabled) && (settings->FastPathOutput)) {
 		this->mSurfaceOutputModeEnabled = settings->FrameMarkerCommandEnabled && settings->SurfaceFrameMarkerEnabled;
@@ -345,11 +509,21 @@ BOOL QFreeRdpPeer::configureOptimizeMode(rdpSettings *settings) {
 		return FALSE;
 	}
 
-	// check codec configuration
-	if ((settings->NSCodec) && (this->mSurfaceOutputModeEnabled)) {
+	// check codec configuration, RemoteFX is the most compact
+	bool rfx = settings->RemoteFxCodec && settings->RemoteFxCodecId && this->mSurfaceOutputModeEnabled;
+	bool nsc = settings->NSCodec && settings->NSCodecId && this->mSurfaceOutputModeEnabled;
+	if (rfx && (preferRfx || !nsc)) {
+		this->mRfxSupported = TRUE;
+	} else if (nsc) {
 		// 1- NS codec in compatibility list
 		// 2- Surface commands enabled
-		this->mNsCodecSupported = FALSE;
+		this->mNsCodecSupported = TRUE;
+
+		// the client announced the highest color loss and if it takes subsampled planes
+		const QFreeRdpPlatformConfig *config = mPlatform->config();
+		mNscMaxColorLoss = qBound<UINT32>(1, settings->NSCodecColorLossLevel, 7);
+		mNscColorLoss = qMin<UINT32>(config->nsc_color_loss, mNscMaxColorLoss);
+		settings->NSCodecAllowSubsampling = settings->NSCodecAllowSubsampling && config->nsc_subsampling;
 	}
 	return TRUE;
 }
@@ -372,18 +546,70 @@ BOOL QFreeRdpPeer::detectDisplaySettings(freerdp_peer* client) {
 		return configureOptimizeMode(settings);
 
 	} else if (mPlatform->getDisplayMode() == DisplayMode::AUTODETECT) {
+		// pick the pipeline and the codecs from the capabilities and the link
+		return configureAutodetectMode(settings);
+	}
 
-		// XXX: Has this ever seen the light of day?! oO
-		// // If RDP client is a windows client -> Optimize mode
-		// if (settings->OsMajorType == OSMAJORTYPE_WINDOWS) {
-		// 	return configureOptimizeMode(settings);
-		// }
+	return FALSE;
+}
 
-		// else -> legacy mode
-		return configureDisplayLegacyMode(settings);
+BOOL QFreeRdpPeer::configureAutodetectMode(rdpSettings *settings) {
+	// nothing is measured before the activation, the connection type announced
+	// by the client tells if the link is slow. The measures of the network
+	// autodetection that start with the activation feed the byte budget.
+	bool slowLink;
+	switch (settings->ConnectionType) {
+	case CONNECTION_TYPE_MODEM:
+	case CONNECTION_TYPE_BROADBAND_LOW:
+	case CONNECTION_TYPE_SATELLITE:
+		slowLink = true;
+		break;
+	default:
+		slowLink = false;
+		break;
 	}
 
-	return FALSE;
+	// on a slow link the frame rate starts low and egfx goes lossy, the frame
+	// acknowledges and the byte budget adjust the rest
+	if (slowLink) {
+		mBaseFrameInterval = qMax(mBaseFrameInterval, 1000 / AUTODETECT_SLOW_LINK_FPS);
+		mEgfxProgressive = true;
+	}
+
+	qDebug("autodetect: connection type %u, %s link", settings->ConnectionType, slowLink ? "slow" : "fast");
+
+	// egfx is picked when the graphics pipeline opens, this is the fallback:
+	// surface commands with RemoteFX or NSCodec, then bitmap updates
+	if (settings->SurfaceCommandsEnabled && settings->FastPathOutput &&
+			settings->FrameMarkerCommandEnabled && settings->SurfaceFrameMarkerEnabled) {
+		// NSCodec keeps more of the image on a fast link
+		return configureOptimizeMode(settings, slowLink);
+	}
+
+	return configureDisplayLegacyMode(settings);
+}
+
+void QFreeRdpPeer::configureBulkCompression(rdpSettings *settings) {
+	// the client announced in its info packet if it takes compressed PDUs, and
+	// the highest compression type it knows
+	const QFreeRdpPlatformConfig *config = mPlatform->config();
+	if (config->compressionMode == CompressionMode::COMPRESSION_OFF)
+		settings->CompressionEnabled = FALSE;
+	else if (settings->CompressionEnabled)
+		settings->CompressionLevel = qMin<UINT32>(settings->CompressionLevel, config->compression_level);
+
+	if (settings->CompressionEnabled)
+		qDebug("bulk compression: type %u", settings->CompressionLevel);
+}
+
+bool QFreeRdpPeer::skipBulkCompression(bool compressedPayload) const {
+	// planar, interleaved, NSCodec and RemoteFX data hardly compress further
+	return compressedPayload && (mPlatform->config()->compressionMode != CompressionMode::COMPRESSION_ALWAYS);
+}
+
+void QFreeRdpPeer::countPdu(PduKind kind, quint64 payload, quint64 sentBefore) {
+	mPduPayloadBytes[kind] += payload;
+	mPduSentBytes[kind] += freerdp_get_transport_sent(mClient->context, FALSE) - sentBefore;
 }
 
 BOOL QFreeRdpPeer::xf_peer_activate(freerdp_peer *client) {
@@ -394,6 +620,9 @@ BOOL QFreeRdpPeer::xf_peer_activate(freerdp_peer *client) {
 		return FALSE;
 
 	rdpPeer->mFlags.setFlag(PEER_ACTIVATED);
+	if (client->context->settings->NetworkAutoDetect)
+		rdpPeer->mLinkTimer.start(LINK_MEASURE_INTERVAL);
+
 	if (rdpPeer->mFlags & PEER_WAITING_DYNVC) {
 		rdpPeer->checkDrdynvcState();
 	} else {
@@ -413,6 +642,7 @@ BOOL QFreeRdpPeer::xf_peer_post_connect(freerdp_peer* client) {
 		qWarning("Can not detect correctly settings");
 		return FALSE;
 	}
+	rdpPeer->configureBulkCompression(settings);
 
 	return rdpPeer->mKeyboard.setKeymap(settings);
 }
@@ -437,11 +667,33 @@ bool QFreeRdpPeer::initializeChannels()
 		mPlatform->mClipboard->registerPeer(mClipboard);
 	}
 
+	/* =============== RemoteApp =================*/
+	delete mRail;
+	mRail = nullptr;
+
+	if (config->rail_enabled && mClient->context->settings->RemoteApplicationMode &&
+			WTSVirtualChannelManagerIsChannelJoined(mVcm, RAIL_SVC_CHANNEL_NAME))
+	{
+		qDebug() << "instanciating RAIL component";
+
+		mRail = new QFreeRdpPeerRail(this, mVcm);
+		if (!mRail->start()) {
+			qDebug() << "error starting RAIL";
+			return false;
+		}
+	}
+
 	/* =============== egfx =================*/
 	if (mRdpgfx) {
+		delete mGfxNotifier;
+		mGfxNotifier = nullptr;
 		rdpgfx_server_context_free(mRdpgfx);
 		mRdpgfx = nullptr;
+		mGfxOpened = false;
 		mSurfaceCreated = false;
+		mFramesInFlight.clear();
+		mClientQueueDepth = QUEUE_DEPTH_UNAVAILABLE;
+		mAckLatency = -1;
 	}
 
 	if (WTSVirtualChannelManagerIsChannelJoined(mVcm, DRDYNVC_SVC_CHANNEL_NAME))
@@ -460,6 +712,12 @@ bool QFreeRdpPeer::initializeChannels()
 			mRdpgfx->CapsAdvertise = rdpgfx_caps_advertise;
 			mRdpgfx->FrameAcknowledge = rdpgfx_frame_acknowledge;
 
+			// no channel thread, the callbacks run from gfxTraffic()
+			if (!mRdpgfx->Initialize(mRdpgfx, TRUE)) {
+				qDebug() << "error initializing egfx";
+				return false;
+			}
+
 			mFlags.setFlag(PEER_WAITING_DYNVC, true);
 			mFlags.setFlag(PEER_WAITING_GRAPHICS, true);
 		} else {
@@ -475,11 +733,80 @@ bool QFreeRdpPeer::initializeChannels()
 	return true;
 }
 
-bool QFreeRdpPeer::frameAck(UINT32 frameId) {
-	Q_UNUSED(frameId);
+bool QFreeRdpPeer::frameAck(UINT32 frameId, UINT32 queueDepth) {
+	if (queueDepth == SUSPEND_FRAME_ACKNOWLEDGEMENT) {
+		// the client won't acknowledge frames anymore, until it sends another queueDepth
+		mFrameAcksSuspended = true;
+		mFramesInFlight.clear();
+		mBandwidth.dropFramesInFlight();
+	} else {
+		mFrameAcksSuspended = false;
+		mClientQueueDepth = queueDepth;
+	}
+
+	mBandwidth.frameAcked(frameId, mClock.elapsed());
+
+	auto it = mFramesInFlight.find(frameId);
+	if (it != mFramesInFlight.end()) {
+		int latency = int(mClock.elapsed() - it.value());
+		mAckLatency = (mAckLatency < 0) ? latency : (3 * mAckLatency + latency) / 4;
+		mFramesInFlight.erase(it);
+	}
+
+	// the damage coalesced while waiting goes in the next frame
+	if (mRepaintPending)
+		repaint();
 	return true;
 }
 
+int QFreeRdpPeer::egfxFrameInterval() const {
+	int interval = mBaseFrameInterval;
+	if (mFrameAcksSuspended || (mAckLatency < 0))
+		return interval;
+
+	// the frames in flight are spread over the acknowledge latency
+	return qBound(interval, mAckLatency / EGFX_MAX_FRAMES_IN_FLIGHT, EGFX_MAX_FRAME_INTERVAL);
+}
+
+bool QFreeRdpPeer::canStartEgfxFrame() {
+	qint64 now = mClock.elapsed();
+	qint64 wait = 0;
+
+	if (!mFrameAcksSuspended) {
+		// acknowledges may never come from some clients, don't wait forever
+		for (auto it = mFramesInFlight.begin(); it != mFramesInFlight.end(); ) {
+			if (now - it.value() > EGFX_FRAME_ACK_TIMEOUT)
+				it = mFramesInFlight.erase(it);
+			else
+				++it;
+		}
+
+		// a client with a long queue of frames to decode gets one frame at a time
+		if ((mFramesInFlight.size() >= EGFX_MAX_FRAMES_IN_FLIGHT) ||
+				(!mFramesInFlight.isEmpty() && mClientQueueDepth >= EGFX_MAX_FRAMES_IN_FLIGHT)) {
+			qint64 oldest = now;
+			for (qint64 sent : mFramesInFlight)
+				oldest = qMin(oldest, sent);
+			wait = oldest + EGFX_FRAME_ACK_TIMEOUT - now + 1;
+		}
+	}
+
+	// the window manager already paces frames at the configured rate
+	int interval = egfxFrameInterval();
+	if (!wait && (interval > 1000 / mPlatform->config()->fps))
+		wait = mLastFrameTime + interval - now;
+
+	if (wait <= 0) {
+		mRepaintPending = false;
+		return true;
+	}
+
+	mRepaintPending = true;
+	if (!mDeferredRepaint.isActive() || (mDeferredRepaint.remainingTime() > wait))
+		mDeferredRepaint.start(int(wait));
+	return false;
+}
+
 bool QFreeRdpPeer::egfx_caps_test(const RDPGFX_CAPS_ADVERTISE_PDU* capsAdvertise, UINT32 version, UINT &rc) {
 	for (UINT16 i = 0; i < capsAdvertise->capsSetCount; i++) {
 		RDPGFX_CAPSET *capSet = &capsAdvertise->capsSets[i];
@@ -487,8 +814,18 @@ bool QFreeRdpPeer::egfx_caps_test(const RDPGFX_CAPS_ADVERTISE_PDU* capsAdvertise
 			RDPGFX_CAPSET caps = *capSet;
 			RDPGFX_CAPS_CONFIRM_PDU pdu = { &caps };
 
-			caps.flags |= RDPGFX_CAPS_FLAG_AVC_DISABLED; /* no encoding at all */
+			// AVC420 is only used when asked for, and if an encoder is available
+			mAvcEnabled = mPlatform->config()->egfx_avc &&
+					!(capSet->flags & RDPGFX_CAPS_FLAG_AVC_DISABLED) && initAvcEncoder();
+			if (!mAvcEnabled)
+				caps.flags |= RDPGFX_CAPS_FLAG_AVC_DISABLED;
 			rc = mRdpgfx->CapsConfirm(mRdpgfx, &pdu);
+
+			// [MS-RDPEGFX] 3.3.1.4: the cache is limited both in slots and in size
+			bool smallCache = (caps.flags & RDPGFX_CAPS_FLAG_SMALL_CACHE);
+			int maxSlots = smallCache ? 4096 : 25600;
+			int maxBytes = (smallCache ? 16 : 100) * 1024 * 1024;
+			mEgfxCacheSlots = qMin(maxSlots, maxBytes / (EGFX_CACHE_TILE_SIZE * EGFX_CACHE_TILE_SIZE * 4));
 			return true;
 		}
 	}
@@ -511,19 +848,38 @@ bool QFreeRdpPeer::initGfxDisplay() {
 		return false;
 	}
 
-	RDPGFX_CREATE_SURFACE_PDU createSurface = { mSurfaceId,
-			(UINT16)settings->DesktopWidth, (UINT16)settings->DesktopHeight,
-			GFX_PIXEL_FORMAT_XRGB_8888
-	};
-	if (mRdpgfx->CreateSurface(mRdpgfx, &createSurface) != CHANNEL_RC_OK) {
-		qDebug("error creating surface");
-		return false;
+	// the client deletes all the surfaces on ResetGraphics
+	mNextSurfaceId = mSurfaceId + 1;
+
+	if (mRail) {
+		// RemoteApp windows get a surface of their own when they are painted
+		mRail->invalidate(true);
+	} else {
+		RDPGFX_CREATE_SURFACE_PDU createSurface = { mSurfaceId,
+				(UINT16)settings->DesktopWidth, (UINT16)settings->DesktopHeight,
+				GFX_PIXEL_FORMAT_XRGB_8888
+		};
+		if (mRdpgfx->CreateSurface(mRdpgfx, &createSurface) != CHANNEL_RC_OK) {
+			qDebug("error creating surface");
+			return false;
+		}
+
+		RDPGFX_MAP_SURFACE_TO_OUTPUT_PDU surfaceToOutput = { mSurfaceId, 0, 0, 0 };
+		if (mRdpgfx->MapSurfaceToOutput(mRdpgfx, &surfaceToOutput) != CHANNEL_RC_OK) {
+			qDebug("error mapping surface to output");
+			return false;
+		}
 	}
 
-	RDPGFX_MAP_SURFACE_TO_OUTPUT_PDU surfaceToOutput = { mSurfaceId, 0, 0, 0 };
-	if (mRdpgfx->MapSurfaceToOutput(mRdpgfx, &surfaceToOutput) != CHANNEL_RC_OK) {
-		qDebug("error mapping surface to output");
-		return false;
+	// the client empties its cache on ResetGraphics
+	mEgfxCache.reset(mEgfxCacheSlots);
+	mLossyRegion = QRegion();
+	mRefineTimer.stop();
+
+	// the AVC stream covers the whole surface and starts again with it
+	if (mAvcEnabled && !h264_context_reset(mH264, settings->DesktopWidth, settings->DesktopHeight)) {
+		qDebug("unable to reset the AVC420 encoder, disabling it");
+		mAvcEnabled = false;
 	}
 
 	mSurfaceCreated = true;
@@ -542,7 +898,10 @@ void QFreeRdpPeer::init_display(freerdp_peer* client) {
 	//TODO: see the user's monitor layout
 	QRect currentGeometry = screen->geometry();
 
-	mCompositor.reset(settings->DesktopWidth, settings->DesktopHeight);
+	mDamage.reset();
+
+	// the cache model starts empty with each activation, cached tiles are sent again
+	mBitmapCache.reset(selectBitmapCacheCell(settings));
 
 	QRect peerGeometry(0, 0, settings->DesktopWidth, settings->DesktopHeight);
 	if(currentGeometry != peerGeometry)
@@ -571,9 +930,16 @@ bool QFreeRdpPeer::init() {
 	settings = mClient->context->settings;
 	settings->MultitransportFlags = 0;
 	settings->NlaSecurity = FALSE;
-	settings->RemoteFxCodec = FALSE;
+	settings->RemoteFxCodec = mPlatform->config()->rfx_enabled;
 	settings->NSCodec = TRUE; // support NS codec
 	settings->ColorDepth = 32;
+	// announces revision 2 bitmap caches, so that the client sends its cells
+	settings->BitmapCachePersistEnabled = mPlatform->config()->bitmap_cache_enabled;
+	if (mPlatform->config()->rail_enabled) {
+		// RemoteApp is used if the client asks for it in its info packet
+		settings->RemoteApplicationSupportLevel = RAIL_LEVEL_SUPPORTED;
+		settings->RemoteWndSupportLevel = WINDOW_LEVEL_SUPPORTED;
+	}
 	mPlatform->configureClient(settings);
 
 	mClient->Capabilities = QFreeRdpPeer::xf_peer_capabilities;
@@ -585,6 +951,10 @@ bool QFreeRdpPeer::init() {
 	update->SuppressOutput = QFreeRdpPeer::xf_suppress_output;
 	update->autoCalculateBitmapData = FALSE;
 
+	rdpAutoDetect *autodetect = mClient->context->autodetect;
+	autodetect->RTTMeasureResponse = QFreeRdpPeer::xf_rtt_measure_response;
+	autodetect->ClientBandwidthMeasureResult = QFreeRdpPeer::xf_bandwidth_measure_result;
+
 	rdpInput *input = mClient->context->input;
 	input->SynchronizeEvent = QFreeRdpPeer::xf_input_synchronize_event;
 	input->MouseEvent = QFreeRdpPeer::xf_mouseEvent;
@@ -634,7 +1004,8 @@ void QFreeRdpPeer::checkDrdynvcState() {
 	case DRDYNVC_STATE_READY:
 		if (mFlags.testFlag(PEER_WAITING_DYNVC) && mRdpgfx && !mGfxOpened)	{
 			qDebug("drdynvc ready, opening GraphicsPipeline");
-			if (!mRdpgfx->Open(mRdpgfx))
+			HANDLE gfxEvent = mRdpgfx->Open(mRdpgfx) ? rdpgfx_server_get_event_handle(mRdpgfx) : nullptr;
+			if (!gfxEvent)
 			{
 				qDebug("Failed to open GraphicsPipeline");
 				mClient->context->settings->SupportGraphicsPipeline = FALSE;
@@ -646,6 +1017,9 @@ void QFreeRdpPeer::checkDrdynvcState() {
 				mGfxOpened = true;
 				mRenderMode = RENDER_EGFX;
 				freerdp_planar_topdown_image(mClient->context->codecs->planar, TRUE);
+
+				mGfxNotifier = new QSocketNotifier(GetEventFileDescriptor(gfxEvent), QSocketNotifier::Read);
+				connect(mGfxNotifier, &QSocketNotifier::activated, this, &QFreeRdpPeer::gfxTraffic);
 			}
 			mFlags.setFlag(PEER_WAITING_DYNVC, false);
 		}
@@ -671,32 +1045,112 @@ void QFreeRdpPeer::channelTraffic(int) {
 	}
 }
 
+void QFreeRdpPeer::gfxTraffic(int) {
+	UINT rc = rdpgfx_server_handle_messages(mRdpgfx);
+	if ((rc != CHANNEL_RC_OK) && (rc != ERROR_NO_DATA))
+		qDebug("error treating egfx messages: 0x%x", rc);
+}
+
+
+void QFreeRdpPeer::repaint() {
+	if(!mFlags.testFlag(PEER_ACTIVATED) ||
+	   mFlags.testFlag(PEER_OUTPUT_DISABLED) ||
+	   mFlags.testFlag(PEER_WAITING_DYNVC) ||
+	   mFlags.testFlag(PEER_WAITING_GRAPHICS))
+		return;
+
+	// window orders are not throttled, a window move only costs one of them
+	if (mRail) {
+		if (!mRail->isReady() || !mRail->syncWindows())
+			return;
+
+		if (mRenderMode == RENDER_EGFX) {
+			if (canStartEgfxFrame())
+				repaint_rail_egfx();
+			return;
+		}
+	}
+
+	// while the client catches up, the damage accumulates in the tracker. Peers
+	// paced slower than the window manager wait the same way.
+	if (!canStartEgfxFrame())
+		return;
+
+	const QFreeRdpCompositor *compositor = mPlatform->mWindowManager->compositor();
+	QFreeRdpMoveList moves;
+	QFreeRdpFillList fills;
+	QRegion dirty = mDamage.update(*compositor, canSendMoves() ? &moves : nullptr,
+			canSendFills() ? &fills : nullptr);
+
+	// deferred areas are sent with this frame, where the moves take their content
+	if (!mDeferredRegion.isEmpty()) {
+		for (const QFreeRdpMove &move : moves)
+			mDeferredRegion += mDeferredRegion.intersected(move.src).translated(move.dst - move.src.topLeft());
+		dirty += mDeferredRegion;
+		mDeferredRegion = QRegion();
+	}
+
+	if (dirty.isEmpty() && moves.isEmpty() && fills.isEmpty())
+		return;
+
+	paint(dirty, moves, fills);
+}
 
-void QFreeRdpPeer::repaint(const QRegion &region, bool useCompositorCache) {
+void QFreeRdpPeer::refresh(const QRegion &region) {
 	if(!mFlags.testFlag(PEER_ACTIVATED) ||
 	   mFlags.testFlag(PEER_OUTPUT_DISABLED) ||
 	   mFlags.testFlag(PEER_WAITING_DYNVC) ||
 	   mFlags.testFlag(PEER_WAITING_GRAPHICS))
 		return;
 
-	QRegion dirty = mCompositor.qtToRdpDirtyRegion(region);
-	// We bypass the compositor only _after_ giving it the lastest update, so
-	// that its cache stays in sync with what we send to our peer.
-	if (!useCompositorCache)
-		dirty = region;
+	// there is no desktop surface with RemoteApp, all the windows are sent again
+	if (mRail && mRenderMode == RENDER_EGFX) {
+		mRail->invalidate(false);
+		repaint();
+		return;
+	}
 
+	// Do not try to reduce the size of the update using the compositor.
+	// We got asked for a certain size and we're going to send all of it.
+	mDamage.markSent(*mPlatform->mWindowManager->compositor(), region);
+	paint(region, QFreeRdpMoveList(), QFreeRdpFillList());
+}
 
-	// qDebug() << "QFreeRdpPeer::repaint(" << dirty << ")";
+bool QFreeRdpPeer::canSendMoves() const {
+	switch(mRenderMode) {
+	case RENDER_EGFX:
+		return true;
+	case RENDER_BITMAP_UPDATES:
+		return mClient->context->settings->OrderSupport[NEG_SCRBLT_INDEX];
+	default:
+		return false;
+	}
+}
+
+bool QFreeRdpPeer::canSendFills() const {
+	auto settings = mClient->context->settings;
+
+	switch(mRenderMode) {
+	case RENDER_EGFX:
+		return true;
+	case RENDER_BITMAP_UPDATES:
+		// order colors are given as RGB only in 24 and 32 bpp
+		return settings->OrderSupport[NEG_OPAQUE_RECT_INDEX] && (settings->ColorDepth >= 24);
+	default:
+		return false;
+	}
+}
+
+void QFreeRdpPeer::paint(const QRegion &dirty, const QFreeRdpMoveList &moves, const QFreeRdpFillList &fills) {
+	// qDebug() << "QFreeRdpPeer::paint(" << dirty << ")";
 
 	switch(mRenderMode) {
 	case RENDER_BITMAP_UPDATES:
-		repaint_raw(dirty);
+		repaint_raw(dirty, moves, fills);
 		break;
-	case RENDER_EGFX: {
-		bool doCompress = freerdp_settings_get_bool(mClient->context->settings, FreeRDP_GfxPlanar);
-		repaint_egfx(dirty, doCompress);
+	case RENDER_EGFX:
+		repaint_egfx(dirty, moves, fills, mEgfxProgressive ? EGFX_CODEC_PROGRESSIVE : losslessEgfxCodec());
 		break;
-	}
 	default:
 		break;
 	}
@@ -729,9 +1183,40 @@ void qimage_subrect(const QRect &rect, const QImage *img, BYTE *dest, bool flip_
 }
 
 
-void QFreeRdpPeer::repaint_raw(const QRegion &region) {
+void QFreeRdpPeer::repaint_raw(const QRegion &region, const QFreeRdpMoveList &moves, const QFreeRdpFillList &fills) {
+	mLastFrameTime = mClock.elapsed();
+
+	if (!moves.isEmpty() || !fills.isEmpty()) {
+		// moves are sent as screen to screen blits and solid areas as opaque
+		// rectangles, before the bitmaps
+		rdpUpdate *update = mClient->context->update;
+		update->BeginPaint(mClient->context);
+		for (const QFreeRdpMove &move : moves) {
+			SCRBLT_ORDER scrblt = {};
+			scrblt.nLeftRect = move.dst.x();
+			scrblt.nTopRect = move.dst.y();
+			scrblt.nWidth = move.src.width();
+			scrblt.nHeight = move.src.height();
+			scrblt.bRop = 0xCC; /* SRCCOPY */
+			scrblt.nXSrc = move.src.left();
+			scrblt.nYSrc = move.src.top();
+			update->primary->ScrBlt(mClient->context, &scrblt);
+		}
+
+		for (const QFreeRdpFill &fill : fills) {
+			OPAQUE_RECT_ORDER opaqueRect = {};
+			opaqueRect.nLeftRect = fill.rect.left();
+			opaqueRect.nTopRect = fill.rect.top();
+			opaqueRect.nWidth = fill.rect.width();
+			opaqueRect.nHeight = fill.rect.height();
+			opaqueRect.Color = (qBlue(fill.color) << 16) | (qGreen(fill.color) << 8) | qRed(fill.color);
+			update->primary->OpaqueRect(mClient->context, &opaqueRect);
+		}
+		update->EndPaint(mClient->context);
+	}
 
-	QVector<QRect> rects;
+	QVector<QRect> &rects = mPaintRects;
+	rects.clear();
 	for (const QRect& boundingRect: region) {
 
 		// divide boundingRect in several rects
@@ -775,9 +1260,26 @@ void QFreeRdpPeer::repaint_raw(const QRegion &region) {
 		}
 	}
 
+	// over the byte budget of the frame NSC peers get the highest color loss
+	// they accept, then the tiles far from the pointer wait
+	quint64 budget = mBandwidth.frameBudget(egfxFrameInterval());
+	QFreeRdpBandwidthEstimator::EncodingKind kind = QFreeRdpBandwidthEstimator::ENCODING_LOSSLESS;
+	if (budget && mSurfaceOutputModeEnabled && mNsCodecSupported && (mNscMaxColorLoss > mNscColorLoss)) {
+		quint64 pixels = 0;
+		for (const QRect &rect : rects)
+			pixels += rect.width() * rect.height();
+		if (pixels * mBandwidth.bytesPerPixel(kind) > budget)
+			kind = QFreeRdpBandwidthEstimator::ENCODING_LOSSY;
+	}
+	deferRegion(trimToBudget(rects, budget, mBandwidth.bytesPerPixel(kind)));
+
+	// repeated tiles are drawn from the bitmap cache of the client
+	if (!mSurfaceOutputModeEnabled)
+		paintCachedTiles(rects);
+
 	// send rects
 	if (!rects.empty()) {
-		mSurfaceOutputModeEnabled ? paintSurface(rects) : paintBitmap(rects);
+		mSurfaceOutputModeEnabled ? paintSurface(rects, kind) : paintBitmap(rects);
 	}
 }
 
@@ -803,11 +1305,300 @@ static void adjustRectForPlanar(QRect &rect, const QSize &screenSize) {
 	}
 }
 
-bool QFreeRdpPeer::repaint_egfx(const QRegion &region, bool compress) {
-	if (!mSurfaceCreated && !initGfxDisplay())
+QFreeRdpPeer::EgfxCodec QFreeRdpPeer::losslessEgfxCodec() const {
+	return freerdp_settings_get_bool(mClient->context->settings, FreeRDP_GfxPlanar) ?
+			EGFX_CODEC_PLANAR : EGFX_CODEC_UNCOMPRESSED;
+}
+
+void QFreeRdpPeer::refineLossyRegion() {
+	if (mLossyRegion.isEmpty() || (mRenderMode != RENDER_EGFX) ||
+		!mFlags.testFlag(PEER_ACTIVATED) ||
+		mFlags.testFlag(PEER_OUTPUT_DISABLED) ||
+		mFlags.testFlag(PEER_WAITING_GRAPHICS))
+		return;
+
+	// refinement is the least urgent traffic, it waits for the client
+	if (!canStartEgfxFrame()) {
+		mRefineTimer.start(EGFX_REFINE_DELAY);
+		return;
+	}
+
+	QRegion region = mLossyRegion;
+	repaint_egfx(region, QFreeRdpMoveList(), QFreeRdpFillList(), losslessEgfxCodec(), false);
+}
+
+QRegion QFreeRdpPeer::trimToBudget(QVector<QRect> &tiles, quint64 budget, double bytesPerPixel) const {
+	if (!budget)
+		return QRegion();
+
+	double cost = 0;
+	for (const QRect &tile : tiles)
+		cost += tile.width() * tile.height() * bytesPerPixel;
+	if (cost <= budget)
+		return QRegion();
+
+	// what the user is looking at goes first
+	QPoint pointer = mLastMousePos;
+	std::stable_sort(tiles.begin(), tiles.end(), [&pointer](const QRect &a, const QRect &b) {
+		return (a.center() - pointer).manhattanLength() < (b.center() - pointer).manhattanLength();
+	});
+
+	// at least one tile goes out, so that the screen makes progress
+	double used = 0;
+	int kept = 0;
+	for (; kept < tiles.size(); kept++) {
+		double tileCost = tiles[kept].width() * tiles[kept].height() * bytesPerPixel;
+		if (kept && (used + tileCost > budget))
+			break;
+		used += tileCost;
+	}
+
+	QRegion deferred;
+	for (int i = kept; i < tiles.size(); i++)
+		deferred += tiles[i];
+	tiles.resize(kept);
+	return deferred;
+}
+
+void QFreeRdpPeer::deferRegion(const QRegion &region) {
+	if (region.isEmpty())
+		return;
+
+	mDeferredRegion += region;
+	if (!mDeferredRepaint.isActive())
+		mDeferredRepaint.start(egfxFrameInterval());
+}
+
+void QFreeRdpPeer::measureLink() {
+	if (!mFlags.testFlag(PEER_ACTIVATED))
+		return;
+
+	rdpAutoDetect *autodetect = mClient->context->autodetect;
+	mRttRequestTime = mClock.elapsed();
+	if (!autodetect->RTTMeasureRequest(autodetect, RDP_TRANSPORT_TCP, ++mRttSequence)) {
+		qDebug("error sending a RTT measure request, stopping the measures");
+		mLinkTimer.stop();
+		return;
+	}
+
+	// the client counts the bytes of the updates between the start and the
+	// stop of a measure, and reports them with the time it took
+	BOOL ok;
+	if (mBandwidthMeasuring) {
+		ok = autodetect->BandwidthMeasureStop(autodetect, RDP_TRANSPORT_TCP, mBandwidthSequence, 0);
+		mBandwidthMeasuring = false;
+	} else {
+		ok = autodetect->BandwidthMeasureStart(autodetect, RDP_TRANSPORT_TCP, ++mBandwidthSequence);
+		mBandwidthMeasuring = ok;
+	}
+	if (!ok)
+		qDebug("error sending a bandwidth measure request");
+}
+
+bool QFreeRdpPeer::encodeProgressive(const QRegion &region, const QSize &surfaceSize) {
+	if (!mProgressive) {
+		mProgressive = progressive_context_new(TRUE);
+		if (!mProgressive)
+			return false;
+	}
+
+	REGION16 invalidRegion;
+	region16_init(&invalidRegion);
+	for (const QRect &rect : region) {
+		RECTANGLE_16 rect16 = { (UINT16)rect.left(), (UINT16)rect.top(),
+				(UINT16)(rect.right() + 1), (UINT16)(rect.bottom() + 1) };
+		region16_union_rect(&invalidRegion, &invalidRegion, &rect16);
+	}
+
+	// the encoder works on the whole surface, and only encodes the tiles
+	// touched by the invalid region
+	const QImage *src = mPlatform->getScreen()->getScreenBits();
+	RDPGFX_SURFACE_COMMAND cmd;
+	QRect bounds = region.boundingRect();
+	cmd.surfaceId = mSurfaceId;
+	cmd.codecId = RDPGFX_CODECID_CAPROGRESSIVE;
+	cmd.contextId = 0;
+	cmd.format = PIXEL_FORMAT_BGRX32;
+	cmd.left = bounds.left();
+	cmd.top = bounds.top();
+	cmd.right = bounds.right() + 1;
+	cmd.bottom = bounds.bottom() + 1;
+	cmd.width = bounds.width();
+	cmd.height = bounds.height();
+	cmd.data = nullptr;
+	cmd.length = 0;
+
+	int rc = progressive_compress(mProgressive, src->bits(), surfaceSize.height() * src->bytesPerLine(),
+			PIXEL_FORMAT_BGRX32, surfaceSize.width(), surfaceSize.height(), src->bytesPerLine(),
+			&invalidRegion, &cmd.data, &cmd.length);
+	region16_uninit(&invalidRegion);
+	if (rc < 0) {
+		qDebug("error during progressive compression");
 		return false;
+	}
 
-	//qDebug() << "repaint_egfx_raw(" << region << ")";
+	// the encoded data belongs to the progressive context
+	if (mRdpgfx->SurfaceCommand(mRdpgfx, &cmd) != CHANNEL_RC_OK) {
+		qDebug("error during surfaceCommand");
+		return false;
+	}
+
+	quint64 pixels = 0;
+	for (const QRect &rect : region)
+		pixels += rect.width() * rect.height();
+	mFrameBytes += cmd.length;
+	mBandwidth.encoded(QFreeRdpBandwidthEstimator::ENCODING_LOSSY, pixels, cmd.length);
+	return true;
+}
+
+bool QFreeRdpPeer::initAvcEncoder() {
+	if (!mH264) {
+		// FreeRDP picks a software encoder (OpenH264) when there is no hardware one
+		mH264 = h264_context_new(TRUE);
+		if (!mH264) {
+			qDebug("no AVC420 encoder available");
+			return false;
+		}
+	}
+
+	h264_context_set_option(mH264, H264_CONTEXT_OPTION_RATECONTROL, H264_RATECONTROL_VBR);
+	h264_context_set_option(mH264, H264_CONTEXT_OPTION_BITRATE, AVC_BITRATE);
+	h264_context_set_option(mH264, H264_CONTEXT_OPTION_FRAMERATE, mPlatform->config()->fps);
+	return true;
+}
+
+bool QFreeRdpPeer::encodeAvc420(const QRect &rect, const QSize &surfaceSize) {
+	const QImage *src = mPlatform->getScreen()->getScreenBits();
+	RDPGFX_AVC420_BITMAP_STREAM avc420 = {};
+	RECTANGLE_16 regionRect = { (UINT16)rect.left(), (UINT16)rect.top(),
+			(UINT16)(rect.right() + 1), (UINT16)(rect.bottom() + 1) };
+
+	RDPGFX_SURFACE_COMMAND cmd;
+	cmd.surfaceId = mSurfaceId;
+	cmd.codecId = RDPGFX_CODECID_AVC420;
+	cmd.contextId = 0;
+	cmd.format = PIXEL_FORMAT_BGRX32;
+	cmd.left = regionRect.left;
+	cmd.top = regionRect.top;
+	cmd.right = regionRect.right;
+	cmd.bottom = regionRect.bottom;
+	cmd.width = rect.width();
+	cmd.height = rect.height();
+	cmd.data = nullptr;
+	cmd.length = 0;
+	cmd.extra = &avc420;
+
+	// the stream is made of frames of the whole surface, only the region rect
+	// is updated by the client
+	int rc = avc420_compress(mH264, src->bits(), PIXEL_FORMAT_BGRX32, src->bytesPerLine(),
+			surfaceSize.width(), surfaceSize.height(), &regionRect, &avc420.data, &avc420.length,
+			&avc420.meta);
+	if (rc < 0) {
+		qDebug("error during AVC420 compression");
+		free_h264_metablock(&avc420.meta);
+		return false;
+	}
+
+	// nothing to send when the encoder skips the frame
+	bool ok = true;
+	if (rc > 0 && mRdpgfx->SurfaceCommand(mRdpgfx, &cmd) != CHANNEL_RC_OK) {
+		qDebug("error during surfaceCommand");
+		ok = false;
+	}
+	if (rc > 0)
+		mFrameBytes += avc420.length;
+
+	free_h264_metablock(&avc420.meta);
+	return ok;
+}
+
+bool QFreeRdpPeer::sendSolidFills(const QFreeRdpFillList &fills) {
+	// one command per color
+	QMap<quint32, QVector<RECTANGLE_16>> fillRects;
+	for (const QFreeRdpFill &fill : fills) {
+		RECTANGLE_16 rect = { (UINT16)fill.rect.left(), (UINT16)fill.rect.top(),
+				(UINT16)(fill.rect.right() + 1), (UINT16)(fill.rect.bottom() + 1) };
+		fillRects[fill.color].append(rect);
+		mLossyRegion -= fill.rect;
+	}
+
+	for (auto it = fillRects.cbegin(); it != fillRects.cend(); ++it) {
+		RDPGFX_SOLID_FILL_PDU solidFill;
+		solidFill.surfaceId = mSurfaceId;
+		solidFill.fillColor.B = qBlue(it.key());
+		solidFill.fillColor.G = qGreen(it.key());
+		solidFill.fillColor.R = qRed(it.key());
+		solidFill.fillColor.XA = 0xff;
+		solidFill.fillRectCount = it.value().size();
+		solidFill.fillRects = const_cast<RECTANGLE_16 *>(it.value().constData());
+		if (mRdpgfx->SolidFill(mRdpgfx, &solidFill) != CHANNEL_RC_OK) {
+			qDebug("error during solidFill");
+			return false;
+		}
+	}
+	return true;
+}
+
+bool QFreeRdpPeer::classifyTiles(QRegion &region, const QRect &surfaceRect) {
+	const QImage *src = mPlatform->getScreen()->getScreenBits();
+	const QFreeRdpCompositor *compositor = mPlatform->mWindowManager->compositor();
+	QRegion changing = compositor->changingRegion(AVC_MIN_UPDATES);
+
+	// the region is cut on the tile grid
+	QVector<QRect> pieces;
+	for (const QRect &rect : region.intersected(surfaceRect)) {
+		for (int ty = rect.top() / EGFX_CACHE_TILE_SIZE; ty <= rect.bottom() / EGFX_CACHE_TILE_SIZE; ty++) {
+			for (int tx = rect.left() / EGFX_CACHE_TILE_SIZE; tx <= rect.right() / EGFX_CACHE_TILE_SIZE; tx++) {
+				pieces.append(rect.intersected(QRect(tx * EGFX_CACHE_TILE_SIZE, ty * EGFX_CACHE_TILE_SIZE,
+						EGFX_CACHE_TILE_SIZE, EGFX_CACHE_TILE_SIZE)));
+			}
+		}
+	}
+
+	QVector<QFreeRdpTileClassifier::TileClass> classes(pieces.size());
+	QVector<quint32> colors(pieces.size(), 0);
+	QFreeRdpEncoder::instance()->run(pieces.size(), [&](int index, QFreeRdpCodecContexts &) {
+		const QRect &piece = pieces[index];
+		const uchar *bits = src->bits() + (piece.top() * src->bytesPerLine()) + (piece.left() * 4);
+		classes[index] = QFreeRdpTileClassifier::classify(bits, src->bytesPerLine(), piece.width(), piece.height(),
+				changing.intersects(piece), colors[index]);
+	});
+
+	QFreeRdpFillList fills;
+	QRegion lossyRegion;
+	for (int i = 0; i < pieces.size(); i++) {
+		const QRect &piece = pieces[i];
+		mClassifier.record(classes[i], piece.width() * piece.height());
+
+		switch (classes[i]) {
+		case QFreeRdpTileClassifier::TILE_SOLID:
+			fills.append({ piece, colors[i] });
+			region -= piece;
+			break;
+		case QFreeRdpTileClassifier::TILE_IMAGE:
+		case QFreeRdpTileClassifier::TILE_CHANGING:
+			lossyRegion += piece;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (!sendSolidFills(fills))
+		return false;
+
+	if (!lossyRegion.isEmpty()) {
+		if (!encodeProgressive(lossyRegion, surfaceRect.size()))
+			return false;
+
+		region -= lossyRegion;
+		mLossyRegion += lossyRegion;
+		mRefineTimer.start(EGFX_REFINE_DELAY);
+	}
+	return true;
+}
+
+bool QFreeRdpPeer::startEgfxFrame() {
 	SYSTEMTIME sTime;
 	GetSystemTime(&sTime);
 
@@ -818,23 +1609,94 @@ bool QFreeRdpPeer::repaint_egfx(const QRegion &region, bool compress) {
 	if (mRdpgfx->StartFrame(mRdpgfx, &startFrame) != CHANNEL_RC_OK)
 		return false;
 
+	mFrameBytes = 0;
+	mLastFrameTime = mClock.elapsed();
+	if (!mFrameAcksSuspended)
+		mFramesInFlight.insert(mFrameId, mLastFrameTime);
+	return true;
+}
+
+bool QFreeRdpPeer::endEgfxFrame() {
+	RDPGFX_END_FRAME_PDU endFrame = { mFrameId };
+	if (mRdpgfx->EndFrame(mRdpgfx, &endFrame) != CHANNEL_RC_OK)
+		return false;
+
+	// channel data is queued, its delivery is known from the acknowledge
+	qint64 now = mClock.elapsed();
+	if (!mFrameAcksSuspended)
+		mBandwidth.frameSent(mFrameId, mFrameBytes, now);
+	mBandwidth.transportSent(freerdp_get_transport_sent(mClient->context, FALSE), now);
+	return true;
+}
+
+bool QFreeRdpPeer::sendSurfaceBits(UINT16 surfaceId, const QImage *src, const QRegion &region,
+		const QSize &surfaceSize, bool compress)
+{
 	RDPGFX_SURFACE_COMMAND cmd;
 	cmd.codecId = compress ? RDPGFX_CODECID_PLANAR : RDPGFX_CODECID_UNCOMPRESSED;
-	cmd.surfaceId = 1;
+	cmd.surfaceId = surfaceId;
 	cmd.format = PIXEL_FORMAT_BGRA32;
 	cmd.contextId = 1;
 	cmd.data = nullptr;
 
-	auto settings = mClient->context->settings;
-	QSize peerSize(settings->DesktopWidth, settings->DesktopHeight);
-
-	BYTE *data = nullptr;
-	const QImage *src = mPlatform->getScreen()->getScreenBits();
-
+	// rects are encoded in parallel, and sent in order once they are all ready
+	struct EncodedRect {
+		BYTE *data;
+		UINT32 length;
+		bool ok;
+	};
+	QVector<QRect> &rects = mEncodeRects;
+	rects.clear();
 	for (QRect rect : region) {
 		//qDebug() << "repaint_egfx(" << rect << ")";
 		if (compress)
-			adjustRectForPlanar(rect, peerSize);
+			adjustRectForPlanar(rect, surfaceSize);
+		rect &= src->rect();
+		if (!rect.isEmpty())
+			rects.append(rect);
+	}
+
+	// results and buffers come from the scratch arena, no need to free them
+	EncodedRect *encoded = (EncodedRect *)mScratch.alloc(rects.size() * sizeof(EncodedRect));
+	if (!encoded)
+		return false;
+	std::fill(encoded, encoded + rects.size(), EncodedRect{ nullptr, 0, false });
+	QFreeRdpEncoder::instance()->run(rects.size(), [&](int index, QFreeRdpCodecContexts &codecs) {
+		const QRect &rect = rects[index];
+		EncodedRect &out = encoded[index];
+
+		if (compress) {
+			BITMAP_PLANAR_CONTEXT *planar = codecs.planar(rect.width(), rect.height(), true);
+			if (!planar)
+				return;
+			const BYTE *srcBytes = (const BYTE *)src->bits() + (rect.top() * src->bytesPerLine()) + (rect.left() * 4);
+			out.length = rect.width() * rect.height() * 4 + PLANAR_MAX_OVERHEAD;
+			BYTE *dst = mScratch.alloc(out.length);
+			out.data = dst ? freerdp_bitmap_compress_planar(planar, srcBytes, PIXEL_FORMAT_BGRA32,
+					rect.width(), rect.height(), src->bytesPerLine(), dst, &out.length) : nullptr;
+			out.ok = (out.data != nullptr);
+		} else {
+			out.length = rect.width() * rect.height() * 4;
+			out.data = mScratch.alloc(out.length);
+			out.ok = out.data && freerdp_image_copy(out.data, cmd.format, 0 /*nDstStep*/, 0, 0,
+					rect.width(), rect.height(), (const BYTE *)src->bits(), PIXEL_FORMAT_BGRA32,
+					src->bytesPerLine(), rect.left(), rect.top(), nullptr, 0);
+		}
+	});
+
+	quint64 pixels = 0;
+	quint64 bytes = 0;
+	for (int i = 0; i < rects.size(); i++) {
+		const QRect &rect = rects[i];
+		const EncodedRect &out = encoded[i];
+
+		if (!out.ok) {
+			qDebug("error while encoding %s", compress ? "planar" : "raw");
+			return false;
+		}
+
+		pixels += rect.width() * rect.height();
+		bytes += out.length;
 
 		cmd.left = rect.left();
 		cmd.top = rect.top();
@@ -842,55 +1704,283 @@ bool QFreeRdpPeer::repaint_egfx(const QRegion &region, bool compress) {
 		cmd.bottom = rect.bottom() + 1;
 		cmd.width = rect.width();
 		cmd.height = rect.height();
+		cmd.data = out.data;
+		cmd.length = out.length;
 
-		if (compress) {
-			auto planar = mClient->context->codecs->planar;
-			freerdp_bitmap_planar_context_reset(planar, cmd.width, cmd.height);
-			freerdp_planar_topdown_image(planar, TRUE);
-			const BYTE *srcBytes = (const BYTE *)src->bits() + (cmd.top * src->bytesPerLine()) + (cmd.left * 4);
-			cmd.length = 0;
-			cmd.data = freerdp_bitmap_compress_planar(planar, srcBytes, PIXEL_FORMAT_BGRA32,
-					cmd.width, cmd.height, src->bytesPerLine(), NULL, &cmd.length);
-			if (!cmd.data && cmd.length != 0) {
-				qDebug("error while planar compression");
-				return false;
+		if (mRdpgfx->SurfaceCommand(mRdpgfx, &cmd) != CHANNEL_RC_OK) {
+			qDebug("error during surfaceCommand");
+			return false;
+		}
+	}
+
+	mFrameBytes += bytes;
+	mBandwidth.encoded(QFreeRdpBandwidthEstimator::ENCODING_LOSSLESS, pixels, bytes);
+	return true;
+}
+
+bool QFreeRdpPeer::repaint_rail_egfx() {
+	if (!mSurfaceCreated && !initGfxDisplay())
+		return false;
+
+	for (UINT16 surfaceId : mRail->takeDroppedSurfaces()) {
+		RDPGFX_DELETE_SURFACE_PDU deleteSurface = { surfaceId };
+		if (mRdpgfx->DeleteSurface(mRdpgfx, &deleteSurface) != CHANNEL_RC_OK) {
+			qDebug("error deleting surface %d", surfaceId);
+			return false;
+		}
+	}
+
+	QFreeRdpPeerRail::RailWindows &windows = mRail->windows();
+	bool dirty = false;
+	for (const QFreeRdpPeerRail::RailWindow &state : windows)
+		dirty |= !state.dirty.isEmpty() || (state.surfaceSize != state.geometry.size());
+	if (!dirty)
+		return true;
+
+	// the buffers of the previous frame have been sent
+	mScratch.reset();
+
+	if (!startEgfxFrame())
+		return false;
+
+	bool compress = (losslessEgfxCodec() == EGFX_CODEC_PLANAR);
+	for (auto it = windows.begin(); it != windows.end(); ++it) {
+		QFreeRdpPeerRail::RailWindow &state = it.value();
+		QFreeRdpWindow *window = mRail->window(UINT32(it.key()));
+		const QImage *content = window ? window->windowContent() : nullptr;
+		QSize size = state.geometry.size();
+		if (!content || size.isEmpty())
+			continue;
+
+		// the content of a resized window goes on a new surface
+		if (state.surfaceSize != size) {
+			if (state.surfaceId) {
+				RDPGFX_DELETE_SURFACE_PDU deleteSurface = { state.surfaceId };
+				if (mRdpgfx->DeleteSurface(mRdpgfx, &deleteSurface) != CHANNEL_RC_OK) {
+					qDebug("error deleting surface %d", state.surfaceId);
+					return false;
+				}
 			}
-		} else {
-			BYTE *tmp = (BYTE *)realloc(data, cmd.width * cmd.height * 4);
-			if (!tmp) {
-				free(data);
-				qDebug("unable to realloc tmpData");
+
+			RDPGFX_CREATE_SURFACE_PDU createSurface = { mNextSurfaceId,
+					(UINT16)size.width(), (UINT16)size.height(), GFX_PIXEL_FORMAT_XRGB_8888
+			};
+			if (mRdpgfx->CreateSurface(mRdpgfx, &createSurface) != CHANNEL_RC_OK) {
+				qDebug("error creating surface");
 				return false;
 			}
-			data = tmp;
 
-			if (!freerdp_image_copy(data, cmd.format, 0 /*nDstStep*/, 0, 0, cmd.width, cmd.height,
-						(const BYTE *)src->bits(), PIXEL_FORMAT_BGRA32, src->bytesPerLine(),
-						rect.left(), rect.top(), nullptr, 0)) {
-				free(data);
-				qDebug("error during freerdp_image_copy()");
+			RDPGFX_MAP_SURFACE_TO_WINDOW_PDU surfaceToWindow = { mNextSurfaceId, it.key(),
+					(UINT32)size.width(), (UINT32)size.height()
+			};
+			if (mRdpgfx->MapSurfaceToWindow(mRdpgfx, &surfaceToWindow) != CHANNEL_RC_OK) {
+				qDebug("error mapping surface to window");
 				return false;
 			}
 
-			cmd.data = data;
-			cmd.length = cmd.width * cmd.height * 4;
+			state.surfaceId = mNextSurfaceId++;
+			state.surfaceSize = size;
+			state.dirty = QRect(QPoint(0, 0), size);
 		}
 
-		if (mRdpgfx->SurfaceCommand(mRdpgfx, &cmd) != CHANNEL_RC_OK) {
-			free(data);
-			qDebug("error during surfaceCommand");
+		QRegion toEncode = state.dirty.intersected(QRect(QPoint(0, 0), size)).intersected(content->rect());
+		state.dirty = QRegion();
+		if (!toEncode.isEmpty() && !sendSurfaceBits(state.surfaceId, content, toEncode, size, compress))
+			return false;
+	}
+
+	return endEgfxFrame();
+}
+
+bool QFreeRdpPeer::repaint_egfx(const QRegion &region, const QFreeRdpMoveList &moves, const QFreeRdpFillList &fills,
+		EgfxCodec codec, bool allowLossy)
+{
+	bool compress = (codec == EGFX_CODEC_PLANAR);
+	bool lossy = (codec == EGFX_CODEC_PROGRESSIVE);
+
+	if (!mSurfaceCreated && !initGfxDisplay())
+		return false;
+
+	// the buffers of the previous frame have been sent
+	mScratch.reset();
+
+	//qDebug() << "repaint_egfx_raw(" << region << ")";
+	if (!startEgfxFrame())
+		return false;
+
+	// moves first, the residual damage is relative to the moved content
+	for (const QFreeRdpMove &move : moves) {
+		RDPGFX_SURFACE_TO_SURFACE_PDU surfaceToSurface;
+		RDPGFX_POINT16 destPt = { (UINT16)move.dst.x(), (UINT16)move.dst.y() };
+
+		surfaceToSurface.surfaceIdSrc = mSurfaceId;
+		surfaceToSurface.surfaceIdDest = mSurfaceId;
+		surfaceToSurface.rectSrc.left = move.src.left();
+		surfaceToSurface.rectSrc.top = move.src.top();
+		surfaceToSurface.rectSrc.right = move.src.right() + 1;
+		surfaceToSurface.rectSrc.bottom = move.src.bottom() + 1;
+		surfaceToSurface.destPtsCount = 1;
+		surfaceToSurface.destPts = &destPt;
+		if (mRdpgfx->SurfaceToSurface(mRdpgfx, &surfaceToSurface) != CHANNEL_RC_OK) {
+			qDebug("error during surfaceToSurface");
 			return false;
 		}
 
-		if (compress)
-			free(cmd.data);
+		// lossy pixels stay lossy where they are copied
+		QRegion movedLossy = mLossyRegion.intersected(move.src).translated(move.dst - move.src.topLeft());
+		mLossyRegion -= move.dstRect();
+		mLossyRegion += movedLossy;
 	}
 
-	RDPGFX_END_FRAME_PDU endFrame = { mFrameId };
-	if (mRdpgfx->EndFrame(mRdpgfx, &endFrame) != CHANNEL_RC_OK)
+	// then solid areas
+	if (!sendSolidFills(fills))
 		return false;
 
-	return true;
+	auto settings = mClient->context->settings;
+	QSize peerSize(settings->DesktopWidth, settings->DesktopHeight);
+
+	const QImage *src = mPlatform->getScreen()->getScreenBits();
+
+	// tiles already known by the client are copied from its cache, the
+	// others are stored once encoded
+	struct CacheStore {
+		quint64 key;
+		QRect tile;
+	};
+	QVector<CacheStore> cacheStores;
+	QRegion toEncode = region;
+	QRect surfaceRect = QRect(QPoint(0, 0), peerSize).intersected(src->rect());
+
+	// areas that keep changing go out as video
+	if (mAvcEnabled && allowLossy) {
+		const QFreeRdpCompositor *compositor = mPlatform->mWindowManager->compositor();
+		QRegion avcRegion = region.intersected(compositor->changingRegion(AVC_MIN_UPDATES)).intersected(surfaceRect);
+		if (!avcRegion.isEmpty()) {
+			QRect bounds = avcRegion.boundingRect();
+			if (!encodeAvc420(bounds, surfaceRect.size()))
+				return false;
+
+			toEncode -= bounds;
+			mLossyRegion += bounds;
+			mRefineTimer.start(EGFX_REFINE_DELAY);
+		}
+	}
+
+	// over the byte budget of the frame the quality drops first, then the tiles
+	// far from the pointer wait for the next frames. Refinements that don't fit
+	// stay lossy for now.
+	quint64 budget = mBandwidth.frameBudget(egfxFrameInterval());
+	if (budget && !toEncode.isEmpty()) {
+		QVector<QRect> tiles;
+		quint64 pixels = 0;
+		for (const QRect &rect : toEncode.intersected(surfaceRect)) {
+			for (int y = rect.top() / BUDGET_TILE_SIZE * BUDGET_TILE_SIZE; y <= rect.bottom(); y += BUDGET_TILE_SIZE) {
+				for (int x = rect.left() / BUDGET_TILE_SIZE * BUDGET_TILE_SIZE; x <= rect.right(); x += BUDGET_TILE_SIZE) {
+					QRect tile = QRect(x, y, BUDGET_TILE_SIZE, BUDGET_TILE_SIZE).intersected(rect);
+					pixels += tile.width() * tile.height();
+					tiles.append(tile);
+				}
+			}
+		}
+
+		double losslessCost = mBandwidth.bytesPerPixel(QFreeRdpBandwidthEstimator::ENCODING_LOSSLESS);
+		if (!lossy && allowLossy && (pixels * losslessCost > budget)) {
+			lossy = true;
+			compress = false;
+		}
+
+		QRegion deferred = trimToBudget(tiles, budget, mBandwidth.bytesPerPixel(lossy ?
+				QFreeRdpBandwidthEstimator::ENCODING_LOSSY : QFreeRdpBandwidthEstimator::ENCODING_LOSSLESS));
+		if (!deferred.isEmpty()) {
+			toEncode -= deferred;
+			if (allowLossy)
+				deferRegion(deferred);
+			else
+				mRefineTimer.start(EGFX_REFINE_DELAY);
+		}
+	}
+
+	if (mEgfxCache.slotCount()) {
+		QSet<quint64> storedKeys;
+		const QRegion cacheCandidates = toEncode;
+
+		for (const QRect &rect : cacheCandidates) {
+			for (int ty = rect.top() / EGFX_CACHE_TILE_SIZE; ty <= rect.bottom() / EGFX_CACHE_TILE_SIZE; ty++) {
+				for (int tx = rect.left() / EGFX_CACHE_TILE_SIZE; tx <= rect.right() / EGFX_CACHE_TILE_SIZE; tx++) {
+					QRect tile = QRect(tx * EGFX_CACHE_TILE_SIZE, ty * EGFX_CACHE_TILE_SIZE,
+							EGFX_CACHE_TILE_SIZE, EGFX_CACHE_TILE_SIZE).intersected(surfaceRect);
+					if (tile.isEmpty() || !rect.contains(tile))
+						continue;
+
+					const uchar *tileBits = src->bits() + (tile.top() * src->bytesPerLine()) + (tile.left() * 4);
+					quint64 key = QFreeRdpEgfxCache::tileKey(tileBits, src->bytesPerLine(), tile.width(), tile.height());
+
+					// a tile stored in this frame is not in the client cache yet
+					if (storedKeys.contains(key))
+						continue;
+
+					int slot = mEgfxCache.find(key);
+					if (slot) {
+						RDPGFX_POINT16 destPt = { (UINT16)tile.left(), (UINT16)tile.top() };
+						RDPGFX_CACHE_TO_SURFACE_PDU cacheToSurface;
+						cacheToSurface.cacheSlot = slot;
+						cacheToSurface.surfaceId = mSurfaceId;
+						cacheToSurface.destPtsCount = 1;
+						cacheToSurface.destPts = &destPt;
+						if (mRdpgfx->CacheToSurface(mRdpgfx, &cacheToSurface) != CHANNEL_RC_OK) {
+							qDebug("error during cacheToSurface");
+							return false;
+						}
+						toEncode -= tile;
+						mLossyRegion -= tile;
+					} else if (!lossy && (cacheStores.size() < EGFX_CACHE_MAX_STORES)) {
+						// lossy pixels must not be reused as exact content
+						cacheStores.append({ key, tile });
+						storedKeys.insert(key);
+					}
+				}
+			}
+		}
+	}
+
+	// with the automatic choice, lossless is only for the tiles that need it
+	if (!lossy && allowLossy && mPlatform->config()->egfx_autocodec && !classifyTiles(toEncode, surfaceRect))
+		return false;
+
+	if (lossy) {
+		if (!toEncode.isEmpty() && !encodeProgressive(toEncode.intersected(surfaceRect), surfaceRect.size()))
+			return false;
+
+		mLossyRegion += toEncode;
+		mRefineTimer.start(EGFX_REFINE_DELAY);
+		toEncode = QRegion();
+	} else {
+		mLossyRegion -= toEncode;
+	}
+
+	if (!toEncode.isEmpty() && !sendSurfaceBits(mSurfaceId, src, toEncode, peerSize, compress))
+		return false;
+
+	for (const CacheStore &store : cacheStores) {
+		// the classifier may have sent the tile with the progressive codec
+		if (mLossyRegion.intersects(store.tile))
+			continue;
+
+		RDPGFX_SURFACE_TO_CACHE_PDU surfaceToCache;
+		surfaceToCache.surfaceId = mSurfaceId;
+		surfaceToCache.cacheKey = store.key;
+		surfaceToCache.cacheSlot = mEgfxCache.insert(store.key);
+		surfaceToCache.rectSrc.left = store.tile.left();
+		surfaceToCache.rectSrc.top = store.tile.top();
+		surfaceToCache.rectSrc.right = store.tile.right() + 1;
+		surfaceToCache.rectSrc.bottom = store.tile.bottom() + 1;
+		if (mRdpgfx->SurfaceToCache(mRdpgfx, &surfaceToCache) != CHANNEL_RC_OK) {
+			qDebug("error during surfaceToCache");
+			return false;
+		}
+	}
+
+	return endEgfxFrame();
 }
 
 
@@ -1006,19 +2096,152 @@ UINT16 QFreeRdpPeer::getCursorCacheIndex(Qt::CursorShape shape, bool &isNew, boo
 	return ret;
 }
 
+void QFreeRdpPeer::encodeBitmap(const QImage *src, const QRect &rect, UINT32 colorDepth, const gdiPalette *palette,
+		QFreeRdpScratchArena &scratch, QFreeRdpCodecContexts &codecs, BITMAP_DATA &bitmapData)
+{
+
+	// bits per pixel
+	UINT32 origFormat = PIXEL_FORMAT_BGRX32;
+	switch (src->format()) {
+		case QImage::Format_RGB555 :
+			origFormat = PIXEL_FORMAT_RGB15;
+			break;
+		case QImage::Format_RGB16 :
+			origFormat = PIXEL_FORMAT_RGB16;
+			break;
+		case QImage::Format_RGB888 :
+			origFormat = PIXEL_FORMAT_RGB24;
+			break;
+		case QImage::Format_RGB32 :
+		default :
+			origFormat = PIXEL_FORMAT_BGRX32;
+			break;
+	}
+
+	bitmapData = {};
+
+	// coord
+	bitmapData.destLeft = rect.left();
+	bitmapData.destTop = rect.top();
+	bitmapData.destRight = rect.right();
+	bitmapData.destBottom = rect.bottom();
+	bitmapData.flags = 0x401; /* BITMAP_COMPRESSION | NO_BITMAP_COMPRESSION_HDR */
+
+	// width (inclusive bounds)
+	// freerdp requires it to be a multiple of 4
+	UINT32 width = (bitmapData.destRight - bitmapData.destLeft) + 1;
+	bitmapData.width = (width + 3) & ~3;
+
+	// height (inclusive bounds)
+	bitmapData.height = rect.bottom() - rect.top() + 1;
+
+	bitmapData.bitsPerPixel = colorDepth;
+
+	// options
+	bitmapData.cbCompFirstRowSize = 0x0000;
+	bitmapData.cbCompMainBodySize = 0x0000;
+	bitmapData.cbScanWidth = 0x0000;
+	bitmapData.cbUncompressedSize = 0x0000;
+	bitmapData.bitmapDataStream = NULL;
+	bitmapData.bitmapLength = 0;
+
+	// the encoders read the screen in place. When the rounded width goes
+	// past the right of the screen, the tile is copied in a padding buffer
+	// where the extra columns are black.
+	UINT32 srcBytesPerPixel = (src->depth() + 7) / 8;
+	const BYTE *image = src->constScanLine(rect.top()) + rect.left() * srcBytesPerPixel;
+	UINT32 imageStride = src->bytesPerLine();
+	if (rect.left() + bitmapData.width > UINT32(src->width())) {
+		UINT32 paddedStride = bitmapData.width * srcBytesPerPixel;
+		BYTE *padded = scratch.alloc(paddedStride * bitmapData.height);
+		if (!padded)
+			return;
+
+		size_t copied = width * srcBytesPerPixel;
+		for (UINT32 y = 0; y < bitmapData.height; y++) {
+			BYTE *dstRow = padded + y * paddedStride;
+			memcpy(dstRow, image + y * imageStride, copied);
+			memset(dstRow + copied, 0, paddedStride - copied);
+		}
+		image = padded;
+		imageStride = paddedStride;
+	}
+
+	if (colorDepth == 32) {
+		// bpp 32 bits for client -> use planar codec
+		UINT32 dstSize = bitmapData.width * bitmapData.height * 4 + PLANAR_MAX_OVERHEAD;
+		BYTE *dst = scratch.alloc(dstSize);
+
+		BITMAP_PLANAR_CONTEXT *planar = codecs.planar(bitmapData.width, bitmapData.height, false);
+		if (planar && dst) {
+			bitmapData.bitmapDataStream = freerdp_bitmap_compress_planar(planar, image, PIXEL_FORMAT_BGRX32,
+					bitmapData.width, bitmapData.height, imageStride, dst, &dstSize);
+		}
+		if (!bitmapData.bitmapDataStream)
+			dstSize = 0;
+
+		bitmapData.bitmapLength = dstSize;
+
+	} else {
+		// bpp is other than 32 bits
+		UINT32 dstBitsPerPixel = colorDepth;
+		UINT32 dstBytesPerPixel =  ((dstBitsPerPixel + 7) / 8);
+		// allocate a buffer for the compressed image
+		// if it is too small, freerdp crashes on the following assertion:
+		// [FATAL][com.freerdp.winpr.assert] - Stream_GetRemainingCapacity(_s) >= _n
+		// so let's use the size of the original (uncompressed) image
+		UINT32 DstSize = bitmapData.width * bitmapData.height * srcBytesPerPixel;
+		BYTE* buffer = scratch.alloc(DstSize);
+
+		BOOL status = buffer && interleaved_compress(codecs.interleaved(), buffer, &DstSize,
+										bitmapData.width, bitmapData.height,
+										image, origFormat, imageStride,
+										0, 0, palette, dstBitsPerPixel);
+
+		if (!status) {
+			qCritical() << "Can not interleaved compress";
+			return;
+		}
+
+		bitmapData.bitmapDataStream = buffer;
+		bitmapData.bitmapLength = DstSize;
+		bitmapData.bitsPerPixel = dstBitsPerPixel;
+		bitmapData.cbScanWidth = bitmapData.width * dstBytesPerPixel;
+		bitmapData.cbUncompressedSize = bitmapData.width * bitmapData.height * dstBytesPerPixel;
+		bitmapData.cbCompMainBodySize = bitmapData.bitmapLength;
+		bitmapData.compressed = true;
+	}
+
+	// debug
+//	qDebug() << "BITMAP [" << bitmapData.destLeft << "," << bitmapData.destTop
+//			<< "," << bitmapData.destRight << "," << bitmapData.destBottom << "]"
+//			<< "[w " << bitmapData.width << ",h " << bitmapData.height << "]"
+//			<< "[bpp " << bitmapData.bitsPerPixel << ",f " << bitmapData.flags
+//			<< ",bmpLen " << bitmapData.bitmapLength << "]"
+//			<< "[cbCompFirstRowSize " << bitmapData.cbCompFirstRowSize
+//			<< ", cbCompMainBodySize " << bitmapData.cbCompMainBodySize
+//			<< ",cbScanWidth " << bitmapData.cbScanWidth
+//			<< ",cbUncompressedSize " << bitmapData.cbUncompressedSize
+//			<< ",compressed " << bitmapData.compressed << "]";
+}
+
 void QFreeRdpPeer::paintBitmap(const QVector<QRect> &rects) {
 	rdpUpdate *update = mClient->context->update;
 
+	// the buffers of the previous update have been sent
+	mScratch.reset();
+
 	// use bitmap update
-	BITMAP_UPDATE *bitmapUpdate = (BITMAP_UPDATE*) malloc(sizeof(BITMAP_UPDATE));
+	BITMAP_UPDATE bitmapUpdateData = {};
+	BITMAP_UPDATE *bitmapUpdate = &bitmapUpdateData;
 
-	bitmapUpdate->skipCompression = false;
+	bitmapUpdate->skipCompression = skipBulkCompression(true);
 
 	// set bitmap rectangles number
 	bitmapUpdate->number = rects.size();
 //	qDebug() << "number of rectangles : " << bitmapUpdate->number << endl;
 
-	bitmapUpdate->rectangles = (BITMAP_DATA*)malloc(bitmapUpdate->number * sizeof(BITMAP_DATA));
+	bitmapUpdate->rectangles = (BITMAP_DATA*)mScratch.alloc(bitmapUpdate->number * sizeof(BITMAP_DATA));
 
 	if (bitmapUpdate->rectangles == NULL)
 		return;
@@ -1026,132 +2249,238 @@ void QFreeRdpPeer::paintBitmap(const QVector<QRect> &rects) {
 	// get source image bits
 	const QImage *src = mPlatform->getScreen()->getScreenBits();
 
-	int i = 0;
 	auto settings = mClient->context->settings;
 
-	// fill bitmap data
-	foreach(QRect rect, rects) {
-		BITMAP_DATA bitmapData;
-
-		// coord
-		bitmapData.destLeft = rect.left();
-		bitmapData.destTop = rect.top();
-		bitmapData.destRight = rect.right();
-		bitmapData.destBottom = rect.bottom();
-		bitmapData.flags = 0x401; /* BITMAP_COMPRESSION | NO_BITMAP_COMPRESSION_HDR */
-
-		// width (inclusive bounds)
-		// freerdp requires it to be a multiple of 4
-		UINT32 width = (bitmapData.destRight - bitmapData.destLeft) + 1;
-		bitmapData.width = qCeil(qreal(width) / 16) * 16;
-
-		// height (inclusive bounds)
-		bitmapData.height = rect.bottom() - rect.top() + 1;
-
-		// bits per pixel
-		UINT32 origFormat = PIXEL_FORMAT_BGRX32;
-		switch (src->format()) {
-			case QImage::Format_RGB555 :
-				origFormat = PIXEL_FORMAT_RGB15;
-				break;
-			case QImage::Format_RGB16 :
-				origFormat = PIXEL_FORMAT_RGB16;
-				break;
-			case QImage::Format_RGB888 :
-				origFormat = PIXEL_FORMAT_RGB24;
-				break;
-			case QImage::Format_RGB32 :
-			default :
-				origFormat = PIXEL_FORMAT_BGRX32;
-				break;
+	// the update is cut in batches that the client can reassemble, each batch
+	// goes out as soon as its rects are encoded
+	UINT32 batchLimit = BITMAP_BATCH_MAX_FRAGMENTS * BITMAP_BATCH_FRAGMENT_SIZE;
+	if (!settings->FastPathOutput)
+		batchLimit = BITMAP_BATCH_FRAGMENT_SIZE;
+	else if (settings->MultifragMaxRequestSize)
+		batchLimit = qMin(batchLimit, settings->MultifragMaxRequestSize);
+	batchLimit -= BITMAP_UPDATE_HEADER_SIZE;
+
+	quint64 bytes = 0;
+	qint64 writeTime = 0;
+	UINT32 checked = 0;
+	UINT32 kept = 0;
+	UINT32 sent = 0;
+	QRegion failed;
+	auto sendBatches = [&](int done) {
+		// rects that failed to encode are taken out of the update, the others
+		// move down over them
+		for (; checked < UINT32(done); checked++) {
+			const BITMAP_DATA &bitmap = bitmapUpdate->rectangles[checked];
+			if (!bitmap.bitmapDataStream || !bitmap.bitmapLength) {
+				failed += rects[checked];
+				continue;
+			}
+			if (kept != checked)
+				bitmapUpdate->rectangles[kept] = bitmap;
+			kept++;
 		}
-		bitmapData.bitsPerPixel = settings->ColorDepth;
 
-		// options
-		bitmapData.cbCompFirstRowSize = 0x0000;
-		bitmapData.cbCompMainBodySize = 0x0000;
-		bitmapData.cbScanWidth = 0x0000;
-		bitmapData.cbUncompressedSize = 0x0000;
-		bitmapData.bitmapDataStream = NULL;
+		while (sent < kept) {
+			UINT32 end = sent;
+			UINT32 batchBytes = 0;
+			for (; end < kept; end++) {
+				UINT32 rectBytes = BITMAP_DATA_HEADER_SIZE + bitmapUpdate->rectangles[end].bitmapLength;
+				if ((end > sent) && (batchBytes + rectBytes > batchLimit))
+					break;
+				batchBytes += rectBytes;
+			}
+
+			// the next rects may still fit in this batch
+			if ((end == kept) && (checked < bitmapUpdate->number))
+				break;
+
+			BITMAP_UPDATE batch = {};
+			batch.number = end - sent;
+			batch.rectangles = bitmapUpdate->rectangles + sent;
+			batch.skipCompression = bitmapUpdate->skipCompression;
 
-		// compute subRect
-		QRect subRect(QPoint(bitmapData.destLeft, bitmapData.destTop), QSize(bitmapData.width, bitmapData.height));
-		QImage image = src->copy(subRect);
+			// the write blocks when the socket is full, which shows the throughput of the link
+			qint64 start = mClock.elapsed();
+			quint64 sentBefore = freerdp_get_transport_sent(mClient->context, FALSE);
+			update->BitmapUpdate(mClient->context, &batch);
+			writeTime += mClock.elapsed() - start;
+			countPdu(PDU_BITMAP_UPDATE, BITMAP_UPDATE_HEADER_SIZE + batchBytes, sentBefore);
 
-		auto codecs = mClient->context->codecs;
-		if (settings->ColorDepth == 32) {
-			// bpp 32 bits for client -> use planar codec
-			UINT32 dstSize;
+			bytes += batchBytes;
+			sent = end;
+		}
+	};
 
-			bitmapData.bitmapDataStream = freerdp_bitmap_compress_planar(codecs->planar, image.bits(), PIXEL_FORMAT_BGRX32,
-					bitmapData.width, bitmapData.height, bitmapData.width * 4, NULL, &dstSize);
+	// fill bitmap data, each rect is encoded by one of the encoder threads
+	const gdiPalette *palette = &mClient->context->gdi->palette;
+	QFreeRdpEncoder::instance()->run(rects.size(), [&](int i, QFreeRdpCodecContexts &codecs) {
+		encodeBitmap(src, rects[i], settings->ColorDepth, palette, mScratch, codecs, bitmapUpdate->rectangles[i]);
+	}, sendBatches);
 
-			bitmapData.bitmapLength = dstSize;
+	if (!failed.isEmpty()) {
+		qDebug("error while encoding bitmaps, sending them with the next frame");
+		deferRegion(failed);
+	}
 
-		} else {
-			// bpp is other than 32 bits
-			UINT32 dstBitsPerPixel = settings->ColorDepth;
-			UINT32 dstBytesPerPixel =  ((dstBitsPerPixel + 7) / 8);
-			UINT32 srcBytesPerPixel = (image.depth() + 7) / 8;
-			// allocate a buffer for the compressed image
-			// if it is too small, freerdp crashes on the following assertion:
-			// [FATAL][com.freerdp.winpr.assert] - Stream_GetRemainingCapacity(_s) >= _n
-			// so let's use the size of the original (uncompressed) image
-			UINT32 DstSize = bitmapData.width * bitmapData.height * srcBytesPerPixel;
-			BYTE* buffer = (BYTE*) malloc(DstSize);
-
-			BOOL status = interleaved_compress(codecs->interleaved, buffer, &DstSize,
-											bitmapData.width, bitmapData.height,
-											image.bits(), origFormat, bitmapData.width * srcBytesPerPixel,
-											0, 0, &mClient->context->gdi->palette,
-											dstBitsPerPixel);
-
-			if (!status) {
-				qCritical() << "Can not interleaved compress";
-			}
+	quint64 pixels = 0;
+	for (UINT32 i = 0; i < kept; i++)
+		pixels += bitmapUpdate->rectangles[i].width * bitmapUpdate->rectangles[i].height;
+
+	qint64 now = mClock.elapsed();
+	mBandwidth.writeCompleted(bytes, writeTime, now);
+	mBandwidth.transportSent(freerdp_get_transport_sent(mClient->context, FALSE), now);
+	mBandwidth.encoded(QFreeRdpBandwidthEstimator::ENCODING_LOSSLESS, pixels, bytes);
+}
 
-			bitmapData.bitmapDataStream = buffer;
-			bitmapData.bitmapLength = DstSize;
-			bitmapData.bitsPerPixel = dstBitsPerPixel;
-			bitmapData.cbScanWidth = bitmapData.width * dstBytesPerPixel;
-			bitmapData.cbUncompressedSize = bitmapData.width * bitmapData.height * dstBytesPerPixel;
-			bitmapData.cbCompMainBodySize = bitmapData.bitmapLength;
-			bitmapData.compressed = true;
+int QFreeRdpPeer::selectBitmapCacheCell(rdpSettings *settings) {
+	mBitmapCacheId = 0;
+	if (!mPlatform->config()->bitmap_cache_enabled || mSurfaceOutputModeEnabled ||
+			!settings->BitmapCacheEnabled || !settings->OrderSupport[NEG_MEMBLT_INDEX])
+		return 0;
+
+	// [MS-RDPBCGR] 2.2.7.1.4.2: the bitmaps of cell n are at most (16 << n) * (16 << n) pixels,
+	// the smallest cell taking 64x64 tiles is used
+	for (UINT32 cell = BITMAP_CACHE_TILE_CELL; cell < settings->BitmapCacheV2NumCells; cell++) {
+		UINT32 entries = settings->BitmapCacheV2CellInfo[cell].numEntries;
+		if (entries) {
+			mBitmapCacheId = cell;
+			return int(qMin<UINT32>(entries, BITMAP_CACHE_MAX_ENTRIES));
 		}
+	}
+	return 0;
+}
 
+void QFreeRdpPeer::paintCachedTiles(QVector<QRect> &rects) {
+	const QImage *src = mPlatform->getScreen()->getScreenBits();
+	if (!mBitmapCache.slotCount() || (src->depth() != 32))
+		return;
 
-		// add bitmap data to bitmap update
-		bitmapUpdate->rectangles[i] = bitmapData;
-		i++;
+	/** @brief a full tile, stored in the cache of the client if it's not there yet */
+	struct CachedTile {
+		QRect rect;
+		int slot;
+		bool store;
+	};
 
-		// debug
-//		qDebug() << "BITMAP [" << bitmapData.destLeft << "," << bitmapData.destTop
-//				<< "," << bitmapData.destRight << "," << bitmapData.destBottom << "]"
-//				<< "[w " << bitmapData.width << ",h " << bitmapData.height << "]"
-//				<< "[bpp " << bitmapData.bitsPerPixel << ",f " << bitmapData.flags
-//				<< ",bmpLen " << bitmapData.bitmapLength << "]"
-//				<< "[cbCompFirstRowSize " << bitmapData.cbCompFirstRowSize
-//				<< ", cbCompMainBodySize " << bitmapData.cbCompMainBodySize
-//				<< ",cbScanWidth " << bitmapData.cbScanWidth
-//				<< ",cbUncompressedSize " << bitmapData.cbUncompressedSize
-//				<< ",compressed " << bitmapData.compressed << "]";
-	}
+	// the client handles the orders in sequence, so a slot reused by a later
+	// tile of the frame still holds the content found by the lookups before it
+	QVector<CachedTile> tiles;
+	QVector<QRect> others;
+	for (const QRect &rect : rects) {
+		if ((rect.width() != BITMAP_CACHE_TILE_SIZE) || (rect.height() != BITMAP_CACHE_TILE_SIZE)) {
+			others.append(rect);
+			continue;
+		}
 
-	// send bitmap update
-	update->BitmapUpdate(mClient->context, bitmapUpdate);
+		const uchar *tileBits = src->constScanLine(rect.top()) + (rect.left() * 4);
+		quint64 key = QFreeRdpEgfxCache::tileKey(tileBits, src->bytesPerLine(), rect.width(), rect.height());
+		int slot = mBitmapCache.find(key);
+		if (slot)
+			tiles.append({ rect, slot, false });
+		else
+			tiles.append({ rect, mBitmapCache.insert(key), true });
+	}
+	if (tiles.isEmpty())
+		return;
 
-	// free bitmap
-	for (UINT32 i = 0; i < bitmapUpdate->number; ++i){
-		free(bitmapUpdate->rectangles[i].bitmapDataStream);
+	mScratch.reset();
+	BITMAP_DATA *bitmaps = (BITMAP_DATA *)mScratch.alloc(tiles.size() * sizeof(BITMAP_DATA));
+	if (!bitmaps) {
+		mBitmapCache.reset(mBitmapCache.slotCount());
+		return;
 	}
 
-	free(bitmapUpdate->rectangles);
-	free(bitmapUpdate);
+	rdpUpdate *update = mClient->context->update;
+	auto settings = mClient->context->settings;
+	QSet<int> failedSlots;
+	quint64 bytes = 0;
+	quint64 storedPixels = 0;
+	quint64 storedBytes = 0;
+	qint64 writeTime = 0;
+	int sent = 0;
+
+	// the orders of a tile go out as soon as it is encoded
+	quint64 sentBefore = freerdp_get_transport_sent(mClient->context, FALSE);
+	update->BeginPaint(mClient->context);
+	const gdiPalette *palette = &mClient->context->gdi->palette;
+	QFreeRdpEncoder::instance()->run(tiles.size(), [&](int i, QFreeRdpCodecContexts &codecs) {
+		if (tiles[i].store)
+			encodeBitmap(src, tiles[i].rect, settings->ColorDepth, palette, mScratch, codecs, bitmaps[i]);
+	}, [&](int done) {
+		qint64 start = mClock.elapsed();
+		for (; sent < done; sent++) {
+			const CachedTile &tile = tiles[sent];
+			if (tile.store) {
+				const BITMAP_DATA &bitmap = bitmaps[sent];
+				if (!bitmap.bitmapDataStream || !bitmap.bitmapLength) {
+					// sent with the bitmap update, as the tiles drawn from this slot
+					failedSlots.insert(tile.slot);
+					others.append(tile.rect);
+					continue;
+				}
+
+				CACHE_BITMAP_V2_ORDER cacheBitmap = {};
+				cacheBitmap.cacheId = mBitmapCacheId;
+				cacheBitmap.flags = 0x08; /* CBR2_NO_BITMAP_COMPRESSION_HDR */
+				cacheBitmap.bitmapBpp = bitmap.bitsPerPixel;
+				cacheBitmap.bitmapWidth = bitmap.width;
+				cacheBitmap.bitmapHeight = bitmap.height;
+				cacheBitmap.bitmapLength = bitmap.bitmapLength;
+				cacheBitmap.bitmapDataStream = bitmap.bitmapDataStream;
+				cacheBitmap.cacheIndex = tile.slot - 1;
+				cacheBitmap.compressed = TRUE;
+				update->secondary->CacheBitmapV2(mClient->context, &cacheBitmap);
+				failedSlots.remove(tile.slot);
+
+				bytes += BITMAP_CACHE_ORDER_HEADER_SIZE + bitmap.bitmapLength;
+				storedPixels += bitmap.width * bitmap.height;
+				storedBytes += BITMAP_CACHE_ORDER_HEADER_SIZE + bitmap.bitmapLength;
+			} else if (failedSlots.contains(tile.slot)) {
+				others.append(tile.rect);
+				continue;
+			}
+
+			MEMBLT_ORDER memblt = {};
+			memblt.cacheId = mBitmapCacheId;
+			memblt.nLeftRect = tile.rect.left();
+			memblt.nTopRect = tile.rect.top();
+			memblt.nWidth = tile.rect.width();
+			memblt.nHeight = tile.rect.height();
+			memblt.bRop = 0xCC; /* SRCCOPY */
+			memblt.cacheIndex = tile.slot - 1;
+			update->primary->MemBlt(mClient->context, &memblt);
+			bytes += MEMBLT_ORDER_SIZE;
+		}
+
+		// the write blocks when the socket is full, which shows the throughput of the link
+		writeTime += mClock.elapsed() - start;
+	});
+
+	qint64 start = mClock.elapsed();
+	update->EndPaint(mClient->context);
+	qint64 now = mClock.elapsed();
+	writeTime += now - start;
+	countPdu(PDU_CACHE_ORDERS, bytes, sentBefore);
+
+	// the slots whose content could not be encoded are not known to hold it
+	if (!failedSlots.isEmpty())
+		mBitmapCache.reset(mBitmapCache.slotCount());
+	rects = others;
+
+	mBandwidth.writeCompleted(bytes, writeTime, now);
+	mBandwidth.transportSent(freerdp_get_transport_sent(mClient->context, FALSE), now);
+	if (storedPixels)
+		mBandwidth.encoded(QFreeRdpBandwidthEstimator::ENCODING_LOSSLESS, storedPixels, storedBytes);
 }
 
-void QFreeRdpPeer::paintSurface(const QVector<QRect> &rects) {
+void QFreeRdpPeer::paintSurface(const QVector<QRect> &rects, QFreeRdpBandwidthEstimator::EncodingKind kind) {
+	if (mRfxSupported) {
+		paintRemoteFx(rects);
+		return;
+	}
+
 	rdpUpdate *update = mClient->context->update;
-	SURFACE_BITS_COMMAND cmd;
+	SURFACE_BITS_COMMAND cmd = {};
 	SURFACE_FRAME_MARKER marker;
 	marker.frameId = 0;
 	marker.frameId++;
@@ -1159,64 +2488,242 @@ void QFreeRdpPeer::paintSurface(const QVector<QRect> &rects) {
 	update->SurfaceFrameMarker(mClient->context, &marker);
 
 	const QImage *src = mPlatform->getScreen()->getScreenBits();
-	foreach(QRect rect, rects) {
-		cmd.bmp.width = rect.width();
-		cmd.destLeft = rect.left();
-		cmd.destRight = rect.right() + 1;
+	auto settings = mClient->context->settings;
 
-		// we split the surface to fit in the negotiated packet size
-		// 16 is an approximation of bytes required for the surface command
-		int heightIncrement = mClient->context->settings->MultifragMaxRequestSize / (16 + cmd.bmp.width * 4);
+	// we split the surface to fit in the negotiated packet size
+	// 16 is an approximation of bytes required for the surface command
+	QVector<QRect> &subRects = mEncodeRects;
+	subRects.clear();
+	foreach(QRect rect, rects) {
+		int heightIncrement = settings->MultifragMaxRequestSize / (16 + rect.width() * 4);
 		int remainingHeight = rect.height();
 		int top = rect.top();
 		while(remainingHeight) {
-			cmd.bmp.height = (remainingHeight > heightIncrement) ? heightIncrement : remainingHeight;
-			cmd.destTop = top;
-			cmd.destBottom = top + cmd.bmp.height;
+			int height = (remainingHeight > heightIncrement) ? heightIncrement : remainingHeight;
+			subRects.append(QRect(rect.left(), top, rect.width(), height));
 
-			QRect subRect(QPoint(cmd.destLeft, cmd.destTop), QSize(cmd.bmp.width, cmd.bmp.height));
+			remainingHeight -= height;
+			top += height;
+		}
+	}
 
-			cmd.bmp.bitmapDataLength = cmd.bmp.width * cmd.bmp.height * 4;
-			cmd.bmp.bitmapData = (BYTE *)malloc(cmd.bmp.bitmapDataLength * sizeof(BYTE));
+	// pieces are encoded in parallel, then sent in order. Streams and buffers
+	// come from the scratch arena.
+	mScratch.reset();
+	wStream **streams = (wStream **)mScratch.alloc(subRects.size() * sizeof(wStream *));
+	wStream *staticStreams = (wStream *)mScratch.alloc(subRects.size() * sizeof(wStream));
+	if (!streams || !staticStreams) {
+		qDebug("error allocating the surface bits streams, sending them with the next frame");
+		for (const QRect &rect : rects)
+			deferRegion(rect);
+		marker.frameAction = SURFACECMD_FRAMEACTION_END;
+		update->SurfaceFrameMarker(mClient->context, &marker);
+		return;
+	}
+	memset(streams, 0, subRects.size() * sizeof(wStream *));
+
+	UINT32 colorLoss = (kind == QFreeRdpBandwidthEstimator::ENCODING_LOSSY) ? mNscMaxColorLoss : mNscColorLoss;
+
+	QFreeRdpEncoder::instance()->run(subRects.size(), [&](int index, QFreeRdpCodecContexts &codecs) {
+		const QRect &subRect = subRects[index];
+		size_t length = subRect.width() * subRect.height() * 4;
+
+		if (mNsCodecSupported) {
+			size_t capacity = QFreeRdpCodecContexts::nscMaxSize(subRect.width(), subRect.height());
+			BYTE *buffer = mScratch.alloc(capacity);
+			NSC_CONTEXT *nsc = codecs.nsc(subRect.width(), subRect.height(), colorLoss,
+					settings->NSCodecAllowSubsampling, settings->NSCodecAllowDynamicColorFidelity);
+			if (!buffer || !nsc)
+				return;
+
+			// NSC reads the screen in place, top-down
+			const BYTE *bitmapData = src->constScanLine(subRect.top()) + subRect.left() * 4;
+			wStream *s = Stream_StaticInit(&staticStreams[index], buffer, capacity);
+			if (!nsc_compose_message(nsc, s, bitmapData, subRect.width(), subRect.height(), src->bytesPerLine()))
+				return;
+			streams[index] = s;
+		} else {
+			BYTE *buffer = mScratch.alloc(length);
+			if (!buffer)
+				return;
+
+			// get bytes in the stream (vertical flip)
+			qimage_subrect(subRect, src, buffer, true);
+			wStream *s = Stream_StaticInit(&staticStreams[index], buffer, length);
+			Stream_SetPosition(s, length);
+			streams[index] = s;
+		}
+	});
+
+	cmd.cmdType = CMDTYPE_STREAM_SURFACE_BITS;
+	// raw pixels go through the bulk compressor, NSCodec planes hardly compress further
+	cmd.skipCompression = skipBulkCompression(mNsCodecSupported);
+
+	quint64 pixels = 0;
+	quint64 bytes = 0;
+	qint64 start = mClock.elapsed();
+	QRegion failed;
+	for (int i = 0; i < subRects.size(); i++) {
+		const QRect &subRect = subRects[i];
+		wStream *s = streams[i];
+		if (!s) {
+			failed += subRect;
+			continue;
+		}
 
-			if (mNsCodecSupported) {
-				// set codec params
-				cmd.bmp.bpp = 32;
-				cmd.bmp.codecID = mClient->context->settings->NSCodecId;
+		pixels += subRect.width() * subRect.height();
+		bytes += Stream_GetPosition(s);
+
+		cmd.destLeft = subRect.left();
+		cmd.destRight = subRect.right() + 1;
+		cmd.destTop = subRect.top();
+		cmd.destBottom = subRect.top() + subRect.height();
+		cmd.bmp.width = subRect.width();
+		cmd.bmp.height = subRect.height();
+		cmd.bmp.bpp = 32;
+		cmd.bmp.codecID = mNsCodecSupported ? settings->NSCodecId : 0;
+		cmd.bmp.bitmapDataLength = Stream_GetPosition(s);
+		cmd.bmp.bitmapData = Stream_Buffer(s);
+
+		quint64 sentBefore = freerdp_get_transport_sent(mClient->context, FALSE);
+		update->SurfaceBits(mClient->context, &cmd);
+		countPdu(PDU_SURFACE_BITS, SURFACE_BITS_HEADER_SIZE + cmd.bmp.bitmapDataLength, sentBefore);
+	}
+	marker.frameAction = SURFACECMD_FRAMEACTION_END;
+	update->SurfaceFrameMarker(mClient->context, &marker);
 
-				// get bytes in cmd.bitmapData (no vertical flip)
-				qimage_subrect(subRect, src, cmd.bmp.bitmapData, false);
+	// the damage tracker counts them as sent already
+	if (!failed.isEmpty()) {
+		qDebug("error while encoding %s surface bits, sending them with the next frame",
+				mNsCodecSupported ? "NSCodec" : "raw");
+		deferRegion(failed);
+	}
 
-				// create stream of data
-				wStream* s = Stream_New(NULL, cmd.bmp.bitmapDataLength);
-				Stream_Clear(s);
-				Stream_SetPosition(s, 0);
+	qint64 now = mClock.elapsed();
+	mBandwidth.writeCompleted(bytes, now - start, now);
+	mBandwidth.transportSent(freerdp_get_transport_sent(mClient->context, FALSE), now);
+	mBandwidth.encoded(kind, pixels, bytes);
+}
 
-				// compute data with NSC codec
-				RdpPeerContext *ctx = (RdpPeerContext *)mClient->context;
+void QFreeRdpPeer::paintRemoteFx(const QVector<QRect> &rects) {
+	rdpUpdate *update = mClient->context->update;
+	const QImage *src = mPlatform->getScreen()->getScreenBits();
+	auto settings = mClient->context->settings;
 
-				nsc_compose_message(ctx->nsc_context, s,
-		                    cmd.bmp.bitmapData, subRect.width(), subRect.height(), subRect.width() * 4);
+	// RemoteFX encodes whole tiles of the 64x64 grid of the screen, the damage
+	// is extended to them
+	int tilesPerRow = (src->width() + 63) / 64;
+	int tileRows = (src->height() + 63) / 64;
+	std::vector<bool> &dirtyTiles = mRfxDirtyTiles;
+	dirtyTiles.assign(size_t(tilesPerRow) * tileRows, false);
+	for (const QRect &rect : rects) {
+		QRect clipped = rect.intersected(src->rect());
+		if (clipped.isEmpty())
+			continue;
+		for (int ty = clipped.top() / 64; ty <= clipped.bottom() / 64; ty++)
+			for (int tx = clipped.left() / 64; tx <= clipped.right() / 64; tx++)
+				dirtyTiles[ty * tilesPerRow + tx] = true;
+	}
 
-				cmd.bmp.bitmapDataLength = Stream_GetPosition(s);
-				cmd.bmp.bitmapData = Stream_Buffer(s);
-			} else {
-				// no codec used
-				cmd.bmp.bpp = 32;
-				cmd.bmp.codecID = 0;
+	// a job encodes a message made of a few tiles of a row, that fits in what
+	// the client reassembles
+	int maxTiles = RFX_JOB_MAX_TILES;
+	if (settings->MultifragMaxRequestSize > RFX_HEADERS_SIZE) {
+		maxTiles = qBound<int>(1, (settings->MultifragMaxRequestSize - RFX_HEADERS_SIZE) /
+				(RFX_MAX_TILE_SIZE + 8), RFX_JOB_MAX_TILES);
+	}
 
-				// get bytes in cmd.bitmapData (vertical flip)
-				qimage_subrect(subRect, src, cmd.bmp.bitmapData, true);
-			}
+	// jobs are runs of mRfxTiles, mRfxJobs has the first tile of each job then
+	// the end of the last one
+	mRfxTiles.clear();
+	mRfxJobs.clear();
+	for (int ty = 0; ty < tileRows; ty++) {
+		int rowStart = mRfxTiles.size();
+		for (int tx = 0; tx < tilesPerRow; tx++) {
+			if (!dirtyTiles[ty * tilesPerRow + tx])
+				continue;
+
+			if ((mRfxTiles.size() - rowStart) % maxTiles == 0)
+				mRfxJobs.append(mRfxTiles.size());
+			QRect tile = QRect(tx * 64, ty * 64, 64, 64).intersected(src->rect());
+			mRfxTiles.append(RFX_RECT{ UINT16(tile.x()), UINT16(tile.y()), UINT16(tile.width()), UINT16(tile.height()) });
+		}
+	}
+	int jobs = mRfxJobs.size();
+	mRfxJobs.append(mRfxTiles.size());
+
+	SURFACE_FRAME_MARKER marker = {};
+	marker.frameId = 1;
+	marker.frameAction = SURFACECMD_FRAMEACTION_BEGIN;
+	update->SurfaceFrameMarker(mClient->context, &marker);
 
-			update->SurfaceBits(mClient->context, &cmd);
+	// messages are encoded in parallel, with the SIMD primitives of FreeRDP,
+	// then sent in order. Streams and buffers come from the scratch arena.
+	mScratch.reset();
+	wStream **streams = (wStream **)mScratch.alloc(jobs * sizeof(wStream *));
+	wStream *staticStreams = (wStream *)mScratch.alloc(jobs * sizeof(wStream));
+	if (!streams || !staticStreams) {
+		marker.frameAction = SURFACECMD_FRAMEACTION_END;
+		update->SurfaceFrameMarker(mClient->context, &marker);
+		return;
+	}
+	memset(streams, 0, jobs * sizeof(wStream *));
 
-			free(cmd.bmp.bitmapData);
+	QFreeRdpEncoder::instance()->run(jobs, [&](int index, QFreeRdpCodecContexts &codecs) {
+		int first = mRfxJobs.at(index);
+		RFX_CONTEXT *rfx = codecs.rfx(src->width(), src->height());
+		if (!rfx)
+			return;
 
-			remainingHeight -= cmd.bmp.height;
-			top += cmd.bmp.height;
+		RFX_MESSAGE *message = rfx_encode_message(rfx, mRfxTiles.constData() + first, mRfxJobs.at(index + 1) - first,
+				src->constBits(), src->width(), src->height(), src->bytesPerLine());
+		if (!message)
+			return;
+
+		size_t capacity = QFreeRdpCodecContexts::rfxMessageSize(message);
+		BYTE *buffer = mScratch.alloc(capacity);
+		if (buffer) {
+			wStream *s = Stream_StaticInit(&staticStreams[index], buffer, capacity);
+			if (rfx_write_message(rfx, s, message))
+				streams[index] = s;
 		}
+		rfx_message_free(rfx, message);
+	});
+
+	// each message has its rects, the command covers the screen
+	SURFACE_BITS_COMMAND cmd = {};
+	cmd.cmdType = CMDTYPE_STREAM_SURFACE_BITS;
+	cmd.destRight = src->width();
+	cmd.destBottom = src->height();
+	cmd.bmp.bpp = 32;
+	cmd.bmp.codecID = settings->RemoteFxCodecId;
+	cmd.bmp.width = src->width();
+	cmd.bmp.height = src->height();
+	cmd.skipCompression = skipBulkCompression(true);
+
+	quint64 pixels = 0;
+	quint64 bytes = 0;
+	qint64 start = mClock.elapsed();
+	for (int i = 0; i < jobs; i++) {
+		wStream *s = streams[i];
+		if (!s)
+			continue;
+
+		for (int tile = mRfxJobs.at(i); tile < mRfxJobs.at(i + 1); tile++)
+			pixels += mRfxTiles.at(tile).width * mRfxTiles.at(tile).height;
+		bytes += Stream_GetPosition(s);
+
+		cmd.bmp.bitmapDataLength = Stream_GetPosition(s);
+		cmd.bmp.bitmapData = Stream_Buffer(s);
+		quint64 sentBefore = freerdp_get_transport_sent(mClient->context, FALSE);
+		update->SurfaceBits(mClient->context, &cmd);
+		countPdu(PDU_SURFACE_BITS, SURFACE_BITS_HEADER_SIZE + cmd.bmp.bitmapDataLength, sentBefore);
 	}
 	marker.frameAction = SURFACECMD_FRAMEACTION_END;
 	update->SurfaceFrameMarker(mClient->context, &marker);
+
+	qint64 now = mClock.elapsed();
+	mBandwidth.writeCompleted(bytes, now - start, now);
+	mBandwidth.transportSent(freerdp_get_transport_sent(mClient->context, FALSE), now);
+	mBandwidth.encoded(QFreeRdpBandwidthEstimator::ENCODING_LOSSLESS, pixels, bytes);
 }
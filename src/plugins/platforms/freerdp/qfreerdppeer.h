@@ -22,21 +22,34 @@
 #ifndef __QFREERDPPEER_H__
 #define __QFREERDPPEER_H__
 
+#include <vector>
+
+#include <freerdp/codec/h264.h>
+#include <freerdp/codec/progressive.h>
 #include <freerdp/peer.h>
 #include <freerdp/pointer.h>
 #include <freerdp/server/rdpgfx.h>
 
+#include <QElapsedTimer>
+#include <QHash>
 #include <QImage>
 #include <QMap>
+#include <QTimer>
+#include <QVector>
 
 
+#include "qfreerdpbandwidth.h"
 #include "qfreerdpcompositor.h"
+#include "qfreerdpegfxcache.h"
+#include "qfreerdpencoder.h"
 #include "qfreerdppeerkeyboard.h"
+#include "qfreerdptileclassifier.h"
 
 QT_BEGIN_NAMESPACE
 
 class QFreeRdpPlatform;
 class QFreerdpPeerClipboard;
+class QFreeRdpPeerRail;
 class QSocketNotifier;
 
 /**
@@ -44,6 +57,7 @@ class QSocketNotifier;
  */
 class QFreeRdpPeer : public QObject {
 	friend class QFreerdpPeerClipboard;
+	friend class QFreeRdpPeerRail;
 	friend class QFreeRdpPlatform;
 
     Q_OBJECT
@@ -60,20 +74,67 @@ public:
     bool setPointer(const POINTER_LARGE_UPDATE *pointer, Qt::CursorShape newShape);
     freerdp_peer *freerdpPeer() const;
 
+    /**
+     * Encodes a rect of src for a bitmap update or a bitmap cache order, in
+     * buffers of scratch. The planar codec is used at 32 bpp, the interleaved
+     * one below.
+     */
+    static void encodeBitmap(const QImage *src, const QRect &rect, UINT32 colorDepth, const gdiPalette *palette,
+    		QFreeRdpScratchArena &scratch, QFreeRdpCodecContexts &codecs, BITMAP_DATA &bitmapData);
+
 protected:
 	// Sends bitmap updates for
-	// - the rectangles contained in `region`
-	// - rectangles internally marked as dirty
-	void repaint(const QRegion &rect, bool useCompositorCache = true);
-	void repaint_raw(const QRegion &rect);
-	bool repaint_egfx(const QRegion &rect, bool compress);
+	// - the damage and the moves of the current frame
+	// - tiles modified by the frames this peer has missed
+	void repaint();
+	// Sends the content of `region` as is
+	void refresh(const QRegion &region);
+	void paint(const QRegion &region, const QFreeRdpMoveList &moves, const QFreeRdpFillList &fills);
+	void repaint_raw(const QRegion &rect, const QFreeRdpMoveList &moves, const QFreeRdpFillList &fills);
+
+	/** @brief codec of the EGFX surface commands */
+	enum EgfxCodec {
+		EGFX_CODEC_UNCOMPRESSED,
+		EGFX_CODEC_PLANAR,
+		EGFX_CODEC_PROGRESSIVE, /**< lossy, refined later with a lossless codec */
+	};
+	EgfxCodec losslessEgfxCodec() const;
+	bool repaint_egfx(const QRegion &rect, const QFreeRdpMoveList &moves, const QFreeRdpFillList &fills,
+			EgfxCodec codec, bool allowLossy = true);
+	bool startEgfxFrame();
+	bool endEgfxFrame();
+	// Encodes the given region of src on a surface, with the planar codec or raw
+	bool sendSurfaceBits(UINT16 surfaceId, const QImage *src, const QRegion &region,
+			const QSize &surfaceSize, bool compress);
+	// Sends the dirty content of the RemoteApp windows, each on its own surface
+	bool repaint_rail_egfx();
+	bool sendSolidFills(const QFreeRdpFillList &fills);
+	// Sends the tiles of the region classified as photos or animations with the
+	// progressive codec, and solid ones as fills. The region keeps the others.
+	bool classifyTiles(QRegion &region, const QRect &surfaceRect);
+	bool encodeProgressive(const QRegion &region, const QSize &surfaceSize);
+	bool initAvcEncoder();
+	bool encodeAvc420(const QRect &rect, const QSize &surfaceSize);
+	// Sends the areas that went out with a lossy codec again, once they stopped changing
+	void refineLossyRegion();
+	// Keeps the tiles that fit in the byte budget of the frame, the nearest to
+	// the pointer first, and returns the others
+	QRegion trimToBudget(QVector<QRect> &tiles, quint64 budget, double bytesPerPixel) const;
+	// Sends the region with the next frame
+	void deferRegion(const QRegion &region);
+	// Sends a round trip measure request, and starts or stops a bandwidth measure
+	void measureLink();
+	bool canSendMoves() const;
+	bool canSendFills() const;
 	void handleVirtualKeycode(quint32 flags, quint32 vk_code);
 	void updateMouseButtonsFromFlags(DWORD flags, bool &down, bool extended);
 	void init_display(freerdp_peer* client);
 	UINT16 getCursorCacheIndex(Qt::CursorShape shape, bool &isNew, bool &isUpdate);
 	bool initializeChannels();
 
-	bool frameAck(UINT32 frameId);
+	bool frameAck(UINT32 frameId, UINT32 queueDepth = QUEUE_DEPTH_UNAVAILABLE);
+	bool canStartEgfxFrame();
+	int egfxFrameInterval() const;
 	bool initGfxDisplay();
 	bool egfx_caps_test(const RDPGFX_CAPS_ADVERTISE_PDU* capsAdvertise, UINT32 version, UINT &rc);
 	void checkDrdynvcState();
@@ -81,6 +142,7 @@ protected:
 public slots:
 	void incomingBytes(int sock);
 	void channelTraffic(int sock);
+	void gfxTraffic(int sock);
 
 
 protected:
@@ -99,6 +161,10 @@ protected:
 	// [MS-RDPBGGR] 2.2.11.2 Client Suppress Output PDU
 	static BOOL xf_suppress_output(rdpContext* context, BYTE allow, const RECTANGLE_16 *area);
 	static BOOL xf_surface_frame_acknowledge(rdpContext* context, UINT32 frameId);
+	// [MS-RDPBCGR] 2.2.14 network characteristics detection
+	static BOOL xf_rtt_measure_response(rdpAutoDetect *autodetect, RDP_TRANSPORT_TYPE transport, UINT16 sequenceNumber);
+	static BOOL xf_bandwidth_measure_result(rdpAutoDetect *autodetect, RDP_TRANSPORT_TYPE transport,
+			UINT16 responseType, UINT16 sequenceNumber, UINT32 timeDelta, UINT32 byteCount);
 
 	static UINT rdpgfx_caps_advertise(RdpgfxServerContext* context, const RDPGFX_CAPS_ADVERTISE_PDU* capsAdvertise);
 	static UINT rdpgfx_frame_acknowledge(RdpgfxServerContext* context, const RDPGFX_FRAME_ACKNOWLEDGE_PDU* frameAcknowledge);
@@ -133,16 +199,111 @@ protected:
 
     bool mSurfaceOutputModeEnabled;
     bool mNsCodecSupported;
-    QFreeRdpCompositor mCompositor;
+    bool mRfxSupported;
+    UINT32 mNscColorLoss;
+    UINT32 mNscMaxColorLoss;
+    QFreeRdpDamageTracker mDamage;
     RenderMode mRenderMode;
 
     HANDLE mVcm;
     QFreerdpPeerClipboard *mClipboard;
+    QFreeRdpPeerRail *mRail;
     RdpgfxServerContext* mRdpgfx;
     bool mGfxOpened;
+    // egfx messages are handled on this thread, as they touch the state of the peer
+    QSocketNotifier *mGfxNotifier;
     bool mSurfaceCreated;
     UINT16 mSurfaceId;
+    UINT16 mNextSurfaceId;
     UINT32 mFrameId;
+    int mEgfxCacheSlots;
+    QFreeRdpEgfxCache mEgfxCache;
+    // cell of the client bitmap cache holding the 64x64 tiles in bitmap updates mode,
+    // the slots of the model are the cache indexes + 1
+    UINT32 mBitmapCacheId;
+    QFreeRdpEgfxCache mBitmapCache;
+
+    /** @brief EGFX flow control
+     *
+     * At most a few frames are sent without being acknowledged, meanwhile the
+     * damage coalesces in the damage tracker. The interval between frames
+     * follows the acknowledge latency, so that slow links get fewer frames
+     * rather than a growing lag. It starts from the base interval, which is
+     * longer for slow links in autodetect mode.
+     * @{ */
+    QElapsedTimer mClock;
+    QHash<UINT32, qint64> mFramesInFlight;
+    UINT32 mClientQueueDepth;
+    bool mFrameAcksSuspended;
+    int mAckLatency;
+    int mBaseFrameInterval;
+    qint64 mLastFrameTime;
+    bool mRepaintPending;
+    QTimer mDeferredRepaint;
+    /** @} */
+
+    /** @brief lossy EGFX updates
+     *
+     * Areas sent with the progressive or the AVC420 codec are tracked, and sent
+     * again with a lossless codec when no lossy update came for a while. AVC420
+     * is only used for the areas that keep changing.
+     * @{ */
+    PROGRESSIVE_CONTEXT *mProgressive;
+    H264_CONTEXT *mH264;
+    bool mAvcEnabled;
+    bool mEgfxProgressive;
+    QRegion mLossyRegion;
+    QTimer mRefineTimer;
+    /** @} */
+
+    /** @brief throughput of the link
+     *
+     * Each frame gets a byte budget from the estimated throughput. Over it,
+     * EGFX updates drop to the progressive codec, then the tiles far from the
+     * pointer wait for the next frames. Lossy areas are refined as the budget
+     * allows.
+     * @{ */
+    QFreeRdpBandwidthEstimator mBandwidth;
+    quint64 mFrameBytes;
+    QRegion mDeferredRegion;
+    QTimer mLinkTimer;
+    UINT16 mRttSequence;
+    qint64 mRttRequestTime;
+    UINT16 mBandwidthSequence;
+    bool mBandwidthMeasuring;
+    /** @} */
+
+    /** @brief kinds of update PDUs, for the bulk compression counters */
+    enum PduKind {
+		PDU_BITMAP_UPDATE,
+		PDU_SURFACE_BITS,
+		PDU_CACHE_ORDERS,
+		PDU_KIND_COUNT
+    };
+
+    /** @brief bulk compression
+     *
+     * Bytes handed to FreeRDP and bytes written by the transport once
+     * compressed, per kind of PDU.
+     * @{ */
+    quint64 mPduPayloadBytes[PDU_KIND_COUNT];
+    quint64 mPduSentBytes[PDU_KIND_COUNT];
+    /** @} */
+
+    /** @brief decisions of the per tile codec choice */
+    QFreeRdpTileClassifier mClassifier;
+
+    /** @brief buffers of the encoded data, reused from one frame to the next */
+    QFreeRdpScratchArena mScratch;
+
+    /** @brief lists of the rects of a frame, they keep their capacity from one frame to the next
+     * @{ */
+    QVector<QRect> mPaintRects;
+    QVector<QRect> mEncodeRects;
+    std::vector<bool> mRfxDirtyTiles;
+    QVector<RFX_RECT> mRfxTiles;
+    QVector<int> mRfxJobs;
+    /** @} */
 
     /** @brief a cursor cache entry */
 	struct CursorCacheItem {
@@ -156,10 +317,23 @@ protected:
 private :
 	void sendFullRefresh(rdpSettings *settings);
 	void paintBitmap(const QVector<QRect> &rects);
-	void paintSurface(const QVector<QRect> &rects);
+	// Picks the bitmap cache cell for the 64x64 tiles, returns its number of entries
+	int selectBitmapCacheCell(rdpSettings *settings);
+	// Sends the full tiles with bitmap cache orders and removes them from the rects
+	void paintCachedTiles(QVector<QRect> &rects);
+	// Sends surface bits, kind is ENCODING_LOSSY to use the highest NSC color loss
+	void paintSurface(const QVector<QRect> &rects, QFreeRdpBandwidthEstimator::EncodingKind kind);
+	// Sends surface bits with RemoteFX, the rects are extended to the tiles of the 64x64 grid
+	void paintRemoteFx(const QVector<QRect> &rects);
 	BOOL detectDisplaySettings(freerdp_peer* client);
 	BOOL configureDisplayLegacyMode(rdpSettings *settings);
-	BOOL configureOptimizeMode(rdpSettings *settings);
+	BOOL configureOptimizeMode(rdpSettings *settings, bool preferRfx = true);
+	BOOL configureAutodetectMode(rdpSettings *settings);
+	void configureBulkCompression(rdpSettings *settings);
+	// Whether FreeRDP should skip the bulk compression of a PDU, given if its payload is compressed
+	bool skipBulkCompression(bool compressedPayload) const;
+	// Counts a PDU sent since the transport had written sentBefore bytes
+	void countPdu(PduKind kind, quint64 payload, quint64 sentBefore);
 };
 
 QT_END_NAMESPACE
@@ -0,0 +1,398 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <winpr/user.h>
+
+#include <QDebug>
+#include <QSet>
+#include <QSocketNotifier>
+#include <QtGui/qpa/qwindowsysteminterface.h>
+
+#include "qfreerdppeerrail.h"
+#include "qfreerdpplatform.h"
+#include "qfreerdppeer.h"
+#include "qfreerdpwindow.h"
+#include "qfreerdpwindowmanager.h"
+
+/** build number sent in the server handshake, the one of Windows 7 */
+#define RAIL_HANDSHAKE_BUILD_NUMBER 0x1DB0
+
+QFreeRdpPeerRail::QFreeRdpPeerRail(QFreeRdpPeer *parent, HANDLE vcm)
+: mParent(parent)
+, mRail(rail_server_context_new(vcm))
+, mNotifier(nullptr)
+, mReady(false)
+{
+	Q_ASSERT(mRail);
+
+	mRail->custom = this;
+	mRail->rdpcontext = parent->mClient->context;
+
+	mRail->ClientHandshake = rail_client_handshake;
+	mRail->ClientClientStatus = rail_client_status;
+	mRail->ClientExec = rail_client_exec;
+	mRail->ClientSysparam = rail_client_sysparam;
+	mRail->ClientActivate = rail_client_activate;
+	mRail->ClientSysCommand = rail_client_syscommand;
+	mRail->ClientWindowMove = rail_client_window_move;
+}
+
+QFreeRdpPeerRail::~QFreeRdpPeerRail() {
+	delete mNotifier;
+
+	mRail->Stop(mRail);
+	rail_server_context_free(mRail);
+	mRail = nullptr;
+}
+
+bool QFreeRdpPeerRail::start() {
+	if (mRail->Start(mRail) != CHANNEL_RC_OK) {
+		qDebug() << "error starting RAIL";
+		return false;
+	}
+
+	HANDLE channelEvent = rail_server_get_channel_event(mRail);
+	if (!channelEvent) {
+		qDebug() << "no event handle for the RAIL channel";
+		return false;
+	}
+
+	mNotifier = new QSocketNotifier(GetEventFileDescriptor(channelEvent), QSocketNotifier::Read);
+	connect(mNotifier, &QSocketNotifier::activated, this, &QFreeRdpPeerRail::channelTraffic);
+
+	// the client answers with its own handshake, then its status and the program to run
+	RAIL_HANDSHAKE_ORDER handshake = { RAIL_HANDSHAKE_BUILD_NUMBER };
+	if (mRail->ServerHandshake(mRail, &handshake) != CHANNEL_RC_OK) {
+		qDebug() << "error sending RAIL handshake";
+		return false;
+	}
+
+	return true;
+}
+
+void QFreeRdpPeerRail::channelTraffic(int) {
+	UINT rc = rail_server_handle_messages(mRail);
+	if (rc != CHANNEL_RC_OK)
+		qDebug("error treating RAIL messages: 0x%x", rc);
+}
+
+bool QFreeRdpPeerRail::isRailWindow(QFreeRdpWindow *window) {
+	return window->isVisible() && (window->window()->type() != Qt::Desktop) &&
+			!window->geometry().isEmpty() && window->windowContent();
+}
+
+static void windowStyles(QWindow *window, UINT32 &style, UINT32 &exStyle) {
+	bool frameless = (window->flags() & Qt::FramelessWindowHint);
+
+	switch(window->type()) {
+	case Qt::Window:
+		if (!frameless) {
+			style = WS_CAPTION | WS_SYSMENU | WS_THICKFRAME | WS_MINIMIZEBOX | WS_MAXIMIZEBOX;
+			exStyle = WS_EX_APPWINDOW;
+			return;
+		}
+		break;
+	case Qt::Dialog:
+		if (!frameless) {
+			style = WS_CAPTION | WS_SYSMENU;
+			exStyle = WS_EX_DLGMODALFRAME;
+			return;
+		}
+		break;
+	default:
+		break;
+	}
+
+	// popups, menus and tooltips are shown as is and stay out of the taskbar
+	style = WS_POPUP;
+	exStyle = WS_EX_TOOLWINDOW;
+}
+
+bool QFreeRdpPeerRail::syncWindows() {
+	if (!mReady)
+		return true;
+
+	const QFreeRdpWindowManager::QFreeRdpWindowList *windows = mParent->mPlatform->mWindowManager->getAllWindows();
+	QSet<WId> alive;
+
+	// from the bottom of the stack, so that new windows are created in order
+	for (auto it = windows->crbegin(); it != windows->crend(); ++it) {
+		QFreeRdpWindow *window = *it;
+		if (!isRailWindow(window))
+			continue;
+
+		WId id = window->winId();
+		QWindow *qwindow = window->window();
+		QWindow *parent = qwindow->transientParent();
+		alive.insert(id);
+
+		RailWindow state;
+		state.geometry = window->geometry();
+		state.title = qwindow->title();
+		windowStyles(qwindow, state.style, state.exStyle);
+		state.owner = (parent && parent->handle()) ? UINT32(parent->handle()->winId()) : 0;
+		state.surfaceId = 0;
+
+		auto known = mWindows.find(id);
+		if (known == mWindows.end()) {
+			state.dirty = QRect(QPoint(0, 0), state.geometry.size());
+			if (!sendWindowOrder(id, state, WINDOW_ORDER_STATE_NEW |
+					WINDOW_ORDER_FIELD_OWNER | WINDOW_ORDER_FIELD_STYLE | WINDOW_ORDER_FIELD_SHOW |
+					WINDOW_ORDER_FIELD_TITLE | WINDOW_ORDER_FIELD_CLIENT_AREA_OFFSET |
+					WINDOW_ORDER_FIELD_CLIENT_AREA_SIZE | WINDOW_ORDER_FIELD_WND_OFFSET |
+					WINDOW_ORDER_FIELD_WND_SIZE | WINDOW_ORDER_FIELD_WND_RECTS |
+					WINDOW_ORDER_FIELD_VIS_OFFSET | WINDOW_ORDER_FIELD_VISIBILITY |
+					WINDOW_ORDER_FIELD_WND_CLIENT_DELTA))
+				return false;
+
+			mWindows.insert(id, state);
+			continue;
+		}
+
+		// only what changed is sent, a move is a few bytes
+		UINT32 fields = 0;
+		if (known->geometry.topLeft() != state.geometry.topLeft())
+			fields |= WINDOW_ORDER_FIELD_CLIENT_AREA_OFFSET | WINDOW_ORDER_FIELD_WND_OFFSET |
+					WINDOW_ORDER_FIELD_VIS_OFFSET;
+		if (known->geometry.size() != state.geometry.size())
+			fields |= WINDOW_ORDER_FIELD_CLIENT_AREA_SIZE | WINDOW_ORDER_FIELD_WND_SIZE |
+					WINDOW_ORDER_FIELD_WND_RECTS | WINDOW_ORDER_FIELD_VISIBILITY;
+		if (known->title != state.title)
+			fields |= WINDOW_ORDER_FIELD_TITLE;
+		if ((known->style != state.style) || (known->exStyle != state.exStyle))
+			fields |= WINDOW_ORDER_FIELD_STYLE;
+		if (known->owner != state.owner)
+			fields |= WINDOW_ORDER_FIELD_OWNER;
+		if (!fields)
+			continue;
+
+		known->geometry = state.geometry;
+		known->title = state.title;
+		known->style = state.style;
+		known->exStyle = state.exStyle;
+		known->owner = state.owner;
+		if (!sendWindowOrder(id, *known, fields))
+			return false;
+	}
+
+	for (auto it = mWindows.begin(); it != mWindows.end(); ) {
+		if (alive.contains(it.key())) {
+			++it;
+			continue;
+		}
+
+		if (!sendWindowDelete(it.key()))
+			return false;
+
+		if (it->surfaceId)
+			mDroppedSurfaces.append(it->surfaceId);
+		it = mWindows.erase(it);
+	}
+
+	return true;
+}
+
+bool QFreeRdpPeerRail::sendWindowOrder(WId id, const RailWindow &state, UINT32 fieldFlags) {
+	rdpContext *context = mParent->mClient->context;
+	rdpUpdate *update = context->update;
+	const QRect &geometry = state.geometry;
+
+	// window and visibility rects are relative to the window
+	RECTANGLE_16 windowRect = { 0, 0, (UINT16)geometry.width(), (UINT16)geometry.height() };
+
+	WINDOW_ORDER_INFO orderInfo = { };
+	orderInfo.windowId = UINT32(id);
+	orderInfo.fieldFlags = WINDOW_ORDER_TYPE_WINDOW | fieldFlags;
+
+	WINDOW_STATE_ORDER windowState = { };
+	windowState.ownerWindowId = state.owner;
+	windowState.style = state.style;
+	windowState.extendedStyle = state.exStyle;
+	windowState.showState = WINDOW_SHOW;
+	windowState.titleInfo.string = (BYTE *)state.title.utf16();
+	windowState.titleInfo.length = UINT16(state.title.size() * sizeof(char16_t));
+	windowState.clientOffsetX = geometry.left();
+	windowState.clientOffsetY = geometry.top();
+	windowState.clientAreaWidth = geometry.width();
+	windowState.clientAreaHeight = geometry.height();
+	windowState.windowOffsetX = geometry.left();
+	windowState.windowOffsetY = geometry.top();
+	windowState.windowClientDeltaX = 0;
+	windowState.windowClientDeltaY = 0;
+	windowState.windowWidth = geometry.width();
+	windowState.windowHeight = geometry.height();
+	windowState.numWindowRects = 1;
+	windowState.windowRects = &windowRect;
+	windowState.visibleOffsetX = geometry.left();
+	windowState.visibleOffsetY = geometry.top();
+	windowState.numVisibilityRects = 1;
+	windowState.visibilityRects = &windowRect;
+
+	BOOL ok;
+	update->BeginPaint(context);
+	if (fieldFlags & WINDOW_ORDER_STATE_NEW)
+		ok = update->window->WindowCreate(context, &orderInfo, &windowState);
+	else
+		ok = update->window->WindowUpdate(context, &orderInfo, &windowState);
+	update->EndPaint(context);
+
+	if (!ok)
+		qDebug("error sending the RAIL order of window %llu", (unsigned long long)id);
+	return ok;
+}
+
+bool QFreeRdpPeerRail::sendWindowDelete(WId id) {
+	rdpContext *context = mParent->mClient->context;
+	rdpUpdate *update = context->update;
+
+	WINDOW_ORDER_INFO orderInfo = { };
+	orderInfo.windowId = UINT32(id);
+	orderInfo.fieldFlags = WINDOW_ORDER_TYPE_WINDOW | WINDOW_ORDER_STATE_DELETED;
+
+	update->BeginPaint(context);
+	BOOL ok = update->window->WindowDelete(context, &orderInfo);
+	update->EndPaint(context);
+
+	if (!ok)
+		qDebug("error deleting RAIL window %llu", (unsigned long long)id);
+	return ok;
+}
+
+void QFreeRdpPeerRail::addDamage(WId id, const QRegion &region) {
+	auto it = mWindows.find(id);
+	if (it != mWindows.end())
+		it->dirty += region;
+}
+
+void QFreeRdpPeerRail::invalidate(bool surfacesLost) {
+	for (RailWindow &state : mWindows) {
+		state.dirty = QRect(QPoint(0, 0), state.geometry.size());
+		if (surfacesLost) {
+			state.surfaceId = 0;
+			state.surfaceSize = QSize();
+		}
+	}
+
+	if (surfacesLost)
+		mDroppedSurfaces.clear();
+}
+
+QVector<UINT16> QFreeRdpPeerRail::takeDroppedSurfaces() {
+	QVector<UINT16> ret;
+	ret.swap(mDroppedSurfaces);
+	return ret;
+}
+
+QFreeRdpWindow *QFreeRdpPeerRail::window(UINT32 windowId) const {
+	foreach(QFreeRdpWindow *window, *mParent->mPlatform->mWindowManager->getAllWindows()) {
+		if (UINT32(window->winId()) == windowId)
+			return window;
+	}
+	return nullptr;
+}
+
+UINT QFreeRdpPeerRail::rail_client_handshake(RailServerContext *context, const RAIL_HANDSHAKE_ORDER *handshake) {
+	QFreeRdpPeerRail *rail = (QFreeRdpPeerRail *)context->custom;
+
+	qDebug("RAIL handshake, client build %u", handshake->buildNumber);
+	rail->mReady = true;
+
+	// existing windows are announced right away
+	rail->mParent->repaint();
+	return CHANNEL_RC_OK;
+}
+
+UINT QFreeRdpPeerRail::rail_client_status(RailServerContext * /*context*/, const RAIL_CLIENT_STATUS_ORDER *clientStatus) {
+	qDebug("RAIL client status 0x%x", clientStatus->flags);
+	return CHANNEL_RC_OK;
+}
+
+UINT QFreeRdpPeerRail::rail_client_exec(RailServerContext *context, const RAIL_EXEC_ORDER *exec) {
+	QFreeRdpPeerRail *rail = (QFreeRdpPeerRail *)context->custom;
+
+	// the application is already running, any program asked for is that one
+	RAIL_EXEC_RESULT_ORDER result = { };
+	result.flags = exec->flags;
+	result.execResult = RAIL_EXEC_S_OK;
+	result.rawResult = 0;
+	return rail->mRail->ServerExecResult(rail->mRail, &result);
+}
+
+UINT QFreeRdpPeerRail::rail_client_sysparam(RailServerContext * /*context*/, const RAIL_SYSPARAM_ORDER * /*sysparam*/) {
+	return CHANNEL_RC_OK;
+}
+
+UINT QFreeRdpPeerRail::rail_client_activate(RailServerContext *context, const RAIL_ACTIVATE_ORDER *activate) {
+	QFreeRdpPeerRail *rail = (QFreeRdpPeerRail *)context->custom;
+
+	if (!activate->enabled)
+		return CHANNEL_RC_OK;
+
+	// the stacking follows the client, so that input goes to the window under the pointer
+	QFreeRdpWindow *window = rail->window(activate->windowId);
+	if (window)
+		rail->mParent->mPlatform->mWindowManager->setFocusWindow(window);
+	return CHANNEL_RC_OK;
+}
+
+UINT QFreeRdpPeerRail::rail_client_syscommand(RailServerContext *context, const RAIL_SYSCOMMAND_ORDER *syscommand) {
+	QFreeRdpPeerRail *rail = (QFreeRdpPeerRail *)context->custom;
+	QFreeRdpWindow *window = rail->window(syscommand->windowId);
+	if (!window)
+		return CHANNEL_RC_OK;
+
+	switch (syscommand->command) {
+	case SC_CLOSE:
+		QWindowSystemInterface::handleCloseEvent(window->window());
+		break;
+	case SC_MINIMIZE:
+		window->window()->showMinimized();
+		break;
+	case SC_MAXIMIZE:
+		window->window()->showMaximized();
+		break;
+	case SC_RESTORE:
+		window->window()->showNormal();
+		break;
+	default:
+		qDebug("RAIL system command 0x%x not handled", syscommand->command);
+		break;
+	}
+	return CHANNEL_RC_OK;
+}
+
+UINT QFreeRdpPeerRail::rail_client_window_move(RailServerContext *context, const RAIL_WINDOW_MOVE_ORDER *windowMove) {
+	QFreeRdpPeerRail *rail = (QFreeRdpPeerRail *)context->custom;
+	QFreeRdpWindow *window = rail->window(windowMove->windowId);
+	if (!window)
+		return CHANNEL_RC_OK;
+
+	QRect geometry(windowMove->left, windowMove->top,
+			windowMove->right - windowMove->left, windowMove->bottom - windowMove->top);
+
+	// the client already shows the window there, no need to tell it back
+	auto it = rail->mWindows.find(window->winId());
+	if (it != rail->mWindows.end())
+		it->geometry = geometry;
+
+	window->window()->setGeometry(geometry);
+	return CHANNEL_RC_OK;
+}
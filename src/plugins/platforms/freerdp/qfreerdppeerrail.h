@@ -0,0 +1,122 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __QFREERDPPEERRAIL_H__
+#define __QFREERDPPEERRAIL_H__
+
+#include <freerdp/server/rail.h>
+
+#include <QHash>
+#include <QObject>
+#include <QRegion>
+#include <QVector>
+#include <QWindow>
+
+class QFreeRdpPeer;
+class QFreeRdpWindow;
+class QSocketNotifier;
+
+/**
+ * @brief RemoteApp (RAIL) channel of a peer
+ *
+ * Each visible top-level Qt window is announced to the client with window
+ * orders, the client shows it as a window of its own desktop. Moves and
+ * resizes done on the client side come back as window move PDUs, and the ones
+ * done by Qt only cost a window update order.
+ */
+class QFreeRdpPeerRail : public QObject {
+	Q_OBJECT
+
+public:
+	/** @brief what has been sent to the client about a window */
+	struct RailWindow {
+		QRect geometry;
+		QString title;
+		UINT32 style;
+		UINT32 exStyle;
+		UINT32 owner;
+		UINT16 surfaceId;  /**< EGFX surface mapped on the window, 0 if none yet */
+		QSize surfaceSize;
+		QRegion dirty;     /**< content to send, in window coordinates */
+	};
+	typedef QHash<WId, RailWindow> RailWindows;
+
+	QFreeRdpPeerRail(QFreeRdpPeer *parent, HANDLE vcm);
+	~QFreeRdpPeerRail();
+
+	bool start();
+
+	/** @return if the handshake is done and window orders can be sent */
+	bool isReady() const { return mReady; }
+
+	/**
+	 * Sends the window orders to bring the client up to date with the windows
+	 * of the window manager. Surfaces of the deleted or resized windows are
+	 * given back by takeDroppedSurfaces().
+	 */
+	bool syncWindows();
+
+	/** records a change of the content of a window, in window coordinates */
+	void addDamage(WId id, const QRegion &region);
+
+	/**
+	 * Marks the full content of all windows as dirty.
+	 *
+	 * @param surfacesLost if the client dropped the surfaces (graphics reset)
+	 */
+	void invalidate(bool surfacesLost);
+
+	RailWindows &windows() { return mWindows; }
+
+	/** @return the surfaces that are not mapped to a window anymore */
+	QVector<UINT16> takeDroppedSurfaces();
+
+	/** @return the window manager window with the given id, nullptr if none */
+	QFreeRdpWindow *window(UINT32 windowId) const;
+
+protected slots:
+	void channelTraffic(int);
+
+protected:
+	static bool isRailWindow(QFreeRdpWindow *window);
+	bool sendWindowOrder(WId id, const RailWindow &state, UINT32 fieldFlags);
+	bool sendWindowDelete(WId id);
+
+	/** RAIL callbacks
+	 * @{ */
+	static UINT rail_client_handshake(RailServerContext *context, const RAIL_HANDSHAKE_ORDER *handshake);
+	static UINT rail_client_status(RailServerContext *context, const RAIL_CLIENT_STATUS_ORDER *clientStatus);
+	static UINT rail_client_exec(RailServerContext *context, const RAIL_EXEC_ORDER *exec);
+	static UINT rail_client_sysparam(RailServerContext *context, const RAIL_SYSPARAM_ORDER *sysparam);
+	static UINT rail_client_activate(RailServerContext *context, const RAIL_ACTIVATE_ORDER *activate);
+	static UINT rail_client_syscommand(RailServerContext *context, const RAIL_SYSCOMMAND_ORDER *syscommand);
+	static UINT rail_client_window_move(RailServerContext *context, const RAIL_WINDOW_MOVE_ORDER *windowMove);
+	/** @} */
+
+	QFreeRdpPeer *mParent;
+	RailServerContext *mRail;
+	QSocketNotifier *mNotifier;
+	bool mReady;
+	RailWindows mWindows;
+	QVector<UINT16> mDroppedSurfaces;
+};
+
+#endif /* __QFREERDPPEERRAIL_H__ */
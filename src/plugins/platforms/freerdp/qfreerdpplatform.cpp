@@ -49,7 +49,9 @@
 #include "qfreerdplistener.h"
 #include "qfreerdpscreen.h"
 #include "qfreerdppeer.h"
+#include "qfreerdppeerrail.h"
 #include "qfreerdpclipboard.h"
+#include "qfreerdpencoder.h"
 #include "qfreerdpwindow.h"
 #include "qfreerdpwindowmanager.h"
 #include "xcursors/qfreerdpxcursor.h"
@@ -75,10 +77,24 @@ QFreeRdpPlatformConfig::QFreeRdpPlatformConfig(const QStringList &params) :
 	fps(24),
 	clipboard_enabled(true),
 	egfx_enabled(true),
+	egfx_progressive(false),
+	egfx_avc(false),
+	egfx_autocodec(false),
+	rfx_enabled(true),
+	bitmap_cache_enabled(true),
+	rail_enabled(false),
 	qtwebengine_compat(false),
+	motion_enabled(true),
+	damage_threads(0),
+	encode_threads(0),
+	nsc_color_loss(3),
+	nsc_subsampling(true),
+	compression_level(PACKET_COMPR_TYPE_RDP61),
 	secrets_file(nullptr),
 	screenSz(800, 600),
 	displayMode(DisplayMode::AUTODETECT),
+	damageMode(DamageMode::DAMAGE_SHADOW_IMAGE),
+	compressionMode(CompressionMode::COMPRESSION_AUTO),
 	theme{Qt::white, Qt::black, QFont("time", 10)},
 	rootWindow(1)
 {
@@ -118,6 +134,35 @@ QFreeRdpPlatformConfig::QFreeRdpPlatformConfig(const QStringList &params) :
 			if(!ok || (fps <= 0) || (fps > 100)) {
 				qWarning() << "invalid fps value" << subVal;
 			}
+		} else if(param.startsWith(QLatin1String("damage-threads="))) {
+			subVal = param.mid(strlen("damage-threads="));
+			damage_threads = subVal.toInt(&ok);
+			if(!ok || (damage_threads < 0)) {
+				qWarning() << "invalid damage-threads value" << subVal;
+				damage_threads = 0;
+			}
+		} else if(param.startsWith(QLatin1String("encode-threads="))) {
+			subVal = param.mid(strlen("encode-threads="));
+			encode_threads = subVal.toInt(&ok);
+			if(!ok || (encode_threads < 0)) {
+				qWarning() << "invalid encode-threads value" << subVal;
+				encode_threads = 0;
+			}
+		} else if(param.startsWith(QLatin1String("nsc-color-loss="))) {
+			subVal = param.mid(strlen("nsc-color-loss="));
+			nsc_color_loss = subVal.toInt(&ok);
+			if(!ok || (nsc_color_loss < 1) || (nsc_color_loss > 7)) {
+				qWarning() << "invalid nsc-color-loss value" << subVal;
+				nsc_color_loss = 3;
+			}
+		} else if(param.startsWith(QLatin1String("nsc-subsampling="))) {
+			subVal = param.mid(strlen("nsc-subsampling="));
+			val = subVal.toInt(&ok);
+			if(!ok || (val < 0) || (val > 1)) {
+				qWarning() << "invalid nsc-subsampling value" << subVal;
+			} else {
+				nsc_subsampling = (val == 1);
+			}
 		} else if(param.startsWith(QLatin1String("socket="))) {
 			subVal = param.mid(strlen("socket="));
 			fixed_socket = subVal.toInt(&ok);
@@ -164,9 +209,26 @@ QFreeRdpPlatformConfig::QFreeRdpPlatformConfig(const QStringList &params) :
 		} else if(param == "noegfx") {
 			qDebug("disabling egfx");
 			egfx_enabled = false;
+		} else if(param == "progressive") {
+			egfx_progressive = true;
+		} else if(param == "avc") {
+			egfx_avc = true;
+		} else if(param == "autocodec") {
+			egfx_autocodec = true;
+		} else if(param == "norfx") {
+			qDebug("disabling RemoteFX surface bits");
+			rfx_enabled = false;
+		} else if(param == "nobitmapcache") {
+			qDebug("disabling bitmap cache orders");
+			bitmap_cache_enabled = false;
+		} else if(param == "rail") {
+			rail_enabled = true;
 		} else if(param == "noclipboard") {
 			qDebug("disabling clipboard");
 			clipboard_enabled = false;
+		} else if(param == "nomotion") {
+			qDebug("disabling scroll and move detection");
+			motion_enabled = false;
 		} else if(param.startsWith(QLatin1String("mode="))) {
 			subVal = param.mid(strlen("mode="));
 			QString mode = subVal;
@@ -180,6 +242,39 @@ QFreeRdpPlatformConfig::QFreeRdpPlatformConfig(const QStringList &params) :
 				displayMode = DisplayMode::AUTODETECT;
 				qWarning() << "invalid display mode" << mode << ", falling back to autodetect";
 			}
+		} else if(param.startsWith(QLatin1String("damage="))) {
+			subVal = param.mid(strlen("damage="));
+			if (subVal == "shadow") {
+				damageMode = DamageMode::DAMAGE_SHADOW_IMAGE;
+			} else if (subVal == "hash") {
+				damageMode = DamageMode::DAMAGE_TILE_HASH;
+			} else {
+				qWarning() << "invalid damage mode" << subVal << ", falling back to shadow";
+			}
+		} else if(param.startsWith(QLatin1String("compression="))) {
+			subVal = param.mid(strlen("compression="));
+			if (subVal == "off") {
+				compressionMode = CompressionMode::COMPRESSION_OFF;
+			} else if (subVal == "auto") {
+				compressionMode = CompressionMode::COMPRESSION_AUTO;
+			} else if (subVal == "always") {
+				compressionMode = CompressionMode::COMPRESSION_ALWAYS;
+			} else {
+				qWarning() << "invalid compression mode" << subVal << ", falling back to auto";
+			}
+		} else if(param.startsWith(QLatin1String("compression-level="))) {
+			subVal = param.mid(strlen("compression-level="));
+			if (subVal == "8k") {
+				compression_level = PACKET_COMPR_TYPE_8K;
+			} else if (subVal == "64k") {
+				compression_level = PACKET_COMPR_TYPE_64K;
+			} else if (subVal == "rdp6") {
+				compression_level = PACKET_COMPR_TYPE_RDP6;
+			} else if (subVal == "rdp61") {
+				compression_level = PACKET_COMPR_TYPE_RDP61;
+			} else {
+				qWarning() << "invalid compression level" << subVal << ", falling back to rdp61";
+			}
 		} else if(param == "qtwebengineKbdCompat") {
 			qDebug("Enabling qtWebEngine keyboard compatibility mode");
 			qtwebengine_compat = true;
@@ -215,6 +310,7 @@ QFreeRdpPlatform::QFreeRdpPlatform(const QString& system, const QStringList& par
 	//Disable desktop settings for now (or themes crash)
 	QGuiApplicationPrivate::obey_desktop_settings = false;
 	QWindowSystemInterface::handleScreenAdded(mScreen);
+	QFreeRdpEncoder::instance()->setThreadCount(mConfig->encode_threads);
 
 	WTSRegisterWtsApiFunctionTable(FreeRDP_InitWtsApi());
 }
@@ -391,9 +487,20 @@ void QFreeRdpPlatform::dropBackingStore(QFreeRdpBackingStore *back)
 		}
 }
 
-void QFreeRdpPlatform::repaint(const QRegion &region) {
+void QFreeRdpPlatform::repaint() {
+	foreach(QFreeRdpPeer *peer, mPeers) {
+		peer->repaint();
+	}
+}
+
+void QFreeRdpPlatform::notifyWindowContent(QWindow *window, const QRegion &region) {
+	QPlatformWindow *platformWindow = window->handle();
+	if (!platformWindow)
+		return;
+
 	foreach(QFreeRdpPeer *peer, mPeers) {
-		peer->repaint(region);
+		if (peer->mRail)
+			peer->mRail->addDamage(platformWindow->winId(), region);
 	}
 }
 
@@ -23,6 +23,7 @@
 #define __QFREERDP_H___
 
 #include <QList>
+#include <QRegion>
 #include <QSocketNotifier>
 #include <qpa/qplatformintegration.h>
 #include <qabstracteventdispatcher.h>
@@ -52,6 +53,19 @@ enum DisplayMode {
 	OPTIMIZE = 3
 };
 
+/** @brief how the compositor detects the effectively modified tiles */
+enum DamageMode {
+	DAMAGE_SHADOW_IMAGE = 0,
+	DAMAGE_TILE_HASH = 1
+};
+
+/** @brief which update PDUs go through the RDP bulk compressor */
+enum CompressionMode {
+	COMPRESSION_OFF = 0,
+	COMPRESSION_AUTO = 1,
+	COMPRESSION_ALWAYS = 2
+};
+
 typedef enum {
 	ICON_RESOURCE_CLOSE_BUTTON
 } IconResourceType;
@@ -84,11 +98,25 @@ struct QFreeRdpPlatformConfig {
 	int fps;
 	bool clipboard_enabled;
 	bool egfx_enabled;
+	bool egfx_progressive;
+	bool egfx_avc;
+	bool egfx_autocodec;
+	bool rfx_enabled;
+	bool bitmap_cache_enabled;
+	bool rail_enabled;
 	bool qtwebengine_compat;
+	bool motion_enabled;
+	int damage_threads;
+	int encode_threads;
+	int nsc_color_loss;
+	bool nsc_subsampling;
+	int compression_level;
 	char *secrets_file;
 
 	QSize screenSz;
 	DisplayMode displayMode;
+	DamageMode damageMode;
+	CompressionMode compressionMode;
 	WmTheme theme;
 	WId rootWindow;
 };
@@ -101,6 +129,7 @@ class QFreeRdpPlatform : public QObject, public QPlatformIntegration {
 	friend class QFreeRdpBackingStore;
 	friend class QFreeRdpWindow;
 	friend class QFreeRdpPeer;
+	friend class QFreeRdpPeerRail;
 	friend class QFreeRdpListener;
 
 	Q_OBJECT
@@ -157,10 +186,14 @@ public:
 	 */
 	void unregisterPeer(QFreeRdpPeer *peer);
 
-	/**
-	 * @param region
+	/** sends the last update of the compositor to all the peers */
+	void repaint();
+
+	/** forwards a change of the content of a window to the RemoteApp peers
+	 * @param window the window
+	 * @param region the changed area, in window coordinates
 	 */
-	void repaint(const QRegion &region);
+	void notifyWindowContent(QWindow *window, const QRegion &region);
 
 	void registerBackingStore(QWindow *w, QFreeRdpBackingStore *back);
 	void dropBackingStore(QFreeRdpBackingStore *back);
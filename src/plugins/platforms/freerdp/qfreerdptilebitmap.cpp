@@ -0,0 +1,324 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include <QtAlgorithms>
+
+#include "qfreerdptilebitmap.h"
+
+QT_BEGIN_NAMESPACE
+
+QFreeRdpTileBitmap::QFreeRdpTileBitmap()
+: mTileSize(64)
+, mTilesPerRow(0)
+, mTileRows(0)
+, mWordsPerRow(0)
+{}
+
+void QFreeRdpTileBitmap::reset(const QSize &screenSize, int tileSize) {
+	mScreenSize = screenSize;
+	mTileSize = tileSize;
+	mTilesPerRow = (screenSize.width() + tileSize - 1) / tileSize;
+	mTileRows = (screenSize.height() + tileSize - 1) / tileSize;
+	mWordsPerRow = (mTilesPerRow + 63) / 64;
+	mWords.assign(mWordsPerRow * mTileRows, 0);
+}
+
+void QFreeRdpTileBitmap::clear() {
+	std::fill(mWords.begin(), mWords.end(), 0);
+}
+
+void QFreeRdpTileBitmap::setRect(const QRect &rect) {
+	QRect r = rect.intersected(QRect(QPoint(0, 0), mScreenSize));
+	if (r.isEmpty())
+		return;
+
+	for (int ty = r.top() / mTileSize; ty <= r.bottom() / mTileSize; ty++) {
+		for (int tx = r.left() / mTileSize; tx <= r.right() / mTileSize; tx++)
+			set(tx, ty);
+	}
+}
+
+bool QFreeRdpTileBitmap::isEmpty() const {
+	for (quint64 word : mWords) {
+		if (word)
+			return false;
+	}
+	return true;
+}
+
+int QFreeRdpTileBitmap::count() const {
+	int ret = 0;
+	for (quint64 word : mWords)
+		ret += qPopulationCount(word);
+	return ret;
+}
+
+void QFreeRdpTileBitmap::spans(QVector<QRect> &out) const {
+	out.clear();
+
+	for (int ty = 0; ty < mTileRows; ty++) {
+		const quint64 *row = &mWords[ty * mWordsPerRow];
+		int top = ty * mTileSize;
+		int height = std::min(mTileSize, mScreenSize.height() - top);
+
+		auto emitSpan = [&](int first, int end) {
+			int left = first * mTileSize;
+			int right = std::min(end * mTileSize, mScreenSize.width());
+			out.append(QRect(left, top, right - left, height));
+		};
+
+		// a run of set bits may continue on the next word
+		int runStart = -1;
+		for (int w = 0; w < mWordsPerRow; w++) {
+			quint64 bits = row[w];
+			int base = w * 64;
+			int pos = 0;
+
+			while (pos < 64) {
+				if (runStart < 0) {
+					quint64 rest = bits >> pos;
+					if (!rest)
+						break;
+					pos += qCountTrailingZeroBits(rest);
+					runStart = base + pos;
+				} else {
+					quint64 rest = ~bits >> pos;
+					if (!rest)
+						break;
+					pos += qCountTrailingZeroBits(rest);
+					emitSpan(runStart, base + pos);
+					runStart = -1;
+				}
+			}
+		}
+
+		if (runStart >= 0)
+			emitSpan(runStart, mTilesPerRow);
+	}
+}
+
+void QFreeRdpTileBitmap::rects(QVector<QRect> &out) const {
+	QVector<QRect> rowSpans;
+	spans(rowSpans);
+
+	out.clear();
+
+	// indexes in out of the rectangles ending on the previous row of tiles
+	QVector<int> open, nextOpen;
+	int currentTop = -1;
+	int openPos = 0;
+	for (const QRect &span : rowSpans) {
+		if (span.top() != currentTop) {
+			open.swap(nextOpen);
+			nextOpen.clear();
+			currentTop = span.top();
+			openPos = 0;
+		}
+
+		// both lists are sorted by x
+		while (openPos < open.size() && out[open[openPos]].left() < span.left())
+			openPos++;
+
+		if (openPos < open.size()) {
+			QRect &candidate = out[open[openPos]];
+			if (candidate.left() == span.left() && candidate.width() == span.width() &&
+					candidate.bottom() + 1 == span.top()) {
+				candidate.setBottom(span.bottom());
+				nextOpen.append(open[openPos]);
+				continue;
+			}
+		}
+
+		nextOpen.append(out.size());
+		out.append(span);
+	}
+}
+
+QRegion QFreeRdpTileBitmap::toRegion() const {
+	QVector<QRect> rowSpans;
+	spans(rowSpans);
+
+	// spans are already Y-X banded, no need to pay for unions. setRects()
+	// takes them as they are, so a row with the same spans as the band above
+	// is merged into it to keep the region canonical.
+	QVector<QRect> bands;
+	int bandStart = 0;
+	for (int row = 0; row < rowSpans.size(); ) {
+		int rowEnd = row;
+		while (rowEnd < rowSpans.size() && rowSpans[rowEnd].top() == rowSpans[row].top())
+			rowEnd++;
+
+		int count = rowEnd - row;
+		bool merge = (bands.size() - bandStart == count) && (bands[bandStart].bottom() + 1 == rowSpans[row].top());
+		for (int i = 0; merge && i < count; i++) {
+			merge = (bands[bandStart + i].left() == rowSpans[row + i].left()) &&
+					(bands[bandStart + i].right() == rowSpans[row + i].right());
+		}
+
+		if (merge) {
+			for (int i = 0; i < count; i++)
+				bands[bandStart + i].setBottom(rowSpans[row + i].bottom());
+		} else {
+			bandStart = bands.size();
+			for (int i = row; i < rowEnd; i++)
+				bands.append(rowSpans[i]);
+		}
+		row = rowEnd;
+	}
+
+	QRegion ret;
+	ret.setRects(bands.constData(), bands.size());
+	return ret;
+}
+
+
+#ifdef BUILD_TESTS
+#include "tests/qfreerdptestharness.h"
+
+#include <QTest>
+
+void QFreeRdpTest::tileBitmapTestConversions() {
+	QFreeRdpTileBitmap bitmap;
+	bitmap.reset(QSize(200, 100), 64);
+
+	QCOMPARE(bitmap.tilesPerRow(), 4);
+	QCOMPARE(bitmap.tileRows(), 2);
+	QVERIFY(bitmap.isEmpty());
+
+	bitmap.set(1, 0);
+	bitmap.set(2, 0);
+	bitmap.set(1, 1);
+	bitmap.set(2, 1);
+	bitmap.set(3, 1);
+	QCOMPARE(bitmap.count(), 5);
+
+	QVector<QRect> out;
+	bitmap.spans(out);
+	QCOMPARE(out, QVector<QRect>({ QRect(64, 0, 128, 64), QRect(64, 64, 136, 36) }));
+
+	bitmap.rects(out);
+	QCOMPARE(out, QVector<QRect>({ QRect(64, 0, 128, 64), QRect(64, 64, 136, 36) }));
+
+	QCOMPARE(bitmap.toRegion(), QRegion(64, 0, 128, 64) + QRegion(64, 64, 136, 36));
+
+	// identical spans are merged vertically
+	bitmap.clear();
+	bitmap.setRect(QRect(70, 10, 60, 60));
+	bitmap.rects(out);
+	QCOMPARE(out, QVector<QRect>({ QRect(64, 0, 128, 100) }));
+
+	// runs crossing a word boundary
+	QFreeRdpTileBitmap wide;
+	wide.reset(QSize(64 * 130, 64), 64);
+	for (int tx = 60; tx < 70; tx++)
+		wide.set(tx, 0);
+	wide.set(127, 0);
+	wide.set(128, 0);
+	wide.set(129, 0);
+	wide.spans(out);
+	QCOMPARE(out, QVector<QRect>({ QRect(60 * 64, 0, 10 * 64, 64), QRect(127 * 64, 0, 3 * 64, 64) }));
+}
+
+void QFreeRdpTest::tileBitmapTestRegion() {
+	QFreeRdpTileBitmap bitmap;
+	bitmap.reset(QSize(300, 200), 64);
+
+	// the full screen is a single rect, as QRegion builds it
+	bitmap.setRect(QRect(0, 0, 300, 200));
+	QRegion fullScreen(0, 0, 300, 200);
+	QCOMPARE(bitmap.toRegion().rectCount(), 1);
+	QCOMPARE(bitmap.toRegion(), fullScreen);
+
+	// stacked identical rows of two spans make a single band
+	bitmap.clear();
+	for (int ty = 0; ty < 3; ty++) {
+		bitmap.set(0, ty);
+		bitmap.set(2, ty);
+		bitmap.set(3, ty);
+	}
+	QRegion columns = QRegion(0, 0, 64, 192) + QRegion(128, 0, 128, 192);
+	QCOMPARE(bitmap.toRegion().rectCount(), 2);
+	QCOMPARE(bitmap.toRegion(), columns);
+
+	// a different row starts a new band, identical rows below it merge again
+	bitmap.set(1, 1);
+	QRegion expected = columns + QRegion(64, 64, 64, 64);
+	QCOMPARE(bitmap.toRegion().rectCount(), expected.rectCount());
+	QCOMPARE(bitmap.toRegion(), expected);
+
+	bitmap.clear();
+	QVERIFY(bitmap.toRegion().isEmpty());
+}
+
+void QFreeRdpTest::tileBitmapBenchmark_data() {
+	QTest::addColumn<bool>("useBitmap");
+	QTest::addColumn<int>("tiles");
+
+	// a 4K screen has 60x34 tiles
+	for (int tiles : { 32, 256, 1024, 2040 }) {
+		QTest::newRow(qPrintable(QString("qregion %1 tiles").arg(tiles))) << false << tiles;
+		QTest::newRow(qPrintable(QString("bitmap %1 tiles").arg(tiles))) << true << tiles;
+	}
+}
+
+void QFreeRdpTest::tileBitmapBenchmark() {
+	QFETCH(bool, useBitmap);
+	QFETCH(int, tiles);
+
+	const QSize screen(3840, 2160);
+	const int tilesPerRow = 60;
+
+	// dirty tiles spread like text being typed: one every other tile
+	QVector<QPoint> dirtyTiles;
+	for (int i = 0; dirtyTiles.size() < tiles; i++) {
+		int index = (i * 2) % (tilesPerRow * 34) + ((i * 2) / (tilesPerRow * 34));
+		dirtyTiles.append(QPoint(index % tilesPerRow, index / tilesPerRow));
+	}
+
+	QFreeRdpTileBitmap bitmap;
+	bitmap.reset(screen, 64);
+
+	QRegion result;
+	if (useBitmap) {
+		QBENCHMARK {
+			bitmap.clear();
+			for (const QPoint &tile : dirtyTiles)
+				bitmap.set(tile.x(), tile.y());
+			result = bitmap.toRegion();
+		}
+	} else {
+		QBENCHMARK {
+			QRegion dirty;
+			for (const QPoint &tile : dirtyTiles)
+				dirty += QRect(tile.x() * 64, tile.y() * 64, 64, 64).intersected(QRect(QPoint(0, 0), screen));
+			result = dirty;
+		}
+	}
+
+	QVERIFY(!result.isEmpty());
+}
+
+#endif // BUILD_TESTS
+
+QT_END_NAMESPACE
@@ -0,0 +1,97 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __QFREERDPTILEBITMAP_H__
+#define __QFREERDPTILEBITMAP_H__
+
+#include <vector>
+
+#include <QRect>
+#include <QRegion>
+#include <QVector>
+
+QT_BEGIN_NAMESPACE
+
+/**
+ * @brief a set of tiles of the screen grid, one bit per tile
+ *
+ * Each row of tiles starts on a new 64 bits word, so that runs of set tiles
+ * are extracted a word at a time. Conversions produce rectangles in screen
+ * coordinates, clipped to the screen, in the Y-X banded order used by QRegion,
+ * so that building a region costs the number of rectangles and not more.
+ */
+class QFreeRdpTileBitmap {
+public:
+	QFreeRdpTileBitmap();
+
+	/** Resizes the bitmap for a screen of the given size, all tiles are cleared */
+	void reset(const QSize &screenSize, int tileSize);
+
+	/** Clears all the tiles */
+	void clear();
+
+	void set(int tx, int ty) {
+		mWords[ty * mWordsPerRow + (tx >> 6)] |= (quint64(1) << (tx & 63));
+	}
+
+	bool test(int tx, int ty) const {
+		return mWords[ty * mWordsPerRow + (tx >> 6)] & (quint64(1) << (tx & 63));
+	}
+
+	/** Sets all the tiles touched by rect */
+	void setRect(const QRect &rect);
+
+	/** @return if no tile is set */
+	bool isEmpty() const;
+
+	/** @return the number of tiles that are set */
+	int count() const;
+
+	int tilesPerRow() const { return mTilesPerRow; }
+	int tileRows() const { return mTileRows; }
+
+	/**
+	 * Runs of consecutive tiles of each row of tiles, the height of the
+	 * rectangles is at most the tile size.
+	 */
+	void spans(QVector<QRect> &out) const;
+
+	/**
+	 * Spans merged with the identical spans of the next rows, fewer and
+	 * bigger rectangles for the encoders that take any size.
+	 */
+	void rects(QVector<QRect> &out) const;
+
+	/** @return the set tiles as a region */
+	QRegion toRegion() const;
+
+protected:
+	QSize mScreenSize;
+	int mTileSize;
+	int mTilesPerRow;
+	int mTileRows;
+	int mWordsPerRow;
+	std::vector<quint64> mWords;
+};
+
+QT_END_NAMESPACE
+
+#endif // __QFREERDPTILEBITMAP_H__
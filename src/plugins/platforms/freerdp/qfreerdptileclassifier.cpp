@@ -0,0 +1,191 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "qfreerdptileclassifier.h"
+#include "qfreerdptilecompare.h"
+
+QT_BEGIN_NAMESPACE
+
+/** tiles with at most this number of colors are text or UI */
+#define TEXT_MAX_COLORS 64
+
+/** tiles with more colors are still text if this percentage of pixels are sharp edges */
+#define TEXT_MIN_EDGES 20
+
+/** difference on a channel between two neighbour pixels that makes a sharp edge */
+#define EDGE_THRESHOLD 64
+
+/** size of the table counting colors, a power of 2 bigger than TEXT_MAX_COLORS */
+#define COLOR_TABLE_SIZE 256
+
+QFreeRdpTileClassifier::QFreeRdpTileClassifier() {
+	memset(mTiles, 0, sizeof(mTiles));
+	memset(mPixels, 0, sizeof(mPixels));
+}
+
+static bool isEdge(quint32 a, quint32 b) {
+	for (int shift = 0; shift < 24; shift += 8) {
+		int diff = int((a >> shift) & 0xff) - int((b >> shift) & 0xff);
+		if (diff > EDGE_THRESHOLD || diff < -EDGE_THRESHOLD)
+			return true;
+	}
+	return false;
+}
+
+/** @return the number of colors of the tile, or TEXT_MAX_COLORS + 1 if there are more */
+static int countColors(const uchar *src, int stride, int width, int height) {
+	// open addressing, 0 marks a free entry so colors are stored with the alpha set
+	quint32 table[COLOR_TABLE_SIZE];
+	memset(table, 0, sizeof(table));
+	int colors = 0;
+
+	for (int y = 0; y < height; y++) {
+		const quint32 *row = (const quint32 *)(src + y * stride);
+		quint32 last = 0;
+		for (int x = 0; x < width; x++) {
+			quint32 color = row[x] | 0xff000000;
+			if (color == last)
+				continue;
+			last = color;
+
+			quint32 slot = ((color * 2654435761u) >> 24) & (COLOR_TABLE_SIZE - 1);
+			while (table[slot] && table[slot] != color)
+				slot = (slot + 1) & (COLOR_TABLE_SIZE - 1);
+
+			if (!table[slot]) {
+				if (++colors > TEXT_MAX_COLORS)
+					return colors;
+				table[slot] = color;
+			}
+		}
+	}
+	return colors;
+}
+
+QFreeRdpTileClassifier::TileClass QFreeRdpTileClassifier::classify(const uchar *src, int stride,
+		int width, int height, bool changing, quint32 &color)
+{
+	if (QFreeRdpTileComparator::isSolid(src, stride, width, height, color))
+		return TILE_SOLID;
+
+	if (changing)
+		return TILE_CHANGING;
+
+	if (countColors(src, stride, width, height) <= TEXT_MAX_COLORS)
+		return TILE_TEXT;
+
+	// many colors: antialiased text on a colored background still has sharp
+	// edges, gradients and photos mostly have smooth transitions
+	int edges = 0;
+	for (int y = 0; y < height; y++) {
+		const quint32 *row = (const quint32 *)(src + y * stride);
+		for (int x = 1; x < width; x++) {
+			if (isEdge(row[x - 1], row[x]))
+				edges++;
+		}
+	}
+
+	if (edges * 100 >= width * height * TEXT_MIN_EDGES)
+		return TILE_TEXT;
+	return TILE_IMAGE;
+}
+
+const char *QFreeRdpTileClassifier::className(TileClass tileClass) {
+	switch (tileClass) {
+	case TILE_SOLID:
+		return "solid";
+	case TILE_TEXT:
+		return "text";
+	case TILE_IMAGE:
+		return "image";
+	case TILE_CHANGING:
+		return "changing";
+	default:
+		return "unknown";
+	}
+}
+
+void QFreeRdpTileClassifier::record(TileClass tileClass, int pixels) {
+	mTiles[tileClass]++;
+	mPixels[tileClass] += pixels;
+}
+
+
+#ifdef BUILD_TESTS
+#include "tests/qfreerdptestharness.h"
+
+#include <QImage>
+#include <QPainter>
+#include <QTest>
+
+void QFreeRdpTest::tileClassifierTestClassify() {
+	QImage tile(64, 64, QImage::Format_RGB32);
+	quint32 color = 0;
+
+	tile.fill(Qt::blue);
+	QCOMPARE(QFreeRdpTileClassifier::classify(tile.constBits(), tile.bytesPerLine(), 64, 64, true, color),
+			QFreeRdpTileClassifier::TILE_SOLID);
+	QCOMPARE(color, quint32(qRgb(0, 0, 255)));
+
+	// a button: frame and label strokes on a flat background
+	tile.fill(Qt::white);
+	QPainter painter(&tile);
+	painter.setPen(Qt::black);
+	painter.drawRect(2, 2, 59, 30);
+	for (int x = 10; x < 50; x += 6)
+		painter.drawLine(x, 10, x + 3, 24);
+	painter.fillRect(5, 40, 20, 10, Qt::gray);
+	painter.end();
+	QCOMPARE(QFreeRdpTileClassifier::classify(tile.constBits(), tile.bytesPerLine(), 64, 64, false, color),
+			QFreeRdpTileClassifier::TILE_TEXT);
+	QCOMPARE(QFreeRdpTileClassifier::classify(tile.constBits(), tile.bytesPerLine(), 64, 64, true, color),
+			QFreeRdpTileClassifier::TILE_CHANGING);
+
+	// a smooth gradient
+	for (int y = 0; y < 64; y++) {
+		for (int x = 0; x < 64; x++)
+			tile.setPixel(x, y, qRgb(x * 4, y * 4, 128));
+	}
+	QCOMPARE(QFreeRdpTileClassifier::classify(tile.constBits(), tile.bytesPerLine(), 64, 64, false, color),
+			QFreeRdpTileClassifier::TILE_IMAGE);
+
+	// many colors with sharp edges
+	for (int y = 0; y < 64; y++) {
+		for (int x = 0; x < 64; x++)
+			tile.setPixel(x, y, (x & 1) ? qRgb(255, 255, 255) : qRgb(x * 4, y * 4, 0));
+	}
+	QCOMPARE(QFreeRdpTileClassifier::classify(tile.constBits(), tile.bytesPerLine(), 64, 64, false, color),
+			QFreeRdpTileClassifier::TILE_TEXT);
+
+	QFreeRdpTileClassifier stats;
+	stats.record(QFreeRdpTileClassifier::TILE_TEXT, 4096);
+	stats.record(QFreeRdpTileClassifier::TILE_TEXT, 100);
+	QCOMPARE(stats.tiles(QFreeRdpTileClassifier::TILE_TEXT), quint64(2));
+	QCOMPARE(stats.pixels(QFreeRdpTileClassifier::TILE_TEXT), quint64(4196));
+	QCOMPARE(stats.tiles(QFreeRdpTileClassifier::TILE_IMAGE), quint64(0));
+}
+
+#endif // BUILD_TESTS
+
+QT_END_NAMESPACE
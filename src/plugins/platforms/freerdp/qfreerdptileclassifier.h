@@ -0,0 +1,79 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __QFREERDPTILECLASSIFIER_H__
+#define __QFREERDPTILECLASSIFIER_H__
+
+#include <QtGlobal>
+
+QT_BEGIN_NAMESPACE
+
+/**
+ * @brief sorts screen tiles by the kind of content they hold, to pick a codec
+ *
+ * The decision uses cheap signals computed in one pass over the pixels: the
+ * number of distinct colors, the density of sharp edges and whether the tile
+ * keeps changing. Text and UI elements have few colors or many sharp edges and
+ * need a lossless codec, photos and gradients have many colors with smooth
+ * transitions and can go to a lossy one.
+ */
+class QFreeRdpTileClassifier {
+public:
+	/** @brief kinds of tile content */
+	enum TileClass {
+		TILE_SOLID,		/**< a single color, sent as a fill */
+		TILE_TEXT,		/**< text and UI, lossless */
+		TILE_IMAGE,		/**< photos and gradients, lossy */
+		TILE_CHANGING,	/**< modified by every update, lossy */
+		TILE_CLASS_COUNT
+	};
+
+	QFreeRdpTileClassifier();
+
+	/**
+	 * Classifies a tile of a 32 bits image
+	 *
+	 * @param changing if the tile keeps changing
+	 * @param color receives the color of solid tiles
+	 */
+	static TileClass classify(const uchar *src, int stride, int width, int height, bool changing,
+			quint32 &color);
+
+	/** @return a printable name for a class */
+	static const char *className(TileClass tileClass);
+
+	/** Counts a decision in the statistics */
+	void record(TileClass tileClass, int pixels);
+
+	/** Statistics of the decisions since the creation of the session
+	 * @{ */
+	quint64 tiles(TileClass tileClass) const { return mTiles[tileClass]; }
+	quint64 pixels(TileClass tileClass) const { return mPixels[tileClass]; }
+	/** @} */
+
+protected:
+	quint64 mTiles[TILE_CLASS_COUNT];
+	quint64 mPixels[TILE_CLASS_COUNT];
+};
+
+QT_END_NAMESPACE
+
+#endif // __QFREERDPTILECLASSIFIER_H__
@@ -0,0 +1,552 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "qfreerdptilecompare.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define QFREERDP_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+QT_BEGIN_NAMESPACE
+
+static const int BYTES_PER_PIXEL = 4;
+
+/* The SIMD kernels scan a row until the first difference, if there's none the
+ * row is left untouched. Otherwise the remaining part of the row is copied in the
+ * shadow, the beginning being already equal.
+ */
+
+/* Widens the modified columns with a row that differs at or after the byte
+ * offset from, before it is copied. Only the pixels outside the current bounds
+ * are looked at, so a tile costs at most one extra pass.
+ */
+static inline void updateColumns(const uchar *src, const uchar *shadow, size_t from, int width,
+		int &left, int &right)
+{
+	const quint32 *s = (const quint32 *)src;
+	const quint32 *d = (const quint32 *)shadow;
+
+	int x = int(from / BYTES_PER_PIXEL);
+	while (x < left && s[x] == d[x])
+		x++;
+	left = std::min(left, x);
+
+	int last = width - 1;
+	while (last > right && s[last] == d[last])
+		last--;
+	right = std::max(right, last);
+}
+
+static quint64 compareScalar(const uchar *src, int srcStride, uchar *shadow, int shadowStride,
+		int width, int height, int &left, int &right)
+{
+	// libc's memcmp is already well optimized, we just avoid the copy of unmodified rows
+	const size_t rowBytes = size_t(width) * BYTES_PER_PIXEL;
+	quint64 ret = 0;
+	left = width;
+	right = -1;
+
+	for (int y = 0; y < height; y++, src += srcStride, shadow += shadowStride) {
+		if (!memcmp(src, shadow, rowBytes))
+			continue;
+
+		updateColumns(src, shadow, 0, width, left, right);
+		memcpy(shadow, src, rowBytes);
+		ret |= (quint64(1) << y);
+	}
+
+	return ret;
+}
+
+#ifdef QFREERDP_X86_KERNELS
+
+__attribute__((target("sse2")))
+static quint64 compareSse2(const uchar *src, int srcStride, uchar *shadow, int shadowStride,
+		int width, int height, int &left, int &right)
+{
+	const size_t rowBytes = size_t(width) * BYTES_PER_PIXEL;
+	quint64 ret = 0;
+	left = width;
+	right = -1;
+
+	for (int y = 0; y < height; y++, src += srcStride, shadow += shadowStride) {
+		bool modified = false;
+		size_t i = 0;
+
+		for (; i + 64 <= rowBytes; i += 64) {
+			const __m128i *s = (const __m128i *)(src + i);
+			const __m128i *d = (const __m128i *)(shadow + i);
+
+			__m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128(s), _mm_loadu_si128(d));
+			__m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128(s + 1), _mm_loadu_si128(d + 1));
+			__m128i eq2 = _mm_cmpeq_epi8(_mm_loadu_si128(s + 2), _mm_loadu_si128(d + 2));
+			__m128i eq3 = _mm_cmpeq_epi8(_mm_loadu_si128(s + 3), _mm_loadu_si128(d + 3));
+			__m128i eq = _mm_and_si128(_mm_and_si128(eq0, eq1), _mm_and_si128(eq2, eq3));
+			if (_mm_movemask_epi8(eq) != 0xffff) {
+				modified = true;
+				break;
+			}
+		}
+
+		if (!modified) {
+			for (; i + 16 <= rowBytes; i += 16) {
+				__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(src + i)),
+						_mm_loadu_si128((const __m128i *)(shadow + i)));
+				if (_mm_movemask_epi8(eq) != 0xffff) {
+					modified = true;
+					break;
+				}
+			}
+		}
+
+		if (!modified && (i < rowBytes))
+			modified = (memcmp(src + i, shadow + i, rowBytes - i) != 0);
+
+		if (!modified)
+			continue;
+
+		updateColumns(src, shadow, i, width, left, right);
+
+		for (; i + 16 <= rowBytes; i += 16)
+			_mm_storeu_si128((__m128i *)(shadow + i), _mm_loadu_si128((const __m128i *)(src + i)));
+		if (i < rowBytes)
+			memcpy(shadow + i, src + i, rowBytes - i);
+
+		ret |= (quint64(1) << y);
+	}
+
+	return ret;
+}
+
+__attribute__((target("avx2")))
+static quint64 compareAvx2(const uchar *src, int srcStride, uchar *shadow, int shadowStride,
+		int width, int height, int &left, int &right)
+{
+	const size_t rowBytes = size_t(width) * BYTES_PER_PIXEL;
+	quint64 ret = 0;
+	left = width;
+	right = -1;
+
+	for (int y = 0; y < height; y++, src += srcStride, shadow += shadowStride) {
+		bool modified = false;
+		size_t i = 0;
+
+		for (; i + 128 <= rowBytes; i += 128) {
+			const __m256i *s = (const __m256i *)(src + i);
+			const __m256i *d = (const __m256i *)(shadow + i);
+
+			__m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256(s), _mm256_loadu_si256(d));
+			__m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256(s + 1), _mm256_loadu_si256(d + 1));
+			__m256i eq2 = _mm256_cmpeq_epi8(_mm256_loadu_si256(s + 2), _mm256_loadu_si256(d + 2));
+			__m256i eq3 = _mm256_cmpeq_epi8(_mm256_loadu_si256(s + 3), _mm256_loadu_si256(d + 3));
+			__m256i eq = _mm256_and_si256(_mm256_and_si256(eq0, eq1), _mm256_and_si256(eq2, eq3));
+			if (_mm256_movemask_epi8(eq) != -1) {
+				modified = true;
+				break;
+			}
+		}
+
+		if (!modified) {
+			for (; i + 32 <= rowBytes; i += 32) {
+				__m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(src + i)),
+						_mm256_loadu_si256((const __m256i *)(shadow + i)));
+				if (_mm256_movemask_epi8(eq) != -1) {
+					modified = true;
+					break;
+				}
+			}
+		}
+
+		if (!modified && (i < rowBytes))
+			modified = (memcmp(src + i, shadow + i, rowBytes - i) != 0);
+
+		if (!modified)
+			continue;
+
+		updateColumns(src, shadow, i, width, left, right);
+
+		for (; i + 32 <= rowBytes; i += 32)
+			_mm256_storeu_si256((__m256i *)(shadow + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+		if (i < rowBytes)
+			memcpy(shadow + i, src + i, rowBytes - i);
+
+		ret |= (quint64(1) << y);
+	}
+
+	return ret;
+}
+
+#endif // QFREERDP_X86_KERNELS
+
+bool QFreeRdpTileComparator::isSupported(Implementation impl) {
+	switch (impl) {
+	case IMPL_SCALAR:
+		return true;
+#ifdef QFREERDP_X86_KERNELS
+	case IMPL_SSE2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2");
+	case IMPL_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return false;
+	}
+}
+
+QFreeRdpTileComparator::Implementation QFreeRdpTileComparator::best() {
+	static const Implementation ret = isSupported(IMPL_AVX2) ? IMPL_AVX2 :
+			isSupported(IMPL_SSE2) ? IMPL_SSE2 : IMPL_SCALAR;
+	return ret;
+}
+
+QFreeRdpTileComparator::CompareFn QFreeRdpTileComparator::kernel(Implementation impl) {
+	if (!isSupported(impl))
+		return compareScalar;
+
+	switch (impl) {
+#ifdef QFREERDP_X86_KERNELS
+	case IMPL_SSE2:
+		return compareSse2;
+	case IMPL_AVX2:
+		return compareAvx2;
+#endif
+	case IMPL_SCALAR:
+	default:
+		return compareScalar;
+	}
+}
+
+const char *QFreeRdpTileComparator::name(Implementation impl) {
+	switch (impl) {
+	case IMPL_SSE2:
+		return "sse2";
+	case IMPL_AVX2:
+		return "avx2";
+	case IMPL_SCALAR:
+	default:
+		return "scalar";
+	}
+}
+
+static const quint64 PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const quint64 PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const quint64 PRIME64_3 = 0x165667B19E3779F9ULL;
+static const quint64 PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const quint64 PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline quint64 rotl64(quint64 v, int r) {
+	return (v << r) | (v >> (64 - r));
+}
+
+static inline quint64 hashRound(quint64 acc, quint64 input) {
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline quint64 hashMergeRound(quint64 acc, quint64 val) {
+	acc ^= hashRound(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+static inline quint64 read64(const uchar *p) {
+	quint64 ret;
+	memcpy(&ret, p, sizeof(ret));
+	return ret;
+}
+
+quint64 QFreeRdpTileComparator::hash(const uchar *src, int stride, int width, int height) {
+	const size_t rowBytes = size_t(width) * BYTES_PER_PIXEL;
+	quint64 v[4] = { PRIME64_1 + PRIME64_2, PRIME64_2, 0, 0 - PRIME64_1 };
+
+	// each row is treated like a XXH64 stream of 32 bytes stripes, the
+	// remaining 8 and 4 bytes lanes are spread on the accumulators
+	for (int y = 0; y < height; y++, src += stride) {
+		size_t i = 0;
+		for (; i + 32 <= rowBytes; i += 32) {
+			v[0] = hashRound(v[0], read64(src + i));
+			v[1] = hashRound(v[1], read64(src + i + 8));
+			v[2] = hashRound(v[2], read64(src + i + 16));
+			v[3] = hashRound(v[3], read64(src + i + 24));
+		}
+
+		for (int lane = 0; i + 8 <= rowBytes; i += 8, lane++)
+			v[lane] = hashRound(v[lane], read64(src + i));
+
+		if (i < rowBytes) {
+			quint32 last;
+			memcpy(&last, src + i, sizeof(last));
+			v[3] = hashRound(v[3], quint64(last) * PRIME64_1);
+		}
+	}
+
+	quint64 h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+	for (int i = 0; i < 4; i++)
+		h = hashMergeRound(h, v[i]);
+	h += rowBytes * height;
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+bool QFreeRdpTileComparator::isSolid(const uchar *src, int stride, int width, int height, quint32 &color) {
+	const quint32 first = *(const quint32 *)src;
+	const quint64 pattern = (quint64(first) << 32) | first;
+
+	for (int y = 0; y < height; y++, src += stride) {
+		const quint32 *row = (const quint32 *)src;
+		int x = 0;
+		for (; x + 2 <= width; x += 2) {
+			if (read64((const uchar *)(row + x)) != pattern)
+				return false;
+		}
+		if (x < width && row[x] != first)
+			return false;
+	}
+
+	color = first;
+	return true;
+}
+
+#ifdef BUILD_TESTS
+#include "tests/qfreerdptestharness.h"
+
+#include <QTest>
+#include <QVector>
+
+// the comparison as it was done before the SIMD kernels, kept as reference
+static quint64 compareLegacy(const uchar *src, int srcStride, uchar *shadow, int shadowStride,
+		int width, int height, int &left, int &right)
+{
+	quint64 ret = 0;
+	int tileWidth = width * BYTES_PER_PIXEL;
+	for (int y = 0; y < height; y++, src += srcStride, shadow += shadowStride) {
+		if (memcmp(src, shadow, tileWidth) != 0) {
+			ret |= (quint64(1) << y);
+			memcpy(shadow, src, tileWidth);
+		}
+	}
+
+	// the whole tile was sent
+	left = ret ? 0 : width;
+	right = ret ? width - 1 : -1;
+	return ret;
+}
+
+static void fillPseudoRandom(QVector<uchar> &buffer, quint32 seed) {
+	for (uchar &c : buffer) {
+		seed = seed * 1664525 + 1013904223;
+		c = uchar(seed >> 24);
+	}
+}
+
+void QFreeRdpTest::tileCompareTestKernels_data() {
+	QTest::addColumn<int>("impl");
+	QTest::addColumn<int>("width");
+	QTest::addColumn<int>("height");
+	QTest::addColumn<quint64>("modifiedRows");
+
+	const int impls[] = { QFreeRdpTileComparator::IMPL_SCALAR, QFreeRdpTileComparator::IMPL_SSE2,
+			QFreeRdpTileComparator::IMPL_AVX2 };
+
+	for (int impl : impls) {
+		const char *name = QFreeRdpTileComparator::name(QFreeRdpTileComparator::Implementation(impl));
+
+		QTest::addRow("%s: full tile unmodified", name) << impl << 64 << 64 << quint64(0);
+		QTest::addRow("%s: full tile all modified", name) << impl << 64 << 64 << ~quint64(0);
+		QTest::addRow("%s: full tile first and last rows", name) << impl << 64 << 64
+				<< (quint64(1) | (quint64(1) << 63));
+		QTest::addRow("%s: 1px wide", name) << impl << 1 << 10 << quint64(0x155);
+		QTest::addRow("%s: 3px wide", name) << impl << 3 << 7 << quint64(0x42);
+		QTest::addRow("%s: 17px wide", name) << impl << 17 << 64 << quint64(0xf0f0f0f00f0f0f0f);
+		QTest::addRow("%s: 63px wide", name) << impl << 63 << 33 << quint64(0x1aaaaaaaa);
+	}
+}
+
+void QFreeRdpTest::tileCompareTestKernels() {
+	QFETCH(int, impl);
+	QFETCH(int, width);
+	QFETCH(int, height);
+	QFETCH(quint64, modifiedRows);
+
+	auto implementation = QFreeRdpTileComparator::Implementation(impl);
+	if (!QFreeRdpTileComparator::isSupported(implementation))
+		QSKIP("implementation not supported on this CPU");
+
+	// some padding at the end of rows to check we don't write past the tile
+	const int stride = width * BYTES_PER_PIXEL + 32;
+	QVector<uchar> src(stride * height);
+	fillPseudoRandom(src, 42);
+	QVector<uchar> shadow = src;
+
+	int expectedLeft = width;
+	int expectedRight = -1;
+	for (int y = 0; y < height; y++) {
+		if (modifiedRows & (quint64(1) << y)) {
+			// change a single byte at a different place on each row
+			int x = (y * 7) % (width * BYTES_PER_PIXEL);
+			src[y * stride + x] ^= 0x5a;
+			expectedLeft = qMin(expectedLeft, x / BYTES_PER_PIXEL);
+			expectedRight = qMax(expectedRight, x / BYTES_PER_PIXEL);
+		}
+		// make sure that padding differs
+		src[y * stride + width * BYTES_PER_PIXEL] ^= 0xff;
+	}
+
+	auto kernel = QFreeRdpTileComparator::kernel(implementation);
+	int left, right;
+	QCOMPARE(kernel(src.constData(), stride, shadow.data(), stride, width, height, left, right), modifiedRows);
+	QCOMPARE(left, expectedLeft);
+	QCOMPARE(right, expectedRight);
+
+	for (int y = 0; y < height; y++) {
+		const uchar *srcRow = src.constData() + y * stride;
+		const uchar *shadowRow = shadow.constData() + y * stride;
+		QVERIFY(!memcmp(srcRow, shadowRow, width * BYTES_PER_PIXEL));
+		QVERIFY(srcRow[width * BYTES_PER_PIXEL] != shadowRow[width * BYTES_PER_PIXEL]);
+	}
+
+	// a second pass sees no modification
+	QCOMPARE(kernel(src.constData(), stride, shadow.data(), stride, width, height, left, right), quint64(0));
+	QCOMPARE(left, width);
+	QCOMPARE(right, -1);
+}
+
+void QFreeRdpTest::tileCompareBenchmark_data() {
+	QTest::addColumn<int>("impl");
+	QTest::addColumn<int>("modifiedPerTile");
+
+	const int impls[] = { -1, QFreeRdpTileComparator::IMPL_SCALAR, QFreeRdpTileComparator::IMPL_SSE2,
+			QFreeRdpTileComparator::IMPL_AVX2 };
+
+	for (int impl : impls) {
+		const char *name = (impl < 0) ? "memcmp+memcpy" :
+				QFreeRdpTileComparator::name(QFreeRdpTileComparator::Implementation(impl));
+
+		QTest::addRow("%s: unchanged", name) << impl << 0;
+		QTest::addRow("%s: one pixel per tile", name) << impl << 1;
+		QTest::addRow("%s: fully changed", name) << impl << 64;
+	}
+}
+
+void QFreeRdpTest::tileCompareBenchmark() {
+	QFETCH(int, impl);
+	QFETCH(int, modifiedPerTile);
+
+	QFreeRdpTileComparator::CompareFn kernel = compareLegacy;
+	if (impl >= 0) {
+		auto implementation = QFreeRdpTileComparator::Implementation(impl);
+		if (!QFreeRdpTileComparator::isSupported(implementation))
+			QSKIP("implementation not supported on this CPU");
+		kernel = QFreeRdpTileComparator::kernel(implementation);
+	}
+
+	// a 1080p screen, with two frames that we alternatively compare against the shadow
+	const int width = 1920;
+	const int height = 1080;
+	const int stride = width * BYTES_PER_PIXEL;
+	QVector<uchar> frames[2] = { QVector<uchar>(stride * height), QVector<uchar>() };
+	fillPseudoRandom(frames[0], 1);
+	frames[1] = frames[0];
+
+	for (int y = 0; y < height; y++) {
+		if ((y % 64) >= modifiedPerTile)
+			continue;
+
+		uchar *row = frames[1].data() + y * stride;
+		if (modifiedPerTile == 1) {
+			for (int x = 63; x < width; x += 64)
+				row[x * BYTES_PER_PIXEL] ^= 0xff;
+		} else {
+			for (int x = 0; x < stride; x++)
+				row[x] ^= 0xff;
+		}
+	}
+
+	QVector<uchar> shadow = frames[0];
+	int frame = 0;
+	int left, right;
+	QBENCHMARK {
+		frame = (frame + 1) % 2;
+		const uchar *src = frames[frame].constData();
+
+		for (int y = 0; y < height; y += 64) {
+			int tileHeight = qMin(64, height - y);
+			for (int x = 0; x < width; x += 64) {
+				int offset = y * stride + x * BYTES_PER_PIXEL;
+				kernel(src + offset, stride, shadow.data() + offset, stride, qMin(64, width - x), tileHeight,
+						left, right);
+			}
+		}
+	}
+}
+
+void QFreeRdpTest::tileCompareTestHash() {
+	const int width = 64;
+	const int height = 64;
+	const int stride = width * BYTES_PER_PIXEL;
+	QVector<uchar> tile(stride * height);
+	fillPseudoRandom(tile, 7);
+
+	const quint64 h = QFreeRdpTileComparator::hash(tile.constData(), stride, width, height);
+	QCOMPARE(QFreeRdpTileComparator::hash(tile.constData(), stride, width, height), h);
+
+	// the same content with a different stride has the same hash
+	const int largeStride = stride + 64;
+	QVector<uchar> larger(largeStride * height);
+	for (int y = 0; y < height; y++)
+		memcpy(larger.data() + y * largeStride, tile.constData() + y * stride, stride);
+	QCOMPARE(QFreeRdpTileComparator::hash(larger.constData(), largeStride, width, height), h);
+
+	// any single bit change is detected, including in the tail of odd sized tiles
+	const int oddWidth = 63;
+	const quint64 oddHash = QFreeRdpTileComparator::hash(tile.constData(), stride, oddWidth, height);
+	for (int y = 0; y < height; y += 9) {
+		for (int x = 0; x < oddWidth * BYTES_PER_PIXEL; x += 13) {
+			tile[y * stride + x] ^= 0x10;
+			QVERIFY(QFreeRdpTileComparator::hash(tile.constData(), stride, width, height) != h);
+			QVERIFY(QFreeRdpTileComparator::hash(tile.constData(), stride, oddWidth, height) != oddHash);
+			tile[y * stride + x] ^= 0x10;
+		}
+	}
+
+	// swapping two rows changes the hash
+	QVector<uchar> swapped = tile;
+	memcpy(swapped.data(), tile.constData() + stride, stride);
+	memcpy(swapped.data() + stride, tile.constData(), stride);
+	QVERIFY(QFreeRdpTileComparator::hash(swapped.constData(), stride, width, height) != h);
+}
+
+#endif // BUILD_TESTS
+
+QT_END_NAMESPACE
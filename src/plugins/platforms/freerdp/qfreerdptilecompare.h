@@ -0,0 +1,103 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __QFREERDPTILECOMPARE_H__
+#define __QFREERDPTILECOMPARE_H__
+
+#include <QtGlobal>
+
+QT_BEGIN_NAMESPACE
+
+/**
+ * @brief compare and update kernels used by the compositor
+ *
+ * A kernel compares up to 64 rows of a tile of 32 bits pixels against
+ * the shadow copy of the previous frame. Modified rows are copied in the
+ * shadow in the same pass, unmodified rows are never written. The result is
+ * a bitmask where bit N is set if the row N of the tile has been modified,
+ * with the first and last modified columns it gives the exact bounds of the
+ * change inside the tile.
+ *
+ * The best implementation for the running CPU is picked once at startup.
+ */
+class QFreeRdpTileComparator {
+public:
+	/** @brief available kernel implementations */
+	enum Implementation {
+		IMPL_SCALAR,
+		IMPL_SSE2,
+		IMPL_AVX2,
+	};
+
+	/**
+	 * @param src first pixel of the tile in the screen image
+	 * @param srcStride stride of the screen image
+	 * @param shadow first pixel of the tile in the shadow image
+	 * @param shadowStride stride of the shadow image
+	 * @param width width of the tile in pixels
+	 * @param height height of the tile in pixels (at most 64)
+	 * @param left set to the first modified column, width if nothing changed
+	 * @param right set to the last modified column, -1 if nothing changed
+	 * @return the mask of modified rows
+	 */
+	typedef quint64 (*CompareFn)(const uchar *src, int srcStride, uchar *shadow, int shadowStride,
+			int width, int height, int &left, int &right);
+
+	/** @return the best implementation supported by the running CPU */
+	static Implementation best();
+
+	/** @return if the given implementation can run on this CPU */
+	static bool isSupported(Implementation impl);
+
+	/** @return the kernel for the given implementation, the scalar one if not supported */
+	static CompareFn kernel(Implementation impl);
+
+	/** @return the kernel for the best implementation */
+	static CompareFn kernel() { return kernel(best()); }
+
+	/** @return a printable name for the implementation */
+	static const char *name(Implementation impl);
+
+	/**
+	 * Computes a 64 bits hash of the content of a tile, in the spirit of
+	 * XXH64. Hashes of tiles of different sizes must not be compared.
+	 *
+	 * @param src first pixel of the tile
+	 * @param stride stride of the image
+	 * @param width width of the tile in pixels
+	 * @param height height of the tile in pixels
+	 * @return the hash of the tile content
+	 */
+	static quint64 hash(const uchar *src, int stride, int width, int height);
+
+	/**
+	 * Checks if all the pixels of an area have the same color, the scan stops
+	 * at the first different pixel.
+	 *
+	 * @param color receives the color of the area when it is solid
+	 * @return if the area is made of a single color
+	 */
+	static bool isSolid(const uchar *src, int stride, int width, int height, quint32 &color);
+};
+
+QT_END_NAMESPACE
+
+#endif // __QFREERDPTILECOMPARE_H__
@@ -52,7 +52,8 @@ QFreeRdpWindow::QFreeRdpWindow(QWindow *window, QFreeRdpPlatform *platform) :
 	switch (window->type()) {
 	case Qt::Dialog:
 		this->center();
-		setDecorate(true);
+		if (!platform->config()->rail_enabled)
+			setDecorate(true);
 		break;
 	default:
 		break;
@@ -179,6 +180,10 @@ void QFreeRdpWindow::setWindowTitle(const QString &title)
 	QPlatformWindow::setWindowTitle(title);
 	if (mDecorations)
 		mDecorations->setTitle(title);
+
+	// RemoteApp peers send the new title with the next frame
+	if (mPlatform->config()->rail_enabled)
+		notifyDirty(outerWindowGeometry());
 }
 
 QRect QFreeRdpWindow::outerWindowGeometry()const
@@ -165,7 +165,9 @@ QFreeRdpWindowManager::QFreeRdpWindowManager(QFreeRdpPlatform *platform, int fps
 , mFps(fps)
 , mDraggingType(WmWidget::DRAGGING_NONE)
 , mDraggedWindow(nullptr)
+, mCompositor(platform->getScreen(), platform->config()->damageMode, platform->config()->motion_enabled)
 {
+	mCompositor.setWorkerThreads(platform->config()->damage_threads);
 	connect(&mFrameTimer, &QTimer::timeout, this, &QFreeRdpWindowManager::onGenerateFrame);
 }
 
@@ -197,7 +199,9 @@ void QFreeRdpWindowManager::addWindow(QFreeRdpWindow *window) {
 
 	// rootWindow(mWinId==1) is our original page, where we don't want any decorations
 	// Any other window is fair game.
-	if (window->winId() != mPlatform->config()->rootWindow && isDecorableWindow(qwindow)) {
+	// with RemoteApp the client draws the frames of the windows
+	if (!mPlatform->config()->rail_enabled && window->winId() != mPlatform->config()->rootWindow &&
+			isDecorableWindow(qwindow)) {
 		qDebug("WM activating windows decorations");
 		mDecoratedWindows++;
 		dirtyRegion = window->screen()->geometry();
@@ -220,7 +224,7 @@ void QFreeRdpWindowManager::dropWindow(QFreeRdpWindow *window) {
 	if (deco == mEnteredWidget)
 		mEnteredWidget = nullptr;
 
-	if (window->winId() > 1 && isDecorableWindow(window->window())) {
+	if (!mPlatform->config()->rail_enabled && window->winId() > 1 && isDecorableWindow(window->window())) {
 		qDebug("WM desactivating windows decorations");
 		mDecoratedWindows--;
 	}
@@ -285,6 +289,21 @@ void QFreeRdpWindowManager::repaint(const QRegion &region) {
 
 	//qDebug() << "dirtyRegion=" << dirtyRegion;
 
+	// windows that moved since the last frame are hints for the compositor
+	QFreeRdpMoveList moveHints;
+	QHash<QFreeRdpWindow *, QRect> paintedGeometries;
+	foreach(QFreeRdpWindow *window, mWindows) {
+		if(!window->isVisible() || !window->windowContent())
+			continue;
+
+		QRect geometry = window->outerWindowGeometry();
+		auto it = mPaintedGeometries.constFind(window);
+		if (it != mPaintedGeometries.constEnd() && it->size() == geometry.size() && it->topLeft() != geometry.topLeft())
+			moveHints.append({ *it, geometry.topLeft() });
+		paintedGeometries.insert(window, geometry);
+	}
+	mPaintedGeometries = paintedGeometries;
+
 	foreach(QFreeRdpWindow *window, mWindows) {
 		if(!window->isVisible() || !window->windowContent())
 			continue;
@@ -327,7 +346,12 @@ void QFreeRdpWindowManager::repaint(const QRegion &region) {
 		qimage_fillrect(repaintRect, dest, 0);
 	}
 
-	mPlatform->repaint(dirtyRegion);
+	// the effective damage is computed once for all the peers
+	quint32 generation = mCompositor.generation();
+	mCompositor.qtToRdpDirtyRegion(dirtyRegion, moveHints);
+	// RemoteApp peers also need the changes that don't show on the screen
+	if (mCompositor.generation() != generation || mPlatform->config()->rail_enabled)
+		mPlatform->repaint();
 }
 
 
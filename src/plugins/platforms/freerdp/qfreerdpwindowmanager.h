@@ -22,12 +22,15 @@
 #ifndef __QFREERDPWINDOWMANAGER_H___
 #define __QFREERDPWINDOWMANAGER_H___
 
+#include <QHash>
 #include <QList>
 #include <QRect>
 #include <QRegion>
 #include <QTimer>
 #include <wmwidgets/wmwidget.h>
 
+#include "qfreerdpcompositor.h"
+
 QT_BEGIN_NAMESPACE
 
 class QFreeRdpWindow;
@@ -77,6 +80,9 @@ public:
 	typedef QList<QFreeRdpWindow *> QFreeRdpWindowList;
     QFreeRdpWindowList const *getAllWindows() const { return &mWindows; }
 
+	/** @return the compositor computing the damage shared by all peers */
+	const QFreeRdpCompositor *compositor() const { return &mCompositor; }
+
 public slots:
 	void onStartDragging(WmWidget::DraggingType dragType, QFreeRdpWindow *window);
 
@@ -97,6 +103,8 @@ protected:
 
 	QTimer mFrameTimer;
 	QRegion mDirtyRegion;
+	QFreeRdpCompositor mCompositor;
+	QHash<QFreeRdpWindow *, QRect> mPaintedGeometries;
 };
 
 
@@ -0,0 +1,460 @@
+/*
+ * Copyright © 2023 Rubycat <support@rubycat.eu>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmarks of the damage pipeline: synthetic workloads are painted in the
+ * screen image the way the window manager composes windows, then the shared
+ * compositor computes the damage and two damage trackers play the peers (one
+ * using moves and fills, one receiving plain bitmaps).
+ *
+ * Each line reports for a workload, a resolution and a damage mode:
+ * - ns/pixel: time of the pipeline per pixel announced by Qt, best of the runs
+ * - dirty%: area sent as bitmaps over the area announced by Qt
+ * - moves, fills: average number per frame
+ * - allocs/frame: heap allocations per frame in the pipeline
+ *
+ * A second table compares, for the damage of the plain peer, the size of the
+ * surface bits sent raw and with NSCodec:
+ * - raw KB/frame: size of the raw bitmaps per frame
+ * - nsc1%, nsc3%: size with NSCodec at color loss levels 1 and 3 (with
+ *   subsampling) over the raw size
+ * - ns/pixel: encoding time of NSCodec at level 3 per pixel, best of the runs
+ *
+ * Everything but the timings is deterministic, so the output can be diffed
+ * between two builds.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+
+#include <winpr/stream.h>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QPair>
+#include <QScopedPointer>
+#include <QVector>
+
+#include "qfreerdpcompositor.h"
+#include "qfreerdpencoder.h"
+#include "qfreerdpscreen.h"
+
+#include "allocationcounter.h"
+
+QT_BEGIN_NAMESPACE
+
+/** @brief a deterministic pseudo random generator, for stable workloads */
+class BenchRandom {
+public:
+	explicit BenchRandom(quint32 seed) : mState(seed) {}
+
+	quint32 next() {
+		mState = mState * 1664525 + 1013904223;
+		return mState;
+	}
+
+protected:
+	quint32 mState;
+};
+
+/** @brief a synthetic workload, painting a frame like the window manager would */
+class BenchWorkload {
+public:
+	explicit BenchWorkload(const QSize &size) : mSize(size), mRandom(42) {}
+	virtual ~BenchWorkload() {}
+
+	/** Paints the initial content of the screen */
+	virtual void setup(QImage &screen) = 0;
+
+	/**
+	 * Paints the next frame
+	 *
+	 * @param screen the screen image
+	 * @param hints receives the window moves, like the window manager finds them
+	 * @return the region that Qt would announce
+	 */
+	virtual QRegion step(QImage &screen, QFreeRdpMoveList &hints) = 0;
+
+protected:
+	/** a window in the middle of the screen */
+	QRect windowRect() const {
+		return QRect(mSize.width() / 4, mSize.height() / 8, mSize.width() / 2, (mSize.height() * 3) / 4);
+	}
+
+	void fill(QImage &image, const QRect &rect, quint32 color) {
+		for (int y = rect.top(); y <= rect.bottom(); y++) {
+			quint32 *line = (quint32 *)image.scanLine(y);
+			std::fill(line + rect.left(), line + rect.right() + 1, color);
+		}
+	}
+
+	/** draws a glyph like block of dark pixels on the given background */
+	void drawGlyph(QImage &image, const QPoint &pos, quint32 background) {
+		quint32 shape = mRandom.next();
+		for (int y = 0; y < 14; y++) {
+			quint32 *line = (quint32 *)image.scanLine(pos.y() + y) + pos.x();
+			for (int x = 0; x < 8; x++)
+				line[x] = (shape >> ((x + y * 3) & 31)) & 1 ? 0xff202020 : background;
+		}
+	}
+
+	QSize mSize;
+	BenchRandom mRandom;
+};
+
+/** @brief a character typed per frame in a text editor, Qt announces the whole window */
+class TypingWorkload : public BenchWorkload {
+public:
+	using BenchWorkload::BenchWorkload;
+
+	void setup(QImage &screen) override {
+		fill(screen, screen.rect(), 0xff3c6e91);
+		fill(screen, windowRect(), 0xffffffff);
+		mCaret = windowRect().topLeft() + QPoint(8, 8);
+	}
+
+	QRegion step(QImage &screen, QFreeRdpMoveList &) override {
+		QRect window = windowRect();
+		drawGlyph(screen, mCaret, 0xffffffff);
+
+		mCaret.rx() += 9;
+		if (mCaret.x() + 8 > window.right() - 8) {
+			mCaret.setX(window.left() + 8);
+			mCaret.ry() += 18;
+			if (mCaret.y() + 14 > window.bottom() - 8)
+				mCaret.setY(window.top() + 8);
+		}
+		return QRegion(window);
+	}
+
+protected:
+	QPoint mCaret;
+};
+
+/** @brief a text view scrolled by a line per frame */
+class ScrollingWorkload : public BenchWorkload {
+public:
+	using BenchWorkload::BenchWorkload;
+
+	void setup(QImage &screen) override {
+		fill(screen, screen.rect(), 0xff3c6e91);
+		fill(screen, windowRect(), 0xffffffff);
+		for (int y = windowRect().top() + 2; y + 18 < windowRect().bottom(); y += 18)
+			drawLine(screen, y);
+	}
+
+	QRegion step(QImage &screen, QFreeRdpMoveList &) override {
+		QRect window = windowRect();
+		QFreeRdpMotionEstimator::applyMove(screen, { window.adjusted(0, 18, 0, 0), window.topLeft() });
+		fill(screen, QRect(window.left(), window.bottom() - 17, window.width(), 18), 0xffffffff);
+		drawLine(screen, window.bottom() - 16);
+		return QRegion(window);
+	}
+
+protected:
+	void drawLine(QImage &screen, int y) {
+		QRect window = windowRect();
+		int end = window.left() + 8 + (mRandom.next() % (window.width() - 24));
+		for (int x = window.left() + 8; x + 8 < end; x += 9)
+			drawGlyph(screen, QPoint(x, y), 0xffffffff);
+	}
+};
+
+/** @brief a video playing in a quarter of the screen */
+class VideoWorkload : public BenchWorkload {
+public:
+	using BenchWorkload::BenchWorkload;
+
+	void setup(QImage &screen) override {
+		fill(screen, screen.rect(), 0xff3c6e91);
+	}
+
+	QRegion step(QImage &screen, QFreeRdpMoveList &) override {
+		QRect video(mSize.width() / 4, mSize.height() / 4, mSize.width() / 2, mSize.height() / 2);
+		for (int y = video.top(); y <= video.bottom(); y++) {
+			quint32 *line = (quint32 *)screen.scanLine(y);
+			for (int x = video.left(); x <= video.right(); x++)
+				line[x] = 0xff000000 | (mRandom.next() >> 8);
+		}
+		return QRegion(video);
+	}
+};
+
+/** @brief a window dragged over a patterned desktop */
+class DragWorkload : public BenchWorkload {
+public:
+	using BenchWorkload::BenchWorkload;
+
+	void setup(QImage &screen) override {
+		mDesktop = QImage(mSize, QImage::Format_ARGB32_Premultiplied);
+		for (int y = 0; y < mSize.height(); y++) {
+			quint32 *line = (quint32 *)mDesktop.scanLine(y);
+			for (int x = 0; x < mSize.width(); x++)
+				line[x] = 0xff000000 | ((x * 3) & 0xff) << 16 | ((y * 5) & 0xff) << 8 | ((x ^ y) & 0xff);
+		}
+
+		mWindow = QImage(mSize / 3, QImage::Format_ARGB32_Premultiplied);
+		mWindow.fill(0xffffffff);
+		for (int y = 8; y + 14 < mWindow.height(); y += 18)
+			for (int x = 8; x + 8 < mWindow.width(); x += 9)
+				drawGlyph(mWindow, QPoint(x, y), 0xffffffff);
+
+		mGeometry = QRect(QPoint(16, 16), mWindow.size());
+		screen = mDesktop.copy();
+		blit(screen, mWindow, mGeometry.topLeft());
+	}
+
+	QRegion step(QImage &screen, QFreeRdpMoveList &hints) override {
+		QRect previous = mGeometry;
+		QPoint delta(7, 3);
+		if (!QRect(QPoint(0, 0), mSize).contains(mGeometry.translated(delta)))
+			delta = -mGeometry.topLeft() + QPoint(16, 16);
+		mGeometry.translate(delta);
+
+		for (const QRect &exposed : QRegion(previous) - mGeometry)
+			blit(screen, mDesktop.copy(exposed), exposed.topLeft());
+		blit(screen, mWindow, mGeometry.topLeft());
+
+		hints.append({ previous, mGeometry.topLeft() });
+		return QRegion(previous) + mGeometry;
+	}
+
+protected:
+	void blit(QImage &dst, const QImage &src, const QPoint &pos) {
+		for (int y = 0; y < src.height(); y++)
+			memcpy(dst.scanLine(pos.y() + y) + pos.x() * 4, src.constScanLine(y), src.width() * 4);
+	}
+
+	QImage mDesktop;
+	QImage mWindow;
+	QRect mGeometry;
+};
+
+static BenchWorkload *createWorkload(const QString &name, const QSize &size) {
+	if (name == "typing")
+		return new TypingWorkload(size);
+	if (name == "scrolling")
+		return new ScrollingWorkload(size);
+	if (name == "video")
+		return new VideoWorkload(size);
+	if (name == "drag")
+		return new DragWorkload(size);
+	return nullptr;
+}
+
+static qint64 area(const QRegion &region) {
+	qint64 ret = 0;
+	for (const QRect &rect : region)
+		ret += qint64(rect.width()) * rect.height();
+	return ret;
+}
+
+/** @brief results of a run of a workload */
+struct BenchResult {
+	qint64 nsecs = 0;
+	qint64 announced = 0;
+	qint64 sent = 0;
+	quint64 allocations = 0;
+	int moves = 0;
+	int fills = 0;
+};
+
+static BenchResult runWorkload(const QString &name, const QSize &size, DamageMode mode, int frames) {
+	QFreeRdpScreen screen(nullptr, size.width(), size.height());
+	QFreeRdpCompositor compositor(&screen, mode, true);
+	QImage *bits = screen.getScreenBits();
+	QScopedPointer<BenchWorkload> workload(createWorkload(name, size));
+
+	QFreeRdpDamageTracker smartPeer, bitmapPeer;
+	QFreeRdpMoveList moves, hints;
+	QFreeRdpFillList fills;
+
+	workload->setup(*bits);
+	compositor.qtToRdpDirtyRegion(QRegion(bits->rect()));
+	smartPeer.update(compositor, &moves, &fills);
+	bitmapPeer.update(compositor);
+
+	BenchResult ret;
+	QElapsedTimer timer;
+	for (int frame = 0; frame < frames; frame++) {
+		hints.clear();
+		QRegion announced = workload->step(*bits, hints);
+
+		quint64 allocations = testHeapAllocations();
+		timer.start();
+
+		compositor.qtToRdpDirtyRegion(announced, hints);
+		QRegion dirty = smartPeer.update(compositor, &moves, &fills);
+		bitmapPeer.update(compositor);
+
+		ret.nsecs += timer.nsecsElapsed();
+		ret.allocations += testHeapAllocations() - allocations;
+		ret.announced += area(announced);
+		ret.sent += area(dirty);
+		ret.moves += moves.size();
+		ret.fills += fills.size();
+	}
+
+	return ret;
+}
+
+/** @brief sizes of the surface bits of a run of a workload */
+struct CodecResult {
+	qint64 nsecs = 0;
+	qint64 pixels = 0;
+	quint64 nsc1Bytes = 0;
+	quint64 nsc3Bytes = 0;
+};
+
+/** @return the size of the rect encoded with NSCodec, 0 on error */
+static size_t nscSize(const QImage &image, const QRect &rect, UINT32 colorLossLevel, bool subsampling) {
+	NSC_CONTEXT *nsc = QFreeRdpCodecContexts::local().nsc(rect.width(), rect.height(), colorLossLevel,
+			subsampling, false);
+	size_t capacity = QFreeRdpCodecContexts::nscMaxSize(rect.width(), rect.height());
+	std::unique_ptr<BYTE[]> buffer(new BYTE[capacity]);
+	wStream stream;
+	wStream *s = Stream_StaticInit(&stream, buffer.get(), capacity);
+	if (!nsc || !nsc_compose_message(nsc, s, image.constScanLine(rect.top()) + rect.left() * 4,
+			rect.width(), rect.height(), image.bytesPerLine()))
+		return 0;
+	return Stream_GetPosition(s);
+}
+
+static CodecResult runCodecs(const QString &name, const QSize &size, int frames) {
+	QFreeRdpScreen screen(nullptr, size.width(), size.height());
+	QFreeRdpCompositor compositor(&screen, DAMAGE_SHADOW_IMAGE, true);
+	QImage *bits = screen.getScreenBits();
+	QScopedPointer<BenchWorkload> workload(createWorkload(name, size));
+
+	QFreeRdpDamageTracker peer;
+	QFreeRdpMoveList hints;
+
+	workload->setup(*bits);
+	compositor.qtToRdpDirtyRegion(QRegion(bits->rect()));
+	peer.update(compositor);
+
+	CodecResult ret;
+	QElapsedTimer timer;
+	for (int frame = 0; frame < frames; frame++) {
+		hints.clear();
+		compositor.qtToRdpDirtyRegion(workload->step(*bits, hints), hints);
+		for (const QRect &rect : peer.update(compositor)) {
+			ret.pixels += qint64(rect.width()) * rect.height();
+			ret.nsc1Bytes += nscSize(*bits, rect, 1, false);
+
+			timer.start();
+			ret.nsc3Bytes += nscSize(*bits, rect, 3, true);
+			ret.nsecs += timer.nsecsElapsed();
+		}
+	}
+
+	return ret;
+}
+
+QT_END_NAMESPACE
+
+int main(int argc, char **argv) {
+	QCoreApplication app(argc, argv);
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("qfreerdp damage pipeline benchmarks");
+	parser.addHelpOption();
+	QCommandLineOption framesOption("frames", "number of frames per run", "count", "120");
+	QCommandLineOption runsOption("runs", "number of runs, the best time is kept", "count", "3");
+	QCommandLineOption workloadOption("workload", "only run this workload: typing, scrolling, video or drag", "name");
+	QCommandLineOption resolutionOption("resolution", "only run this resolution, like 1920x1080", "size");
+	parser.addOptions({ framesOption, runsOption, workloadOption, resolutionOption });
+	parser.process(app);
+
+	const int frames = qMax(1, parser.value(framesOption).toInt());
+	const int runs = qMax(1, parser.value(runsOption).toInt());
+
+	const QStringList workloads = { "typing", "scrolling", "video", "drag" };
+	const QVector<QSize> resolutions = { QSize(1280, 720), QSize(1920, 1080), QSize(3840, 2160) };
+	const QVector<QPair<DamageMode, const char *>> modes = {
+		{ DAMAGE_SHADOW_IMAGE, "shadow" },
+		{ DAMAGE_TILE_HASH, "hash" },
+	};
+
+	printf("%-10s %-10s %-7s %10s %8s %7s %7s %13s\n",
+			"workload", "resolution", "damage", "ns/pixel", "dirty%", "moves", "fills", "allocs/frame");
+
+	for (const QString &workload : workloads) {
+		if (parser.isSet(workloadOption) && parser.value(workloadOption) != workload)
+			continue;
+
+		for (const QSize &size : resolutions) {
+			QString resolution = QString("%1x%2").arg(size.width()).arg(size.height());
+			if (parser.isSet(resolutionOption) && parser.value(resolutionOption) != resolution)
+				continue;
+
+			for (const auto &mode : modes) {
+				BenchResult best;
+				for (int run = 0; run < runs; run++) {
+					BenchResult result = runWorkload(workload, size, mode.first, frames);
+					if (run == 0 || result.nsecs < best.nsecs)
+						best = result;
+				}
+
+				printf("%-10s %-10s %-7s %10.3f %8.2f %7.2f %7.2f %13.1f\n",
+						qPrintable(workload), qPrintable(resolution), mode.second,
+						double(best.nsecs) / qMax<qint64>(best.announced, 1),
+						(100.0 * best.sent) / qMax<qint64>(best.announced, 1),
+						double(best.moves) / frames, double(best.fills) / frames,
+						double(best.allocations) / frames);
+			}
+		}
+	}
+
+	printf("\n%-10s %-10s %13s %7s %7s %10s\n",
+			"workload", "resolution", "raw KB/frame", "nsc1%", "nsc3%", "ns/pixel");
+
+	for (const QString &workload : workloads) {
+		if (parser.isSet(workloadOption) && parser.value(workloadOption) != workload)
+			continue;
+
+		for (const QSize &size : resolutions) {
+			QString resolution = QString("%1x%2").arg(size.width()).arg(size.height());
+			if (parser.isSet(resolutionOption) && parser.value(resolutionOption) != resolution)
+				continue;
+
+			CodecResult best;
+			for (int run = 0; run < runs; run++) {
+				CodecResult result = runCodecs(workload, size, frames);
+				if (run == 0 || result.nsecs < best.nsecs)
+					best = result;
+			}
+
+			double raw = 4.0 * qMax<qint64>(best.pixels, 1);
+			printf("%-10s %-10s %13.1f %7.2f %7.2f %10.3f\n",
+					qPrintable(workload), qPrintable(resolution), raw / frames / 1024,
+					(100.0 * best.nsc1Bytes) / raw, (100.0 * best.nsc3Bytes) / raw,
+					double(best.nsecs) / qMax<qint64>(best.pixels, 1));
+		}
+	}
+
+	return 0;
+}
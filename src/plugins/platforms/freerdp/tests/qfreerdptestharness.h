@@ -10,4 +10,42 @@ private slots:
     void windowManagerTestValidateGeometry();
     void windowManagerTestWindowResize_data();
     void windowManagerTestWindowResize();
+    void tileCompareTestKernels_data();
+    void tileCompareTestKernels();
+    void tileCompareBenchmark_data();
+    void tileCompareBenchmark();
+    void tileCompareTestHash();
+    void tileBitmapTestConversions();
+    void tileBitmapTestRegion();
+    void tileBitmapBenchmark_data();
+    void tileBitmapBenchmark();
+    void tileClassifierTestClassify();
+    void compositorTestDamage_data();
+    void compositorTestDamage();
+    void compositorTestBandedRegion();
+    void compositorTestDamageTracker();
+    void compositorTestChangingRegion();
+    void compositorTestSolidFills();
+    void compositorBenchmarkDirtyTiles_data();
+    void compositorBenchmarkDirtyTiles();
+    void compositorTestParallel_data();
+    void compositorTestParallel();
+    void compositorTestMoves_data();
+    void compositorTestMoves();
+    void egfxCacheTestLru();
+    void egfxCacheTestTileKey();
+    void encoderTestRun_data();
+    void encoderTestRun();
+    void encoderTestProgress();
+    void encoderTestRemoteFx();
+    void encoderTestScratchArena();
+    void encoderTestWarmRun();
+    void encoderTestWarmBitmapUpdate();
+    void bandwidthTestEstimate();
+    void bandwidthTestSources();
+    void bandwidthTestOutlier();
+    void motionTestVerticalScroll_data();
+    void motionTestVerticalScroll();
+    void motionTestHorizontalScroll();
+    void motionTestVerifyMove();
 };